@@ -9,6 +9,14 @@
 #include "log.h"
 #include "xsevcnn.h"
 #include "xstnt16.h"
+#include "reqtable.h"
+#include "ctxpool.h"
+#include "deadlines.h"
+#include "batch.h"
+#include "stream.h"
+#include "rbufpool.h"
+#include "prepared.h"
+#include "schema.h"
 
 #if __GNUC__ >= 3
 # define INLINE static inline
@@ -28,6 +36,14 @@
 #  define TNT_WBUF_LIMIT 16384
 #endif
 
+#ifndef TNT_CORK_INITIAL
+#  define TNT_CORK_INITIAL 16384
+#endif
+
+#ifndef TNT_CORK_KEEP
+#  define TNT_CORK_KEEP (1024*1024)
+#endif
+
 typedef struct {
 	xs_ev_cnn_struct;
 
@@ -42,20 +58,70 @@ typedef struct {
 	uint32_t pending;
 	uint32_t seq;
 	U32      use_hash;
-	HV      *reqs;
+	U32      compact;
+	TntReqs  reqs;
+	TntCtxPool ctxs;
+	TntDeadlines deadlines;
 	HV      *spaces;
+	uint32_t schema_gen; /* bumped whenever the spaces are dropped or reloaded */
+	uint32_t schema_id;  /* server schema_id the spaces were loaded at, 0 if unknown */
+	HV      *kept_spaces;    /* spaces of the last connection, reused if schema_id still matches */
+	uint32_t kept_schema_id;
+	SV      *schema_file;    /* schema_cache option */
+	SV      *schema_body;    /* _vspace reply body, saved along with the _vindex one */
+	U32      schema_retry;   /* repeat requests rejected for a stale schema_id */
+	uint32_t reload_sync;    /* select of the schema reload in progress, 0 if none */
+	uint32_t reload_schema_id;
+	HV      *reload_spaces;  /* spaces of the reload, waiting for _vindex */
+	AV      *schema_queue;   /* calls waiting for the reload: [ space name or undef, CV, args... ] each */
+	I32      replaying;
+	U32      share_schema;   /* share_schema option, see schema_share */
+	SV      *cluster;        /* cluster uuid, if share_schema could read it */
+	uint32_t hs_auth;        /* handshake requests still unanswered, see on_greet_read */
+	uint32_t hs_cluster;
+	uint32_t hs_spaces;
+	uint32_t hs_index;
+	uint32_t hs_schema_id;   /* schema_id of the auth and cluster replies */
+	uint32_t hs_index_schema_id;
+	SV      *hs_index_body;  /* _vindex reply, decoded when the handshake is complete */
+	U32      hs_early;       /* selects answered before auth */
+	U32      hs_shared;      /* _vspace reply skipped for a shared schema */
+	U32      lazy;           /* spaces option: spaces are looked up on use */
+	AV      *preload;        /* names given to the spaces option */
+	HV      *lookups;        /* names being looked up, see lookup_start */
+	HV      *lookup_missing; /* names just found missing, while their calls fail */
+	uint32_t preload_left;   /* lookups of the spaces option that connected waits for */
 	SV      *username;
 	SV      *password;
 	uint8_t  log_level;
 	uint32_t wbuf_limit;
+
+	SV      *cork_buf;  /* requests held back by cork/autocork */
+	uint32_t corked;    /* nesting depth of explicit cork() calls */
+	uint32_t cork_n;    /* requests in cork_buf, held to wbuf_limit */
+	U32      autocork;
+	U32      handshake; /* TNT_HS_*: handshake writes ignore cork and autocork */
+	ev_prepare flush_w;
+
+	TntStream *streams; /* replies being delivered with on_chunk */
+	SV        *big;     /* reply larger than the read buffer, being reassembled */
+	uint32_t   big_size;
+
+	U32         shared_rbuf;
+	TntRbufUser rb;
+	char        head[5];  /* partial length prefix left by a read into the shared buffer */
+	uint8_t     head_len;
 } TntCnn;
 
 // static const uint32_t _SPACE_SPACEID = 280;
 // static const uint32_t _INDEX_SPACEID = 288;
 
+static const uint32_t _SCHEMA_SPACEID = 272;
 static const uint32_t _VSPACE_SPACEID = 281;
 static const uint32_t _VINDEX_SPACEID = 289;
 
+static char lookup_call[] = "lookup"; /* ctx->call of lookups, see lookup_start */
+
 // static const char *_SPACE_SELECTOR = "return unpack(box.space._space:select{})";
 // static const char *_INDEX_SELECTOR = "return unpack(box.space._index:select{})";
 // static const size_t SELECTOR_STR_LENGTH = 40;
@@ -65,7 +131,7 @@ void tnt_on_connected_cb(ev_cnn *cnn, struct sockaddr *peer) {
 	if (likely(peer != NULL)) {
 		self->peer_info = *peer;
 	}
-	self->spaces = newHV();
+	self->spaces = spaces_new();
 	do_enable_rw_timer((ev_cnn *) self);
 }
 
@@ -77,23 +143,25 @@ INLINE void force_disconnect(TntCnn *self, const char *reason) {
 	on_connect_reset(&self->cnn, 0, reason);
 }
 
-static void on_request_timer(EV_P_ ev_timer *t, int flags) {
-	TntCtx *ctx = (TntCtx *) t;
+static void on_request_timer(TntCtx *ctx) {
 	TntCnn *self = (TntCnn *) ctx->self;
 	// log_warn(self->log_level, "timer called on %p: %s", ctx, ctx->call);
 	ENTER;SAVETMPS;
 	dSP;
 
-	(void) hv_delete( self->reqs, (char *) &ctx->id, sizeof(ctx->id),0);
+	(void) reqs_take(&self->reqs, ctx->id);
+	int reload_failed = ctx->id == self->reload_sync;
+	int handshake_failed = ctx->id == self->hs_auth || ctx->id == self->hs_spaces || ctx->id == self->hs_index;
+	int lookup_failed = ctx->call == lookup_call;
 
-	// ev_timer_stop(self->cnn.loop, &ctx->t);
 	// do_disable_rw_timer(&self->cnn);
-	SvREFCNT_dec(ctx->wbuf);
-	if (ctx->f.size && !ctx->f.nofree) {
-		safefree(ctx->f.f);
-	}
 
-	if (ctx->cb) {
+	SV *cb = ctx->cb;
+	TntBatch *batch = ctx->batch;
+	uint32_t batch_idx = ctx->batch_idx;
+	ctx_release(&self->ctxs, ctx);
+
+	if (cb) {
 		SPAGAIN;
 		ENTER; SAVETMPS;
 
@@ -103,24 +171,35 @@ static void on_request_timer(EV_P_ ev_timer *t, int flags) {
 		PUSHs( sv_2mortal(newSVpvf("Request timed out")) );
 		PUTBACK;
 
-		(void) call_sv( ctx->cb, G_DISCARD | G_VOID );
+		(void) call_sv( cb, G_DISCARD | G_VOID );
 
 		//SPAGAIN;PUTBACK;
 
-		SvREFCNT_dec(ctx->cb);
+		SvREFCNT_dec(cb);
 
 		FREETMPS; LEAVE;
 	}
 
+	if (batch) {
+		batch_store(batch, batch_idx, NULL, newSVpvs("Request timed out"));
+	}
+
 	--self->pending;
 
+	if (unlikely(reload_failed)) {
+		force_disconnect(self, "Couldn\'t reload schema: request timed out");
+	} else if (unlikely(handshake_failed)) {
+		force_disconnect(self, "Handshake timed out");
+	} else if (unlikely(lookup_failed)) {
+		force_disconnect(self, "Couldn\'t look up space: request timed out");
+	}
+
 	FREETMPS;LEAVE;
 }
 
 #define TIMEOUT_TIMER(self, ctx, iid, timeout) STMT_START { \
 	if (timeout > 0) { \
-		ev_timer_init(&ctx->t, on_request_timer, timeout, 0.); \
-		ev_timer_start(self->cnn.loop, &ctx->t); \
+		deadline_schedule(&self->deadlines, ctx, timeout); \
 	} \
 } STMT_END
 
@@ -137,23 +216,151 @@ static void on_request_timer(EV_P_ ev_timer *t, int flags) {
 	TIMEOUT_TIMER(self, ctx, iid, timeout); \
 } STMT_END
 
-#define __EXEC_REQUEST(self, ctxsv, ctx, iid, _cb) STMT_START { \
+#define TNT_HS_BATCH  1 /* collecting the requests sent after the greeting */
+#define TNT_HS_DIRECT 2 /* handshake in progress, requests go out at once */
+
+/*
+ * A nested request (from magic) got to cork_buf while another request is
+ * being appended to it: leave that buffer to the request in progress and go
+ * on with a copy of the held requests.
+ */
+static void cork_detach(TntCnn *self) {
+	SV *held = self->cork_buf;
+	self->cork_buf = newSVpvn(SvPVX(held), SvCUR(held));
+	SvREFCNT_dec(held);
+}
+
+/*
+ * Sends all corked requests with a single do_write.
+ */
+static void cork_flush(TntCnn *self) {
+	if (ev_is_active(&self->flush_w)) {
+		ev_prepare_stop(self->cnn.loop, &self->flush_w);
+	}
+	if (!self->cork_buf || !SvCUR(self->cork_buf)) return;
+	if (unlikely(encbuf_building(self->cork_buf))) cork_detach(self);
+
+	do_write(&self->cnn, SvPVX(self->cork_buf), SvCUR(self->cork_buf));
+	SvCUR_set(self->cork_buf, 0);
+	self->cork_n = 0;
+	if (unlikely(SvLEN(self->cork_buf) > TNT_CORK_KEEP)) {
+		SvREFCNT_dec(self->cork_buf);
+		self->cork_buf = NULL;
+	}
+}
+
+INLINE void cork_discard(TntCnn *self) {
+	if (ev_is_active(&self->flush_w)) {
+		ev_prepare_stop(self->cnn.loop, &self->flush_w);
+	}
+	if (self->cork_buf) {
+		if (unlikely(encbuf_building(self->cork_buf))) {
+			SvREFCNT_dec(self->cork_buf);
+			self->cork_buf = NULL;
+		} else {
+			SvCUR_set(self->cork_buf, 0);
+		}
+	}
+	self->cork_n = 0;
+	self->corked = 0;
+}
+
+INLINE void cork_leave(TntCnn *self) {
+	if (self->corked && --self->corked == 0) {
+		cork_flush(self);
+	}
+}
+
+/* Runs right before the loop blocks, i.e. once all callbacks of the iteration are done */
+static void on_cork_prepare(EV_P_ ev_prepare *w, int revents) {
+	TntCnn *self = (TntCnn *) ((char *) w - offsetof(TntCnn, flush_w));
+	if (self->corked || self->handshake) {
+		/* explicit cork wins, uncork() will flush */
+		ev_prepare_stop(EV_A_ w);
+		return;
+	}
+	cork_flush(self);
+}
+
+/*
+ * While requests are held back, a new one is encoded right at the end of
+ * cork_buf (see encbuf_acquire), so it is copied only once, by do_write
+ * of the whole lot.
+ */
+static SV *tnt_wbuf(TntCtx *ctx) {
+	TntCnn *self = (TntCnn *) ctx->self;
+	if (unlikely(self->handshake)) {
+		if (self->handshake == TNT_HS_DIRECT) return NULL;
+	}
+	else if (likely(!self->corked && !self->autocork)) {
+		return NULL;
+	}
+	if (!self->cork_buf) {
+		self->cork_buf = newSV(TNT_CORK_INITIAL);
+		SvPOK_on(self->cork_buf);
+	}
+	return self->cork_buf;
+}
+
+INLINE void tnt_write(TntCnn *self, SV *pkt) {
+	if (pkt == self->cork_buf) {
+		/* already in place, see tnt_wbuf */
+		++self->cork_n;
+	} else {
+		STRLEN len;
+		char *p = encbuf_pkt(pkt, &len);
+
+		if (unlikely(self->handshake)) {
+			if (self->handshake == TNT_HS_DIRECT) {
+				do_write(&self->cnn, p, len);
+				return;
+			}
+		}
+		else if (likely(!self->corked && !self->autocork)) {
+			do_write(&self->cnn, p, len);
+			return;
+		}
+
+		if (!self->cork_buf) {
+			self->cork_buf = newSV(TNT_CORK_INITIAL);
+			SvPOK_on(self->cork_buf);
+		}
+		else if (unlikely(encbuf_building(self->cork_buf))) {
+			cork_detach(self);
+		}
+		sv_catpvn(self->cork_buf, p, len);
+		++self->cork_n;
+	}
+
+	if (!self->corked && !self->handshake && !ev_is_active(&self->flush_w)) {
+		ev_prepare_start(self->cnn.loop, &self->flush_w);
+	}
+}
+
+#define __EXEC_REQUEST(self, ctx, iid, pkt, _cb) STMT_START { \
 	SvREFCNT_inc(ctx->cb = (_cb)); \
-	(void) hv_store( self->reqs, (char *)&iid, sizeof(iid), SvREFCNT_inc(ctxsv), 0 ); \
+	if (ctx->space) ctx->spaces = (HV *) SvREFCNT_inc_NN(self->spaces); \
+	ctx_commit(&self->ctxs, ctx); \
+	reqs_put(&self->reqs, iid, ctx); \
 	++self->pending; \
-	do_write(&self->cnn,SvPVX(ctx->wbuf), SvCUR(ctx->wbuf)); \
+	tnt_write(self, pkt); \
+	encbuf_release(pkt); \
 } STMT_END
 
-#define EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, _cb) STMT_START { \
-	if ((ctx->wbuf = pkt)) { \
-		__EXEC_REQUEST(self, ctxsv, ctx, iid, _cb); \
+#define EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, _cb) STMT_START { \
+	if (pkt) { \
+		__EXEC_REQUEST(self, ctx, iid, pkt, _cb); \
 		INIT_TIMEOUT_TIMER(self, ctx, iid, opts); \
+	} else { \
+		ctx_release(&self->ctxs, ctx); \
 	} \
 } STMT_END
 
-#define EXEC_REQUEST(self, ctxsv, ctx, iid, pkt, _cb) STMT_START { \
-	if ((ctx->wbuf = pkt)) { \
-		__EXEC_REQUEST(self, ctxsv, ctx, iid, _cb); \
+#define EXEC_REQUEST(self, ctx, iid, pkt, _cb) STMT_START { \
+	if (pkt) { \
+		__EXEC_REQUEST(self, ctx, iid, pkt, _cb); \
+	} else { \
+		ctx_release(&self->ctxs, ctx); \
 	} \
 } STMT_END
 
@@ -161,9 +368,60 @@ static void on_request_timer(EV_P_ ev_timer *t, int flags) {
 	ctx->self = _self; \
 	ctx->call = method; \
 	ctx->use_hash = _self->use_hash; \
+	ctx->compact = _self->compact; \
 	ctx->log_level = _self->log_level; \
 	iid = ++_self->seq; \
 	ctx->id = iid; \
+	ctx->schema_id = _self->schema_id; \
+} STMT_END
+
+/*
+ * An argument kept for a repeated call. Temporaries (anonymous arrays and
+ * subs, results of expressions) and read-only constants cannot change
+ * afterwards, so they are kept by reference; variables are copied.
+ */
+static inline SV *replay_arg(SV *sv) {
+	if ((SvTEMP(sv) && SvREFCNT(sv) == 1) || (SvREADONLY(sv) && !SvGMAGICAL(sv))) {
+		return SvREFCNT_inc_simple_NN(sv);
+	}
+	return newSVsv(sv);
+}
+
+/* Keeps the arguments of a call that depends on the schema, to repeat it if the server rejects its schema_id */
+#define CTX_REPLAY(self, ctx) STMT_START { \
+	if ((self)->schema_retry && !(self)->replaying && items < TNT_REPLAY_MAX) { \
+		int _i; \
+		(ctx)->replay[0] = SvREFCNT_inc_simple_NN((SV *) cv); \
+		for (_i = 0; _i < items; _i++) { \
+			(ctx)->replay[_i + 1] = replay_arg(ST(_i)); \
+		} \
+		(ctx)->replay_n = items + 1; \
+	} \
+} STMT_END
+
+/* While the schema is being reloaded, calls that depend on it wait for the new one */
+#define QUEUE_IF_RELOADING(self) STMT_START { \
+	if (unlikely((self)->reload_sync)) { \
+		schema_queue_call(self, NULL, cv, &ST(0), items); \
+		XSRETURN_UNDEF; \
+	} \
+} STMT_END
+
+/* With lazy spaces, calls that name a space not looked up yet wait for the lookup */
+#define QUEUE_IF_UNKNOWN(self, space) STMT_START { \
+	if (unlikely((self)->lazy) && space_unknown(self, space)) { \
+		schema_queue_call(self, space, cv, &ST(0), items); \
+		(void) lookup_start(self, space, 0); \
+		XSRETURN_UNDEF; \
+	} \
+} STMT_END
+
+/* Requests held back by cork count against wbuf_limit like the ones queued for writing */
+#define tnt_checkconn_wlimit(self, cb) STMT_START { \
+	xs_ev_cnn_checkconn_wlimit(self, cb, (self)->wbuf_limit); \
+	if (unlikely((self)->wbuf_limit && (self)->cork_n >= (self)->wbuf_limit)) { \
+		croak_cb_xsundef(cb, "Write buffer limit exceeded: %u requests corked", (self)->cork_n); \
+	} \
 } STMT_END
 
 #define croak_cb_xsundef(cb, ...) STMT_START { \
@@ -184,137 +442,234 @@ static void on_request_timer(EV_P_ ev_timer *t, int flags) {
 	} \
 } STMT_END
 
-INLINE void _execute_select(TntCnn *self, uint32_t space_id) {
-	dSVX(ctxsv, ctx, TntCtx);
-	sv_2mortal(ctxsv);
+/*
+ * Frames the next complete packet in the read buffer using its 5-byte length
+ * prefix: on success *rbuf points at the packet and *pkt_end right after it,
+ * so header and body are validated and decoded within the packet only.
+ */
+INLINE int tnt_next_packet(char **rbuf, char *end, char **pkt_end, uint32_t *pkt_length) {
+	if (end - *rbuf < 5) {
+		debug("not enough");
+		return 0;
+	}
+	decode_pkt_len_(rbuf, *pkt_length);
+	if ((uint64_t) (end - *rbuf - 5) < *pkt_length) {
+		debug("not enough");
+		return 0;
+	}
+	*rbuf += 5;
+	*pkt_end = *rbuf + *pkt_length;
+	return 1;
+}
+
+INLINE uint32_t _execute_select(TntCnn *self, uint32_t space_id, SV *keys) {
+	TntCtx *ctx = ctx_alloc(&self->ctxs);
 	uint32_t iid;
 
 	INIT_CTX(self, ctx, "select", iid);
-	SV *pkt = pkt_select(ctx, iid, self->spaces, sv_2mortal(newSVuv(space_id)), sv_2mortal(newRV_noinc((SV *) newAV())), NULL, NULL);
-	EXEC_REQUEST(self, ctxsv, ctx, iid, pkt, NULL);
+	ctx->schema_id = 0;
+	SV *pkt = pkt_select(ctx, iid, self->spaces, sv_2mortal(newSVuv(space_id)), keys ? keys : sv_2mortal(newRV_noinc((SV *) newAV())), NULL, NULL);
+	EXEC_REQUEST(self, ctx, iid, pkt, NULL);
 
-	TIMEOUT_TIMER(self, ctx, iid, self->cnn.rw_timeout);
+	if (pkt) {
+		TIMEOUT_TIMER(self, ctx, iid, self->cnn.rw_timeout);
+		return iid;
+	}
+	return 0;
 }
 
 
-static void on_read(ev_cnn *self, size_t len) {
-	ENTER;
-	SAVETMPS;
+/*
+ * Passes a reply to the request callback and to its batch, releasing the
+ * context: ($reply) on success, (undef, $errstr, $reply) on error.
+ */
+static void tnt_deliver(TntCnn *tnt, TntCtx *ctx, SV *reply, SV *errstr) {
+	SV *cb = ctx->cb;
+	TntBatch *batch = ctx->batch;
+	uint32_t batch_idx = ctx->batch_idx;
+	ctx_release(&tnt->ctxs, ctx);
 
-	do_disable_rw_timer(self);
-
-	TntCnn *tnt = (TntCnn *) self;
-	char *rbuf = self->rbuf;
-	char *end = rbuf + self->ruse;
-
-	dSP;
+	if (cb) {
+		dSP;
+		ENTER; SAVETMPS;
 
-	while ( rbuf < end ) {
-		/* len */
-		ptrdiff_t buf_len = end - rbuf;
-		if (buf_len < 5) {
-			//cwarn("buf_len < 5");
-			debug("not enough");
-			break;
+		PUSHMARK(SP);
+		EXTEND(SP, 3);
+		if (errstr) {
+			PUSHs( &PL_sv_undef );
+			PUSHs( sv_2mortal(newSVsv(errstr)) );
+		}
+		if (reply) {
+			PUSHs( sv_2mortal(newSVsv(reply)) );
 		}
+		PUTBACK;
 
-		uint32_t pkt_length;
-		decode_pkt_len_(&rbuf, pkt_length);
+		(void) call_sv(cb, G_DISCARD | G_VOID);
 
-		if (buf_len - 5 < pkt_length) {
-			//cwarn("not enough for a packet");
-			debug("not enough");
-			break;
-		}
-		rbuf += 5;
+		SvREFCNT_dec(cb);
 
-		HV *hv = (HV *) sv_2mortal((SV *) newHV());
+		FREETMPS; LEAVE;
+	}
 
-		/* header */
-		tnt_header_t hdr;
-		int hdr_length = parse_reply_hdr(hv, rbuf, buf_len, &hdr, tnt->log_level);
-		if (unlikely(hdr_length < 0)) {
-			TNT_CROAK("Unexpected response header");
-			return;
-		}
-		if (unlikely(hdr.id <= 0)) {
-			PE_CROAK("Wrong sync id (id <= 0)");
-			return;
-		}
+	if (batch) {
+		batch_store(batch, batch_idx, reply ? newSVsv(reply) : NULL, errstr ? newSVsv(errstr) : NULL);
+	}
+}
 
-		TntCtx *ctx;
-		SV *key = hv_delete(tnt->reqs, (char *) &hdr.id, sizeof(hdr.id), 0);
+/* Delivers the next chunk of a streamed reply, then the reply itself after the last one */
+static int stream_step(TntCnn *tnt, TntStream *s) {
+	ENTER; SAVETMPS;
 
-		if (!key) {
-			rbuf += pkt_length;
-			log_debug(tnt->log_level, "key %d not found", hdr.id);
-		} else {
-			rbuf += hdr_length;
+	if (s->left > 0) {
+		AV *tuples = stream_next_chunk(s);
 
-			ctx = (TntCtx *) SvPVX(key);
-			ev_timer_stop(self->loop, &ctx->t);
-			SvREFCNT_dec(ctx->wbuf);
-			if (ctx->f.size && !ctx->f.nofree) {
-				safefree(ctx->f.f);
-			}
+		dSP;
+		PUSHMARK(SP);
+		EXTEND(SP, 1);
+		PUSHs( sv_2mortal(newRV_noinc((SV *) tuples)) );
+		PUTBACK;
 
-			/* body */
+		(void) call_sv(s->ctx->on_chunk, G_DISCARD | G_VOID);
+	}
 
-			AV *fields = (ctx->space && ctx->use_hash) ? ctx->space->fields : NULL;
-			int body_length = parse_reply_body(ctx, hv, rbuf, buf_len, &ctx->f, fields);
-			if (unlikely(body_length <= 0)) {
-				rbuf += (pkt_length - hdr_length);
-				log_error(tnt->log_level, "Unexpected response body. length = %d", body_length);
-			} else {
-				rbuf += body_length;
-			}
+	int done = s->left == 0;
+	if (done) {
+		stream_unlink(&tnt->streams, s);
+		tnt_deliver(tnt, s->ctx, s->reply, NULL);
+		stream_free(s);
+	}
 
-			if (ctx->cb) {
-				SPAGAIN;
+	FREETMPS; LEAVE;
+	return done;
+}
 
-				ENTER; SAVETMPS;
+static void on_stream_timer(EV_P_ ev_timer *t, int flags) {
+	TntStream *s = (TntStream *) t;
+	if (!stream_step((TntCnn *) s->self, s)) {
+		ev_timer_start(EV_A_ t);
+	}
+}
 
-				SV **var = NULL;
-				if (hdr.code == 0) {
-					PUSHMARK(SP);
-					EXTEND(SP, 1);
-					PUSHs( sv_2mortal(newRV_noinc( SvREFCNT_inc_NN((SV *) hv) )) );
-					PUTBACK;
-				}
-				else {
-					var = hv_fetchs(hv,"errstr",0);
-					PUSHMARK(SP);
-					EXTEND(SP, 3);
-					PUSHs( &PL_sv_undef );
-					PUSHs( var && *var ? sv_2mortal(newSVsv(*var)) : &PL_sv_undef );
-					PUSHs( sv_2mortal(newRV_noinc( SvREFCNT_inc_NN((SV *) hv) )) );
-					PUTBACK;
-				}
+/* Delivers what is left of all streamed replies right away */
+static void streams_drain(TntCnn *tnt) {
+	while (tnt->streams) {
+		TntStream *s = tnt->streams;
+		ev_timer_stop(tnt->cnn.loop, &s->t);
+		while (!stream_step(tnt, s));
+	}
+}
 
-				(void) call_sv(ctx->cb, G_DISCARD | G_VOID);
+static void streams_abort(TntCnn *tnt, const char *message) {
+	ENTER; SAVETMPS;
+	while (tnt->streams) {
+		TntStream *s = tnt->streams;
+		ev_timer_stop(tnt->cnn.loop, &s->t);
+		stream_unlink(&tnt->streams, s);
+		tnt_deliver(tnt, s->ctx, NULL, sv_2mortal(newSVpv(message, 0)));
+		stream_free(s);
+	}
+	FREETMPS; LEAVE;
+}
 
-				//SPAGAIN;PUTBACK;
+typedef void (*tnt_reply_cb_t)(TntCnn *tnt, char *pkt, char *pkt_end);
+
+/*
+ * A reply that can't fit in the read buffer isn't kept there (nor is any
+ * partial reply when the buffer is shared, see rbufpool.h). Its bytes
+ * are moved into a separate buffer of exactly the packet size, and the
+ * read buffer is emptied on every read until the packet is complete. The
+ * read buffer can stay small and never has to grow for a rare huge reply.
+ */
+static inline int tnt_big_start(TntCnn *tnt, char *rbuf, char *end, int force) {
+	uint32_t pkt_length;
+	if (end - rbuf < 5) return 0;
+	decode_pkt_len_(&rbuf, pkt_length);
+	if (!force && (uint64_t) pkt_length + 5 <= tnt->cnn.rlen) return 0;
+
+	if (!force) log_debug(tnt->log_level, "reply of %u bytes exceeds the read buffer, reassembling", pkt_length);
+	tnt->big_size = pkt_length + 5;
+	tnt->big = newSV(tnt->big_size);
+	SvPOK_only(tnt->big);
+	memcpy(SvPVX(tnt->big), rbuf, end - rbuf);
+	SvCUR_set(tnt->big, end - rbuf);
+	return 1;
+}
 
-				SvREFCNT_dec(ctx->cb);
+/* Moves read bytes into the big reply, returns how many were taken */
+static inline size_t tnt_big_fill(TntCnn *tnt, char *rbuf, char *end) {
+	size_t want = tnt->big_size - SvCUR(tnt->big);
+	size_t take = (size_t) (end - rbuf) < want ? (size_t) (end - rbuf) : want;
+	memcpy(SvPVX(tnt->big) + SvCUR(tnt->big), rbuf, take);
+	SvCUR_set(tnt->big, SvCUR(tnt->big) + take);
+	return take;
+}
 
-				FREETMPS; LEAVE;
-			}
+static inline void tnt_big_discard(TntCnn *tnt) {
+	if (tnt->big) {
+		SvREFCNT_dec(tnt->big);
+		tnt->big = NULL;
+	}
+}
 
+/* Frames the replies in the read buffer and passes each one to on_reply */
+static void tnt_read(ev_cnn *self, tnt_reply_cb_t on_reply) {
+	ENTER;
+	SAVETMPS;
 
-			--tnt->pending;
+	do_disable_rw_timer(self);
 
-			if (rbuf == end) {
-				self->ruse = 0;
-				if (tnt->pending == 0) {
-					//do_disable_rw_timer(self);
-				}
-				else {
-					//do_enable_rw_timer(self);
-				}
-				break;
-			}
+	TntCnn *tnt = (TntCnn *) self;
+	char *start = self->rbuf;
+	char *rbuf = start;
+	char *end = rbuf + self->ruse;
+	int filled = self->ruse == self->rlen;
+
+	char *pkt_end;
+	uint32_t pkt_length;
+
+	rbuf_pool_enter(&tnt->rb);
+
+	if (tnt->head_len) {
+		size_t take = 5 - tnt->head_len;
+		if (take > (size_t) (end - rbuf)) take = end - rbuf;
+		memcpy(tnt->head + tnt->head_len, rbuf, take);
+		tnt->head_len += take;
+		rbuf += take;
+		if (tnt->head_len == 5) {
+			tnt_big_start(tnt, tnt->head, tnt->head + 5, 1);
+			tnt->head_len = 0;
 		}
+	}
+
+	if (tnt->big) {
+		rbuf += tnt_big_fill(tnt, rbuf, end);
+		if (SvCUR(tnt->big) < tnt->big_size) {
+			self->ruse = 0;
+			FREETMPS;
+			LEAVE;
+			return;
+		}
+		SV *big = sv_2mortal(tnt->big);
+		tnt->big = NULL;
+		on_reply(tnt, SvPVX(big) + 5, SvPVX(big) + SvCUR(big));
+	}
 
+	while ( tnt_next_packet(&rbuf, end, &pkt_end, &pkt_length) ) {
+		on_reply(tnt, rbuf, pkt_end);
+		rbuf = pkt_end;
+	}
+
+	if (self->rbuf != start) { // disconnected in a callback, buffer switched
+		rbuf = end;
+	} else if (tnt_big_start(tnt, rbuf, end, tnt->rb.pool != NULL)) {
+		rbuf = end;
+	} else if (tnt->rb.pool && rbuf < end) {
+		tnt->head_len = end - rbuf;
+		memcpy(tnt->head, rbuf, tnt->head_len);
+		rbuf = end;
+	}
+	if (filled) {
+		rbuf_pool_filled(&tnt->rb);
 	}
 
 	self->ruse = end - rbuf;
@@ -326,364 +681,817 @@ static void on_read(ev_cnn *self, size_t len) {
 	LEAVE;
 }
 
-static void on_index_info_read(ev_cnn *self, size_t len) {
-	ENTER;
-	SAVETMPS;
+/*
+ * Background schema reload.
+ *
+ * Requests that depend on the schema carry the schema_id the spaces were
+ * loaded at, and the server rejects them if its schema has changed since.
+ * A reload starts when a reply reports another schema_id (or such a
+ * rejection comes): _vspace and then _vindex are selected while other
+ * requests keep going. Calls that depend on the schema wait in a queue
+ * meanwhile, along with the rejected ones (see CTX_REPLAY). The new spaces
+ * then replace the old ones, which stay alive for the replies in flight,
+ * and the queue is replayed. A failed reload disconnects.
+ */
+
+static void batch_op_call(pTHX_ CV *cv);
+static int batch_op_fail(SV **args, SV *err);
+
+/* Entry of the queue; `wait` is the space it waits for the lookup of, or NULL for the reload */
+static SV *schema_queue_entry(SV *wait, CV *cv, SV **args, I32 n) {
+	AV *call = newAV();
+	I32 i;
+	av_extend(call, n + 1);
+	av_push(call, wait ? newSVsv(wait) : newSV(0));
+	av_push(call, SvREFCNT_inc_simple_NN((SV *) cv));
+	for (i = 0; i < n; i++) {
+		av_push(call, replay_arg(args[i]));
+	}
+	return newRV_noinc((SV *) call);
+}
 
-	do_disable_rw_timer(self);
+static void schema_queue_call(TntCnn *tnt, SV *wait, CV *cv, SV **args, I32 n) {
+	if (!tnt->schema_queue) tnt->schema_queue = newAV();
+	av_push(tnt->schema_queue, schema_queue_entry(wait, cv, args, n));
+}
 
-	TntCnn *tnt = (TntCnn *) self;
-	char *rbuf = self->rbuf;
-	char *end = rbuf + self->ruse;
+/* Moves the call of a rejected request to the queue */
+static void schema_queue_ctx(TntCnn *tnt, TntCtx *ctx) {
+	AV *call = newAV();
+	uint32_t i;
+	av_extend(call, ctx->replay_n);
+	av_push(call, newSV(0));
+	for (i = 0; i < ctx->replay_n; i++) {
+		av_push(call, ctx->replay[i]);
+	}
+	ctx->replay_n = 0;
+	if (!tnt->schema_queue) tnt->schema_queue = newAV();
+	av_push(tnt->schema_queue, newRV_noinc((SV *) call));
+}
 
-	while ( rbuf < end ) {
-		/* len */
-		ptrdiff_t buf_len = end - rbuf;
-		if (buf_len < 5) {
-			//cwarn("buf_len < 5");
-			debug("not enough");
-			break;
-		}
+/*
+ * Passes the error of a queued call to its callback, the last argument; a
+ * batch operation gets it at its position in the batch. Returns 0 if there
+ * is no one to tell.
+ */
+static int schema_queue_fail_call(AV *call, SV *err) {
+	CV *cv = (CV *) *av_fetch(call, 1, 0);
+	SV *cb = *av_fetch(call, av_len(call), 0);
+
+	if (CvISXSUB(cv) && CvXSUB(cv) == batch_op_call) {
+		return batch_op_fail(AvARRAY(call) + 2, err);
+	}
+	if (av_len(call) < 2 || !SvROK(cb) || SvTYPE(SvRV(cb)) != SVt_PVCV) {
+		return 0;
+	}
 
-		uint32_t pkt_length;
-		decode_pkt_len_(&rbuf, pkt_length);
+	dSP;
+	ENTER; SAVETMPS;
 
-		if (buf_len - 5 < pkt_length) {
-			//cwarn("not enough for a packet");
-			debug("not enough");
-			break;
+	PUSHMARK(SP);
+	EXTEND(SP, 2);
+	PUSHs( &PL_sv_undef );
+	PUSHs( sv_2mortal(newSVsv(err)) );
+	PUTBACK;
+
+	(void) call_sv(cb, G_DISCARD | G_VOID);
+
+	FREETMPS; LEAVE;
+	return 1;
+}
+
+/* Replays the calls waiting for the lookup of `name`, or all of them with NULL */
+static void schema_queue_replay(TntCnn *tnt, SV *name) {
+	AV *queue = tnt->schema_queue;
+	SSize_t i, j;
+	if (!queue) return;
+	tnt->schema_queue = NULL;
+
+	ENTER; SAVETMPS;
+	sv_2mortal((SV *) queue);
+	SAVEI32(tnt->replaying);
+	tnt->replaying = 1;
+
+	if (name) {
+		/* the others stay queued, ahead of the calls queued by the replay */
+		AV *mine = (AV *) sv_2mortal((SV *) newAV());
+		for (i = 0; i <= av_len(queue); i++) {
+			SV *entry = *av_fetch(queue, i, 0);
+			SV *wait = *av_fetch((AV *) SvRV(entry), 0, 0);
+			if (SvOK(wait) && sv_eq(wait, name)) {
+				av_push(mine, SvREFCNT_inc_simple_NN(entry));
+			} else {
+				if (!tnt->schema_queue) tnt->schema_queue = newAV();
+				av_push(tnt->schema_queue, SvREFCNT_inc_simple_NN(entry));
+			}
 		}
-		rbuf += 5;
+		queue = mine;
+	}
 
-		HV *hv = (HV *) sv_2mortal((SV *) newHV());
+	for (i = 0; i <= av_len(queue); i++) {
+		AV *call = (AV *) SvRV(*av_fetch(queue, i, 0));
+		dSP;
+		ENTER; SAVETMPS;
 
-		/* header */
-		tnt_header_t hdr;
-		int hdr_length = parse_reply_hdr(hv, rbuf, buf_len, &hdr, tnt->log_level);
-		if (unlikely(hdr_length < 0)) {
-			TNT_CROAK("Unexpected response header");
-			return;
+		PUSHMARK(SP);
+		EXTEND(SP, av_len(call));
+		for (j = 2; j <= av_len(call); j++) {
+			PUSHs(*av_fetch(call, j, 0));
 		}
-		if (unlikely(hdr.id <= 0)) {
-			PE_CROAK("Wrong sync id (id <= 0)");
-			return;
+		PUTBACK;
+
+		(void) call_sv(*av_fetch(call, 1, 0), G_DISCARD | G_VOID | G_EVAL);
+		if (SvTRUE(ERRSV)) {
+			/* the request croaked instead of calling back */
+			SV *err = sv_2mortal(newSVsv(ERRSV));
+			sv_setpvs(ERRSV, "");
+			if (!schema_queue_fail_call(call, err)) {
+				log_error(tnt->log_level, "Request failed after schema reload: %s", SvPV_nolen(err));
+			}
 		}
 
-		TntCtx *ctx;
-		SV *key = hv_delete(tnt->reqs, (char *) &hdr.id, sizeof(hdr.id), 0);
+		FREETMPS; LEAVE;
+	}
 
-		if (!key) {
-			rbuf += pkt_length;
-			log_debug(tnt->log_level, "key %d not found", hdr.id);
-		} else {
-			rbuf += hdr_length;
+	FREETMPS; LEAVE;
+}
 
-			ctx = (TntCtx *) SvPVX(key);
-			ev_timer_stop(self->loop, &ctx->t);
-			SvREFCNT_dec(ctx->wbuf);
-			if (ctx->f.size && !ctx->f.nofree) {
-				safefree(ctx->f.f);
-			}
+/* Fails the waiting calls like free_reqs fails the requests in flight */
+static void schema_queue_fail(TntCnn *tnt, const char *message) {
+	AV *queue = tnt->schema_queue;
+	SSize_t i;
+	if (!queue) return;
+	tnt->schema_queue = NULL;
 
+	ENTER; SAVETMPS;
+	sv_2mortal((SV *) queue);
+	SV *err = sv_2mortal(newSVpv(message, 0));
 
-			int body_length = parse_index_body(tnt->spaces, hv, rbuf, buf_len, tnt->log_level);
-			if (unlikely(body_length <= 0)) {
-				rbuf += (pkt_length - hdr_length);
-				log_error(tnt->log_level, "Unexpected response body. length = %d", body_length);
-				force_disconnect(tnt, "Couldn\'t retrieve index info.");
-			} else {
-				rbuf += body_length;
-
-				if (unlikely(hdr.code != 0)) {
-					// log_error(tnt->log_level, "Failed to retrieve index info. Code = %d", (int) hdr.code);
-					// force_disconnect(tnt, "Couldn\'t retrieve index info.");
-
-					SV **var = hv_fetchs(hv,"errstr",0);
-					log_error(
-						tnt->log_level,
-						"Couldn\'t retrieve indexes info. Code = %d, Message = \"%.*s\"",
-						(int) hdr.code,
-						(int) SvCUR(*var),
-						SvPV_nolen(*var)
-					);
-
-					SV *msg = sv_2mortal(newSVpvf(
-						"Couldn\'t retrieve indexes info: %.*s", (int) SvCUR(*var), SvPV_nolen(*var)
-					));
-					force_disconnect(tnt, SvPVX(msg));
-				} else {
-					self->on_read = (c_cb_read_t) on_read;
-					call_connected(tnt);
-				}
-			}
+	for (i = 0; i <= av_len(queue); i++) {
+		(void) schema_queue_fail_call((AV *) SvRV(*av_fetch(queue, i, 0)), err);
+	}
 
+	FREETMPS; LEAVE;
+}
 
-			--tnt->pending;
+/*
+ * Lazy spaces (spaces option).
+ *
+ * The handshake loads no spaces: the names given to the option are looked
+ * up right after connecting, and any other space the first time a request
+ * names it. A lookup selects the space from _vspace by its name index, then
+ * its indexes from _vindex by the space id, and adds both to the spaces of
+ * the connection; the calls naming the space wait in the schema queue
+ * meanwhile, tagged with its name, and only they are replayed once it is
+ * done. The connected callback waits for the lookups of the names given. If the space
+ * is not found, the calls waiting for it fail with "Unknown space". A schema
+ * change drops the spaces looked up so far. A lookup in flight is kept by the
+ * context of its current request (ctx->lookup), and its name in `lookups`.
+ */
+
+#define _VSPACE_NAME_INDEX 2
+
+static int space_unknown(TntCnn *tnt, SV *space) {
+	if (SvIOK(space) || !SvPOK(space) || !tnt->spaces) return 0;
+	if (hv_exists(tnt->spaces, SvPVX(space), SvCUR(space))) return 0;
+	return !(tnt->lookup_missing && hv_exists(tnt->lookup_missing, SvPVX(space), SvCUR(space)));
+}
 
-			if (rbuf == end) {
-				self->ruse = 0;
-				if (tnt->pending == 0) {
-					//do_disable_rw_timer(self);
-				}
-				else {
-					//do_enable_rw_timer(self);
-				}
-				break;
-			}
-		}
+/* Selects by a single part key, the name if given or the id; the request takes over lk */
+static void lookup_send(TntCnn *tnt, TntLookup *lk, uint32_t space_id, uint32_t index_id, SV *name, uint32_t id) {
+	TntCtx *ctx = ctx_alloc(&tnt->ctxs);
+	uint32_t iid;
+	STRLEN len = 0;
+	const char *str = name ? SvPV(name, len) : NULL;
+
+	INIT_CTX(tnt, ctx, lookup_call, iid);
+	ctx->schema_id = 0;
+
+	size_t sz = HEADER_CONST_LEN + 1 + 3 * (1 + 5) + 1 + 1 + 5 + len;
+	create_buffer(rv, h, sz, TP_SELECT, iid, 0);
+	h = mp_encode_map(h, 4);
+	h = mp_encode_uint(h, TP_SPACE);
+	h = mp_encode_uint(h, space_id);
+	h = mp_encode_uint(h, TP_INDEX);
+	h = mp_encode_uint(h, index_id);
+	h = mp_encode_uint(h, TP_LIMIT);
+	h = mp_encode_uint(h, 0xffffffff);
+	h = mp_encode_uint(h, TP_KEY);
+	h = mp_encode_array(h, 1);
+	h = str ? mp_encode_str(h, str, len) : mp_encode_uint(h, id);
+
+	finish_buffer(rv, h);
+
+	ctx->lookup = lk;
+	__EXEC_REQUEST(tnt, ctx, iid, rv, NULL);
+	TIMEOUT_TIMER(tnt, ctx, iid, tnt->cnn.rw_timeout);
+}
 
-	}
+/* Returns 0 if the space is being looked up already */
+static int lookup_start(TntCnn *tnt, SV *name, U32 preload) {
+	TntLookup *lk;
+	STRLEN len;
+	const char *key = SvPV(name, len);
+
+	if (tnt->lookups && hv_exists(tnt->lookups, key, len)) return 0;
+	if (!tnt->lookups) tnt->lookups = newHV();
+	(void) hv_store(tnt->lookups, key, len, newSViv(1), 0);
+
+	log_debug(tnt->log_level, "Looking up space %s", key);
+	Newxz(lk, 1, TntLookup);
+	lk->name = newSVsv(name);
+	lk->preload = preload;
+	lookup_send(tnt, lk, _VSPACE_SPACEID, _VSPACE_NAME_INDEX, name, 0);
+	return 1;
+}
 
-	self->ruse = end - rbuf;
-	if (self->ruse > 0) {
-		memmove(self->rbuf,rbuf,self->ruse);
+/* Returns the number of lookups started */
+static uint32_t lookup_preload(TntCnn *tnt, U32 preload) {
+	SSize_t i;
+	SV **name;
+	uint32_t started = 0;
+	if (!tnt->preload) return 0;
+	for (i = 0; i <= av_len(tnt->preload); i++) {
+		if ((name = av_fetch(tnt->preload, i, 0)) && space_unknown(tnt, *name)) {
+			started += lookup_start(tnt, *name, preload);
+		}
 	}
+	return started;
+}
 
-	FREETMPS;
-	LEAVE;
+/* The lookups themselves go with the contexts of their requests, see free_reqs */
+static void lookup_reset(TntCnn *tnt) {
+	if (tnt->lookups) {
+		SvREFCNT_dec(tnt->lookups);
+		tnt->lookups = NULL;
+	}
+	tnt->preload_left = 0;
 }
 
-static void on_spaces_info_read(ev_cnn *self, size_t len) {
-	ENTER;
-	SAVETMPS;
+/* Adds the space found in lk->spaces (if any), replays the waiting calls and frees lk */
+static void lookup_done(TntCnn *tnt, TntLookup *lk, int found) {
+	MAGIC *mg;
+	HE *ent;
 
-	do_disable_rw_timer(self);
+	if (tnt->lookups) (void) hv_delete(tnt->lookups, SvPVX(lk->name), SvCUR(lk->name), G_DISCARD);
 
-	TntCnn *tnt = (TntCnn *) self;
-	char *rbuf = self->rbuf;
-	char *end = rbuf + self->ruse;
+	if (!found) {
+		log_info(tnt->log_level, "Space %s not found", SvPV_nolen(lk->name));
+		if (!tnt->lookup_missing) tnt->lookup_missing = newHV();
+		(void) hv_store(tnt->lookup_missing, SvPVX(lk->name), SvCUR(lk->name), newSViv(1), 0);
+	}
+	else if ((mg = mg_findext((SV *) tnt->spaces, PERL_MAGIC_ext, &spaces_vtbl)) && mg->mg_obj) {
+		/*
+		 * The spaces were taken from the registry meanwhile. A shared hash is
+		 * complete for its schema_id, which is the one the space was found in
+		 * (a reply with another one switches the spaces before this, and
+		 * on_lookup_reply starts over when they differ), so it has the space
+		 * already; and a published hash is not changed, see schema_share.
+		 */
+	}
+	else {
+		(void) hv_iterinit(lk->spaces);
+		while ((ent = hv_iternext(lk->spaces))) {
+			(void) hv_store(tnt->spaces, HeKEY(ent), HeKLEN(ent), SvREFCNT_inc_NN(HeVAL(ent)), 0);
+		}
+		hv_clear(lk->spaces); /* the structs belong to tnt->spaces now */
+	}
 
-	while ( rbuf < end ) {
-		/* len */
-		ptrdiff_t buf_len = end - rbuf;
-		if (buf_len < 5) {
-			//cwarn("buf_len < 5");
-			debug("not enough");
-			break;
+	schema_queue_replay(tnt, lk->name);
+	if (tnt->lookup_missing) hv_clear(tnt->lookup_missing);
+
+	if (lk->preload && tnt->preload_left && --tnt->preload_left == 0) {
+		call_connected(tnt);
+	}
+	lookup_free(lk);
+}
+
+/* Takes over lk, which the reply belongs to */
+static void on_lookup_reply(TntCnn *tnt, TntLookup *lk, tnt_header_t *hdr, char *rbuf, char *pkt_end) {
+	HV *hv = (HV *) sv_2mortal((SV *) newHV());
+	SV **var;
+
+	if (!lk->spaces) {
+		/* _vspace by name */
+		if (hdr->code != 0 || parse_spaces_body(hv, rbuf, pkt_end - rbuf, tnt->log_level) < 0
+			|| !(var = hv_fetchs(hv, "data", 0)) || !SvROK(*var) || HvUSEDKEYS((HV *) SvRV(*var)) == 0) {
+			lookup_done(tnt, lk, 0);
+			return;
 		}
+		lk->spaces = (HV *) SvREFCNT_inc(SvRV(*var));
+		lk->schema_id = hdr->schema_id;
+		(void) hv_iterinit(lk->spaces);
+		TntSpace *spc = (TntSpace *) SvPVX(HeVAL(hv_iternext(lk->spaces)));
+		lookup_send(tnt, lk, _VINDEX_SPACEID, 0, NULL, spc->id);
+		return;
+	}
 
-		uint32_t pkt_length;
-		decode_pkt_len_(&rbuf, pkt_length);
+	/* _vindex by space id */
+	if (lk->schema_id != tnt->schema_id) {
+		/* the schema changed in between */
+		destroy_spaces(lk->spaces);
+		lk->spaces = NULL;
+		lookup_send(tnt, lk, _VSPACE_SPACEID, _VSPACE_NAME_INDEX, lk->name, 0);
+		return;
+	}
+	if (hdr->code != 0 || parse_index_body(lk->spaces, hv, rbuf, pkt_end - rbuf, tnt->log_level) < 0) {
+		lookup_done(tnt, lk, 0);
+		return;
+	}
+	lookup_done(tnt, lk, 1);
+}
 
-		if (buf_len - 5 < pkt_length) {
-			//cwarn("not enough for a packet");
-			debug("not enough");
-			break;
+/* Reloads the spaces for a new schema_id (0 if not known), or takes them from a connection that already did */
+static void schema_reload(TntCnn *tnt, uint32_t schema_id) {
+	HV *shared;
+	if (tnt->share_schema && (shared = schema_shared(tnt->cluster, schema_id))) {
+		log_info(tnt->log_level, "Schema changed, using the shared one, schema_id = %u", schema_id);
+		SvREFCNT_inc_simple_void_NN(shared);
+		destroy_spaces(tnt->spaces);
+		tnt->spaces = shared;
+		tnt->schema_id = schema_id;
+		++tnt->schema_gen;
+		schema_queue_replay(tnt, NULL);
+		return;
+	}
+	if (tnt->lazy) {
+		if (!schema_id || schema_id != tnt->schema_id) {
+			log_info(tnt->log_level, "Schema changed, dropping the spaces looked up");
+			destroy_spaces(tnt->spaces);
+			tnt->spaces = spaces_new();
+			tnt->schema_id = schema_id;
+			++tnt->schema_gen;
+			(void) lookup_preload(tnt, 0);
 		}
-		rbuf += 5;
+		schema_queue_replay(tnt, NULL);
+		return;
+	}
+	log_info(tnt->log_level, "Schema changed, reloading");
+	tnt->reload_sync = _execute_select(tnt, _VSPACE_SPACEID, NULL);
+}
+
+static void schema_reload_reset(TntCnn *tnt) {
+	tnt->reload_sync = 0;
+	if (tnt->reload_spaces) {
+		destroy_spaces(tnt->reload_spaces);
+		tnt->reload_spaces = NULL;
+	}
+}
 
-		HV *hv = (HV *) sv_2mortal((SV *) newHV());
+static void on_reload_reply(TntCnn *tnt, tnt_header_t *hdr, char *rbuf, char *pkt_end) {
+	HV *hv = (HV *) sv_2mortal((SV *) newHV());
+	SV **var;
 
-		/* header */
-		tnt_header_t hdr;
-		int hdr_length = parse_reply_hdr(hv, rbuf, buf_len, &hdr, tnt->log_level);
-		if (unlikely(hdr_length < 0)) {
-			TNT_CROAK("Unexpected response header");
+	if (!tnt->reload_spaces) {
+		if (hdr->code != 0 || parse_spaces_body(hv, rbuf, pkt_end - rbuf, tnt->log_level) < 0
+			|| !(var = hv_fetchs(hv, "data", 0)) || !SvROK(*var)) {
+			schema_reload_reset(tnt);
+			force_disconnect(tnt, "Couldn\'t reload spaces info.");
 			return;
 		}
-		if (unlikely(hdr.id <= 0)) {
-			PE_CROAK("Wrong sync id (id <= 0)");
-			return;
+		tnt->reload_spaces = (HV *) SvREFCNT_inc(SvRV(*var));
+		tnt->reload_schema_id = hdr->schema_id;
+		if (tnt->schema_file) {
+			if (tnt->schema_body) SvREFCNT_dec(tnt->schema_body);
+			tnt->schema_body = newSVpvn(rbuf, pkt_end - rbuf);
 		}
+		tnt->reload_sync = _execute_select(tnt, _VINDEX_SPACEID, NULL);
+		return;
+	}
 
-		TntCtx *ctx;
-		SV *key = hv_delete(tnt->reqs, (char *) &hdr.id, sizeof(hdr.id), 0);
+	if (hdr->code != 0 || parse_index_body(tnt->reload_spaces, hv, rbuf, pkt_end - rbuf, tnt->log_level) < 0) {
+		schema_reload_reset(tnt);
+		force_disconnect(tnt, "Couldn\'t reload indexes info.");
+		return;
+	}
+	HV *spaces = tnt->reload_spaces;
+	tnt->reload_spaces = NULL;
+	tnt->reload_sync = 0;
+
+	if ((uint32_t) hdr->schema_id != tnt->reload_schema_id) {
+		/* changed again between the two selects */
+		destroy_spaces(spaces);
+		schema_reload(tnt, 0);
+		return;
+	}
+	if (tnt->reload_schema_id && tnt->schema_file && tnt->schema_body) {
+		schema_file_save(tnt->schema_file, tnt->reload_schema_id, tnt->schema_body, rbuf, pkt_end - rbuf, tnt->log_level);
+	}
+	if (tnt->schema_body) {
+		SvREFCNT_dec(tnt->schema_body);
+		tnt->schema_body = NULL;
+	}
 
-		if (!key) {
-			rbuf += pkt_length;
-			log_debug(tnt->log_level, "key %d not found", hdr.id);
-		} else {
-			rbuf += hdr_length;
+	destroy_spaces(tnt->spaces);
+	tnt->spaces = spaces;
+	tnt->schema_id = tnt->reload_schema_id;
+	if (tnt->share_schema) {
+		schema_share(spaces, tnt->cluster, tnt->schema_id);
+	}
+	++tnt->schema_gen;
+	log_info(tnt->log_level, "Schema reloaded, schema_id = %u", tnt->schema_id);
 
-			ctx = (TntCtx *) SvPVX(key);
-			ev_timer_stop(self->loop, &ctx->t);
-			SvREFCNT_dec(ctx->wbuf);
-			if (ctx->f.size && !ctx->f.nofree) {
-				safefree(ctx->f.f);
-			}
+	schema_queue_replay(tnt, NULL);
+}
 
-			int body_length = parse_spaces_body(hv, rbuf, buf_len, tnt->log_level);
+static void on_reply(TntCnn *tnt, char *rbuf, char *pkt_end) {
+	/* header */
+	tnt_header_t hdr;
+	int hdr_length = parse_reply_hdr(NULL, rbuf, pkt_end - rbuf, &hdr, tnt->log_level);
+	if (unlikely(hdr_length < 0)) {
+		TNT_CROAK("Unexpected response header");
+		return;
+	}
+	if (unlikely(hdr.id <= 0)) {
+		PE_CROAK("Wrong sync id (id <= 0)");
+		return;
+	}
 
-			if (unlikely(body_length <= 0)) {
-				rbuf += (pkt_length - hdr_length);
-				log_error(tnt->log_level, "Unexpected response body. length = %d", body_length);
-				force_disconnect(tnt, "Couldn\'t retrieve space info (body_length <= 0).");
-			} else {
-				rbuf += body_length;
-
-				SV **var = NULL;
-				if (unlikely(hdr.code != 0)) {
-					// log_error(tnt->log_level, "Couldn\'t retrieve space info. Code = %d", (int) hdr.code);
-					// force_disconnect(tnt, "Couldn\'t retrieve space info");
-					var = hv_fetchs(hv,"errstr",0);
-					log_error(
-						tnt->log_level,
-						"Couldn\'t retrieve spaces info. Code = %d, Message = \"%.*s\"",
-						(int) hdr.code,
-						(int) SvCUR(*var),
-						SvPV_nolen(*var)
-					);
-
-					SV *msg = sv_2mortal(newSVpvf(
-						"Couldn\'t retrieve spaces info: %.*s", (int) SvCUR(*var), SvPV_nolen(*var)
-					));
-					force_disconnect(tnt, SvPVX(msg));
-				} else {
-					if ((var = hv_fetchs(hv, "data", 0)) && SvOK(*var) && SvROK(*var)) {
-						if (tnt->spaces) {
-							destroy_spaces(tnt->spaces);
-						}
-						tnt->spaces = (HV *) SvREFCNT_inc(SvRV(*var));
-
-						self->on_read = (c_cb_read_t) on_index_info_read;
-						// _execute_eval(tnt, _INDEX_SELECTOR);
-						_execute_select(tnt, _VINDEX_SPACEID);
-						// self->on_read = (c_cb_read_t) on_read;
-					} else {
-						log_error(tnt->log_level, "Couldn\'t retrieve space info. No data parsed");
-						force_disconnect(tnt, "Couldn\'t retrieve space info (no parsed data).");
-					}
-				}
-			}
+	if (unlikely(hdr.schema_id > 0 && (uint32_t) hdr.schema_id != tnt->schema_id && !tnt->reload_sync)) {
+		schema_reload(tnt, hdr.schema_id);
+	}
 
-			--tnt->pending;
+	TntCtx *ctx = reqs_take(&tnt->reqs, hdr.id);
+
+	if (!ctx) {
+		log_debug(tnt->log_level, "key %d not found", hdr.id);
+	} else if (unlikely(hdr.id == tnt->reload_sync)) {
+		deadline_cancel(&tnt->deadlines, ctx);
+		ctx_release(&tnt->ctxs, ctx);
+		--tnt->pending;
+		on_reload_reply(tnt, &hdr, rbuf + hdr_length, pkt_end);
+	} else if (unlikely(ctx->call == lookup_call)) {
+		TntLookup *lk = ctx->lookup;
+		ctx->lookup = NULL;
+		deadline_cancel(&tnt->deadlines, ctx);
+		ctx_release(&tnt->ctxs, ctx);
+		--tnt->pending;
+		on_lookup_reply(tnt, lk, &hdr, rbuf + hdr_length, pkt_end);
+	} else if (unlikely(hdr.code == TP_ER_WRONG_SCHEMA_VERSION && ctx->replay_n)) {
+		deadline_cancel(&tnt->deadlines, ctx);
+		if (ctx->cb) SvREFCNT_dec(ctx->cb);
+		schema_queue_ctx(tnt, ctx);
+		ctx_release(&tnt->ctxs, ctx);
+		--tnt->pending;
+		if (!tnt->reload_sync) schema_reload(tnt, hdr.schema_id);
+	} else {
+		rbuf += hdr_length;
 
-			if (rbuf == end) {
-				self->ruse = 0;
-				if (tnt->pending == 0) {
-					//do_disable_rw_timer(self);
-				}
-				else {
-					//do_enable_rw_timer(self);
-				}
-				break;
-			}
+		deadline_cancel(&tnt->deadlines, ctx);
+
+		/* body */
+
+		TntResult tmp, *res;
+		SV *reply;
+		if (ctx->compact) {
+			reply = sv_2mortal(result_new(&hdr, &res));
+		} else {
+			result_init(res = &tmp, &hdr);
 		}
 
-	}
+		AV *fields = (ctx->space && ctx->use_hash) ? ctx->space->fields : NULL;
+		int body_length = parse_reply_body(ctx, res, rbuf, pkt_end - rbuf, &ctx->f, fields);
+		if (unlikely(body_length < 0)) {
+			log_error(tnt->log_level, "Unexpected response body. length = %d", body_length);
+		}
+
+		SV *errstr = NULL;
+		if (!ctx->compact) {
+			HV *hv = newHV();
+			result_store_hv(res, hv, 1);
+			reply = sv_2mortal(newRV_noinc((SV *) hv));
+			SV **var;
+			if (hdr.code != 0 && (var = hv_fetchs(hv, "errstr", 0))) errstr = *var;
+		} else if (hdr.code != 0) {
+			errstr = res->errstr;
+		}
+		if (hdr.code != 0 && !errstr) errstr = &PL_sv_undef;
+
+		if (res->rest) {
+			TntStream *stream = stream_new(tnt, ctx, res, reply);
+			ev_timer_init(&stream->t, on_stream_timer, 0., 0.);
+			ev_timer_start(tnt->cnn.loop, &stream->t);
+			stream_link(&tnt->streams, stream);
+		} else {
+			tnt_deliver(tnt, ctx, reply, errstr);
+		}
+
+		--tnt->pending;
 
-	self->ruse = end - rbuf;
-	if (self->ruse > 0) {
-		memmove(self->rbuf,rbuf,self->ruse);
 	}
+}
 
-	FREETMPS;
-	LEAVE;
+static void on_read(ev_cnn *self, size_t len) {
+	tnt_read(self, on_reply);
 }
 
-static void on_auth_read(ev_cnn *self, size_t len) {
-	ENTER;
-	SAVETMPS;
+static void drop_kept_spaces(TntCnn *self) {
+	if (self->kept_spaces) {
+		destroy_spaces(self->kept_spaces);
+		self->kept_spaces = NULL;
+	}
+	self->kept_schema_id = 0;
+}
 
-	do_disable_rw_timer(self);
+/*
+ * Handshake after the greeting.
+ *
+ * Auth and the _vspace and _vindex selects are written at once and their
+ * replies are matched by sync, so the connection is ready one round trip
+ * after the greeting. The selects wait for the auth reply instead when its
+ * schema_id may show that no loading is needed: with spaces kept from the
+ * last connection (or read from schema_cache), or, with share_schema, when
+ * a schema of the cluster this connection last saw is published. Without a
+ * username a ping takes the place of auth. With share_schema the cluster
+ * uuid is selected from _schema along with auth, to find the shared schema
+ * by; when the selects were not held back, the replies are dropped if a
+ * shared schema turns up meanwhile.
+ *
+ * The _vindex reply is decoded once everything is in, whatever the order of
+ * the replies. Selects answered before auth ran with guest rights, so they
+ * are sent again.
+ */
+
+static void handshake_reset(TntCnn *tnt) {
+	tnt->hs_auth = tnt->hs_cluster = tnt->hs_spaces = tnt->hs_index = 0;
+	tnt->hs_schema_id = 0;
+	tnt->hs_early = tnt->hs_shared = 0;
+	if (tnt->hs_index_body) {
+		SvREFCNT_dec(tnt->hs_index_body);
+		tnt->hs_index_body = NULL;
+	}
+	if (tnt->schema_body) {
+		SvREFCNT_dec(tnt->schema_body);
+		tnt->schema_body = NULL;
+	}
+}
 
-	TntCnn *tnt = (TntCnn *) self;
-	char *rbuf = self->rbuf;
-	char *end = rbuf + self->ruse;
+static void handshake_send_selects(TntCnn *tnt) {
+	tnt->hs_spaces = _execute_select(tnt, _VSPACE_SPACEID, NULL);
+	tnt->hs_index = _execute_select(tnt, _VINDEX_SPACEID, NULL);
+}
 
-	while ( rbuf < end ) {
-		/* len */
-		ptrdiff_t buf_len = end - rbuf;
-		if (buf_len < 5) {
-			//cwarn("buf_len < 5");
-			debug("not enough");
-			break;
-		}
+static void handshake_ready(TntCnn *tnt) {
+	handshake_reset(tnt);
+	tnt->handshake = 0;
+	if (tnt->share_schema && !tnt->lazy) {
+		schema_share(tnt->spaces, tnt->cluster, tnt->schema_id);
+	}
+	++tnt->schema_gen;
+	tnt->cnn.on_read = (c_cb_read_t) on_read;
+	if (tnt->lazy && (tnt->preload_left = lookup_preload(tnt, 1))) {
+		return; /* connected is called once the preloaded spaces are known, see lookup_done */
+	}
+	call_connected(tnt);
+}
 
-		uint32_t pkt_length;
-		decode_pkt_len_(&rbuf, pkt_length);
+/* Takes spaces loaded before (kept or shared) instead of selecting them */
+static void handshake_adopt(TntCnn *tnt, HV *spaces, uint32_t schema_id) {
+	SvREFCNT_inc_simple_void_NN(spaces);
+	if (tnt->spaces) {
+		destroy_spaces(tnt->spaces);
+	}
+	tnt->spaces = spaces;
+	tnt->schema_id = schema_id;
+	drop_kept_spaces(tnt);
+	handshake_ready(tnt);
+}
 
-		if (buf_len - 5 < pkt_length) {
-			//cwarn("not enough for a packet");
-			debug("not enough");
-			break;
+/* Disconnects if a select of the handshake failed */
+static int handshake_check(TntCnn *tnt, tnt_header_t *hdr, HV *hv, int body_length, const char *what) {
+	if (unlikely(body_length < 0)) {
+		log_error(tnt->log_level, "Unexpected response body. length = %d", body_length);
+		SV *msg = sv_2mortal(newSVpvf("Couldn\'t retrieve %s info.", what));
+		force_disconnect(tnt, SvPVX(msg));
+		return 0;
+	}
+	if (unlikely(hdr->code != 0)) {
+		SV **var = hv_fetchs(hv, "errstr", 0);
+		SV *err = var ? *var : sv_2mortal(newSVpvs("unknown error"));
+		log_error(
+			tnt->log_level,
+			"Couldn\'t retrieve %s info. Code = %d, Message = \"%.*s\"",
+			what,
+			(int) hdr->code,
+			(int) SvCUR(err),
+			SvPV_nolen(err)
+		);
+
+		SV *msg = sv_2mortal(newSVpvf(
+			"Couldn\'t retrieve %s info: %.*s", what, (int) SvCUR(err), SvPV_nolen(err)
+		));
+		force_disconnect(tnt, SvPVX(msg));
+		return 0;
+	}
+	return 1;
+}
+
+/* Cluster uuid from the reply to the select of 'cluster' in _schema, or NULL */
+static SV *decode_cluster(const char *p, const char *end) {
+	const char *test = p;
+	const char *str;
+	uint32_t n, len;
+
+	if (p == end || mp_check(&test, end) || mp_typeof(*p) != MP_MAP) return NULL;
+	n = mp_decode_map(&p);
+	while (n-- > 0) {
+		if (mp_typeof(*p) != MP_UINT) return NULL;
+		if (mp_decode_uint(&p) != TP_DATA) {
+			mp_next(&p);
+			continue;
 		}
-		rbuf += 5;
+		if (mp_typeof(*p) != MP_ARRAY || mp_decode_array(&p) < 1) return NULL;
+		if (mp_typeof(*p) != MP_ARRAY || mp_decode_array(&p) < 2) return NULL;
+		mp_next(&p);
+		if (mp_typeof(*p) != MP_STR) return NULL;
+		str = mp_decode_str(&p, &len);
+		return newSVpvn(str, len);
+	}
+	return NULL;
+}
 
-		HV *hv = (HV *) sv_2mortal((SV *) newHV());
+/* All replies are in: attaches the indexes and saves the schema */
+static void handshake_finish(TntCnn *tnt) {
+	HV *hv = (HV *) sv_2mortal((SV *) newHV());
+	tnt_header_t hdr;
+	SV *body = tnt->hs_index_body;
 
-		/* header */
-		tnt_header_t hdr;
-		int hdr_length = parse_reply_hdr(hv, rbuf, buf_len, &hdr, tnt->log_level);
-		if (unlikely(hdr_length < 0)) {
-			TNT_CROAK("Unexpected response header");
-			return;
-		}
-		if (unlikely(hdr.id <= 0)) {
-			PE_CROAK("Wrong sync id (id <= 0)");
-			return;
-		}
+	if (tnt->hs_early) {
+		handshake_reset(tnt);
+		handshake_send_selects(tnt);
+		return;
+	}
+	if (tnt->hs_shared) {
+		handshake_ready(tnt);
+		return;
+	}
 
-		TntCtx *ctx;
-		SV *key = hv_delete(tnt->reqs, (char *) &hdr.id, sizeof(hdr.id), 0);
+	tnt_header_init(&hdr);
+	hdr.code = 0;
+	if (!handshake_check(tnt, &hdr, hv, parse_index_body(tnt->spaces, hv, SvPVX(body), SvCUR(body), tnt->log_level), "indexes")) {
+		return;
+	}
 
-		if (!key) {
-			rbuf += pkt_length;
-			log_debug(tnt->log_level, "key %d not found", hdr.id);
-		} else {
-			rbuf += hdr_length;
+	if (tnt->hs_index_schema_id != tnt->schema_id) {
+		tnt->schema_id = 0; /* changed between the two selects */
+	} else if (tnt->schema_id && tnt->schema_file && tnt->schema_body) {
+		schema_file_save(tnt->schema_file, tnt->schema_id, tnt->schema_body, SvPVX(body), SvCUR(body), tnt->log_level);
+	}
+	handshake_ready(tnt);
+}
 
-			ctx = (TntCtx *) SvPVX(key);
-			ev_timer_stop(self->loop, &ctx->t);
-			SvREFCNT_dec(ctx->wbuf);
-			if (ctx->f.size && !ctx->f.nofree) {
-				safefree(ctx->f.f);
-			}
+/* Called after every reply of the handshake, decides what comes next */
+static void handshake_step(TntCnn *tnt) {
+	HV *shared;
 
-			/* body */
+	if (tnt->hs_auth || tnt->hs_cluster || tnt->hs_spaces || tnt->hs_index) {
+		return;
+	}
+	if (tnt->hs_index_body) {
+		handshake_finish(tnt);
+	}
+	else if (tnt->kept_spaces && tnt->hs_schema_id && tnt->hs_schema_id == tnt->kept_schema_id) {
+		handshake_adopt(tnt, tnt->kept_spaces, tnt->kept_schema_id);
+	}
+	else if (tnt->share_schema && (shared = schema_shared(tnt->cluster, tnt->hs_schema_id))) {
+		log_debug(tnt->log_level, "Using the shared schema, schema_id = %u", tnt->hs_schema_id);
+		handshake_adopt(tnt, shared, tnt->hs_schema_id);
+	}
+	else if (tnt->lazy) {
+		drop_kept_spaces(tnt);
+		destroy_spaces(tnt->spaces);
+		tnt->spaces = spaces_new();
+		tnt->schema_id = tnt->hs_schema_id;
+		handshake_ready(tnt);
+	}
+	else {
+		drop_kept_spaces(tnt);
+		handshake_send_selects(tnt);
+	}
+}
 
-			AV *fields = (ctx->space && ctx->use_hash) ? ctx->space->fields : NULL;
-			int body_length = parse_reply_body(ctx, hv, rbuf, buf_len, &ctx->f, fields);
-			if (unlikely(body_length <= 0)) {
-				rbuf += (pkt_length - hdr_length);
-				log_error(tnt->log_level, "Unexpected response body. length = %d", body_length);
-				force_disconnect(tnt, "Couldn\'t authenticate (body_length <= 0).");
-			} else {
-				rbuf += body_length;
-
-				SV **var = NULL;
-				if (hdr.code == 0) {
-					self->on_read = (c_cb_read_t) on_spaces_info_read;
-					// _execute_eval(tnt, _SPACE_SELECTOR);
-					_execute_select(tnt, _VSPACE_SPACEID);
-					// self->on_read = (c_cb_read_t) on_read;
-				}
-				else {
-					var = hv_fetchs(hv,"errstr",0);
-					force_disconnect(tnt, SvPVX(*var));
-				}
-			}
+static void on_handshake_reply(TntCnn *tnt, char *rbuf, char *pkt_end) {
+	HV *hv = (HV *) sv_2mortal((SV *) newHV());
+	int ok = 1;
+	SV **var;
+	HV *shared;
+
+	/* header */
+	tnt_header_t hdr;
+	int hdr_length = parse_reply_hdr(hv, rbuf, pkt_end - rbuf, &hdr, tnt->log_level);
+	if (unlikely(hdr_length < 0)) {
+		TNT_CROAK("Unexpected response header");
+		return;
+	}
+	if (unlikely(hdr.id <= 0)) {
+		PE_CROAK("Wrong sync id (id <= 0)");
+		return;
+	}
 
-			--tnt->pending;
+	TntCtx *ctx = reqs_take(&tnt->reqs, hdr.id);
 
-			if (rbuf == end) {
-				self->ruse = 0;
-				if (tnt->pending == 0) {
-					//do_disable_rw_timer(self);
+	if (!ctx) {
+		log_debug(tnt->log_level, "key %d not found", hdr.id);
+		return;
+	}
+	rbuf += hdr_length;
+	deadline_cancel(&tnt->deadlines, ctx);
+
+	if ((uint32_t) hdr.id == tnt->hs_auth) {
+		tnt->hs_auth = 0;
+		if (hdr.schema_id > 0) tnt->hs_schema_id = hdr.schema_id;
+
+		TntResult res;
+		result_init(&res, &hdr);
+
+		int body_length = parse_reply_body(ctx, &res, rbuf, pkt_end - rbuf, &ctx->f, NULL);
+		if (unlikely(body_length < 0)) {
+			log_error(tnt->log_level, "Unexpected response body. length = %d", body_length);
+			force_disconnect(tnt, "Couldn\'t authenticate (body_length <= 0).");
+			ok = 0;
+		} else if (hdr.code != 0) {
+			force_disconnect(tnt, res.errstr ? SvPV_nolen(res.errstr) : "Couldn\'t authenticate.");
+			ok = 0;
+		}
+
+		result_destroy(&res);
+	}
+	else if ((uint32_t) hdr.id == tnt->hs_cluster) {
+		tnt->hs_cluster = 0;
+		if (hdr.schema_id > 0) tnt->hs_schema_id = hdr.schema_id;
+
+		if (tnt->cluster) SvREFCNT_dec(tnt->cluster);
+		tnt->cluster = hdr.code == 0 ? decode_cluster(rbuf, pkt_end) : NULL;
+		if (!tnt->cluster) {
+			log_info(tnt->log_level, "Couldn\'t read the cluster uuid, the schema is not shared");
+		}
+	}
+	else if ((uint32_t) hdr.id == tnt->hs_spaces) {
+		tnt->hs_spaces = 0;
+		if (tnt->hs_auth) tnt->hs_early = 1;
+
+		if (hdr.code == 0 && tnt->share_schema && !tnt->hs_early
+			&& (shared = schema_shared(tnt->cluster, hdr.schema_id))) {
+			/* loaded by another connection meanwhile */
+			if (tnt->spaces) {
+				destroy_spaces(tnt->spaces);
+			}
+			tnt->spaces = (HV *) SvREFCNT_inc_NN(shared);
+			tnt->schema_id = hdr.schema_id;
+			tnt->hs_shared = 1;
+		}
+		else if ((ok = handshake_check(tnt, &hdr, hv, parse_spaces_body(hv, rbuf, pkt_end - rbuf, tnt->log_level), "spaces"))) {
+			if ((var = hv_fetchs(hv, "data", 0)) && SvOK(*var) && SvROK(*var)) {
+				if (tnt->spaces) {
+					destroy_spaces(tnt->spaces);
 				}
-				else {
-					//do_enable_rw_timer(self);
+				tnt->spaces = (HV *) SvREFCNT_inc(SvRV(*var));
+				tnt->schema_id = hdr.schema_id;
+				if (tnt->schema_file) {
+					if (tnt->schema_body) SvREFCNT_dec(tnt->schema_body);
+					tnt->schema_body = newSVpvn(rbuf, pkt_end - rbuf);
 				}
-				break;
+			} else {
+				log_error(tnt->log_level, "Couldn\'t retrieve space info. No data parsed");
+				force_disconnect(tnt, "Couldn\'t retrieve space info (no parsed data).");
+				ok = 0;
 			}
 		}
-
+	}
+	else if ((uint32_t) hdr.id == tnt->hs_index) {
+		tnt->hs_index = 0;
+		if (tnt->hs_auth) tnt->hs_early = 1;
+
+		/* decoded in handshake_finish, once the spaces are known; here only the error */
+		if (hdr.code != 0) {
+			TntResult res;
+			result_init(&res, &hdr);
+			(void) parse_reply_body(ctx, &res, rbuf, pkt_end - rbuf, &ctx->f, NULL);
+			if (res.errstr) (void) hv_stores(hv, "errstr", SvREFCNT_inc(res.errstr));
+			result_destroy(&res);
+		}
+		ok = handshake_check(tnt, &hdr, hv, 0, "indexes");
+		if (ok) {
+			if (tnt->hs_index_body) SvREFCNT_dec(tnt->hs_index_body);
+			tnt->hs_index_body = newSVpvn(rbuf, pkt_end - rbuf);
+			tnt->hs_index_schema_id = hdr.schema_id;
+		}
 	}
 
-	self->ruse = end - rbuf;
-	if (self->ruse > 0) {
-		memmove(self->rbuf,rbuf,self->ruse);
+	ctx_release(&tnt->ctxs, ctx);
+	--tnt->pending;
+
+	if (ok) {
+		handshake_step(tnt);
 	}
+}
 
-	FREETMPS;
-	LEAVE;
+static void on_handshake_read(ev_cnn *self, size_t len) {
+	tnt_read(self, on_handshake_reply);
 }
 
 static void on_greet_read(ev_cnn *self, size_t len) {
 
-	ENTER;
-	SAVETMPS;
-
 	do_disable_rw_timer(self);
 
 	TntCnn *tnt = (TntCnn *) self;
@@ -695,6 +1503,9 @@ static void on_greet_read(ev_cnn *self, size_t len) {
 		return;
 	}
 
+	ENTER;
+	SAVETMPS;
+
 	char *tnt_ver_begin = NULL, *tnt_ver_end = NULL;
 	PERL_UNUSED_VAR(tnt_ver_begin);
 	PERL_UNUSED_VAR(tnt_ver_end);
@@ -708,46 +1519,69 @@ static void on_greet_read(ev_cnn *self, size_t len) {
 		memmove(self->rbuf,rbuf,self->ruse);
 	}
 
+	if (tnt->shared_rbuf) {
+		rbuf_pool_attach(&tnt->rb, self);
+	}
+
+	self->on_read = (c_cb_read_t) on_handshake_read;
+	tnt->handshake = TNT_HS_BATCH;
+
+	int deferred = tnt->kept_spaces || tnt->lazy || (tnt->share_schema && schema_shared_cluster(tnt->cluster));
 	if (tnt->username && SvOK(tnt->username) && SvPOK(tnt->username) && tnt->password && SvOK(tnt->password) && SvPOK(tnt->password)) {
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&tnt->ctxs);
 		uint32_t iid;
 		INIT_CTX(tnt, ctx, "auth", iid);
-		SV *pkt = pkt_authenticate(iid, tnt->username, tnt->password, salt_begin, salt_end, NULL);
+		SV *pkt = pkt_authenticate(ctx, iid, tnt->username, tnt->password, salt_begin, salt_end, NULL);
 
-		self->on_read = (c_cb_read_t) on_auth_read;
-		EXEC_REQUEST(tnt, ctxsv, ctx, iid, pkt, NULL);
+		EXEC_REQUEST(tnt, ctx, iid, pkt, NULL);
 		TIMEOUT_TIMER(tnt, ctx, iid, tnt->cnn.rw_timeout);
-	} else {
-		self->on_read = (c_cb_read_t) on_spaces_info_read;
-		// _execute_eval(tnt, _SPACE_SELECTOR);
-		_execute_select(tnt, _VSPACE_SPACEID);
-		// self->on_read = (c_cb_read_t) on_read;
-		// call_connected(tnt);
+		tnt->hs_auth = iid;
+	} else if (deferred && !tnt->share_schema) {
+		TntCtx *ctx = ctx_alloc(&tnt->ctxs);
+		uint32_t iid;
+		INIT_CTX(tnt, ctx, "ping", iid);
+		SV *pkt = pkt_ping(ctx, iid);
+
+		EXEC_REQUEST(tnt, ctx, iid, pkt, NULL);
+		TIMEOUT_TIMER(tnt, ctx, iid, tnt->cnn.rw_timeout);
+		tnt->hs_auth = iid;
+	}
+	if (tnt->share_schema) {
+		SV *name = sv_2mortal(newSVpvs("cluster"));
+		tnt->hs_cluster = _execute_select(tnt, _SCHEMA_SPACEID, sv_2mortal(newRV_noinc((SV *) av_make(1, &name))));
 	}
+	if (!deferred) {
+		handshake_send_selects(tnt);
+	}
+
+	cork_flush(tnt);
+	tnt->handshake = TNT_HS_DIRECT;
 
 	FREETMPS;
 	LEAVE;
 }
 
 void free_reqs (TntCnn *self, const char *message) {
-	if (unlikely(!self->reqs)) return;
+	if (unlikely(!self->reqs.slots)) return;
 
 	ENTER;SAVETMPS;
 
 	dSP;
 
-	HE *ent;
-	(void) hv_iterinit( self->reqs );
-	while ((ent = hv_iternext( self->reqs ))) {
-		TntCtx *ctx = (TntCtx *) SvPVX( HeVAL(ent) );
-		ev_timer_stop(self->cnn.loop,&ctx->t);
-		SvREFCNT_dec(ctx->wbuf);
-		if (ctx->f.size && !ctx->f.nofree) {
-			safefree(ctx->f.f);
-		}
+	TntReqs reqs;
+	TntReqSlot *slot;
+	reqs_detach(&self->reqs, &reqs);
+
+	reqs_foreach(&reqs, slot) {
+		TntCtx *ctx = slot->ctx;
+		deadline_cancel(&self->deadlines, ctx);
+
+		SV *cb = ctx->cb;
+		TntBatch *batch = ctx->batch;
+		uint32_t batch_idx = ctx->batch_idx;
+		ctx_release(&self->ctxs, ctx);
 
-		if (ctx->cb) {
+		if (cb) {
 			SPAGAIN;
 			ENTER; SAVETMPS;
 
@@ -757,19 +1591,23 @@ void free_reqs (TntCnn *self, const char *message) {
 			PUSHs( sv_2mortal(newSVpvf("%s", message)) );
 			PUTBACK;
 
-			(void) call_sv( ctx->cb, G_DISCARD | G_VOID );
+			(void) call_sv( cb, G_DISCARD | G_VOID );
 
 			//SPAGAIN;PUTBACK;
 
-			SvREFCNT_dec(ctx->cb);
+			SvREFCNT_dec(cb);
 
 			FREETMPS; LEAVE;
 		}
 
+		if (batch) {
+			batch_store(batch, batch_idx, NULL, newSVpv(message, 0));
+		}
+
 		--self->pending;
 	}
 
-	hv_clear(self->reqs);
+	reqs_destroy(&reqs);
 
 	FREETMPS;LEAVE;
 }
@@ -778,23 +1616,395 @@ void free_reqs (TntCnn *self, const char *message) {
 static void on_disconnect (TntCnn *self, int err, const char *reason) {
 	ENTER;SAVETMPS;
 
+	cork_discard(self);
+	self->handshake = 0;
+	tnt_big_discard(self);
+	self->head_len = 0;
+	rbuf_pool_detach(&self->rb);
+	streams_drain(self);
+
+	schema_reload_reset(self);
+	lookup_reset(self);
 	if (err == 0) {
 		free_reqs(self, "Connection closed");
+		schema_queue_fail(self, "Connection closed");
 	} else {
 		SV *msg = sv_2mortal(newSVpvf("Disconnected: %s",strerror(err)));
 		free_reqs(self, SvPVX(msg));
+		schema_queue_fail(self, SvPVX(msg));
 	}
 
 	if (self->spaces) {
-		destroy_spaces(self->spaces);
+		if (self->schema_id && self->cnn.on_read == (c_cb_read_t) on_read) {
+			drop_kept_spaces(self);
+			self->kept_spaces = self->spaces;
+			self->kept_schema_id = self->schema_id;
+		} else {
+			destroy_spaces(self->spaces);
+		}
 		self->spaces = NULL;
 	}
+	self->schema_id = 0;
+	handshake_reset(self);
+	++self->schema_gen;
 
 	self->cnn.on_read = (c_cb_read_t) on_greet_read;
 
 	FREETMPS;LEAVE;
 }
 
+/*
+ * batch(): each operation is [ method => args..., $opts?, $cb? ]
+ */
+
+typedef enum {
+	BATCH_PING,
+	BATCH_SELECT,
+	BATCH_INSERT,
+	BATCH_REPLACE,
+	BATCH_UPDATE,
+	BATCH_UPSERT,
+	BATCH_DELETE,
+	BATCH_EVAL,
+	BATCH_CALL,
+	BATCH_UNKNOWN
+} batch_method_t;
+
+static const struct {
+	char    *name;
+	uint32_t nargs;
+	U32      space; /* the first argument is a space, see batch_send_op */
+} batch_methods[] = {
+	{ "ping",    0, 0 },
+	{ "select",  2, 1 },
+	{ "insert",  2, 1 },
+	{ "replace", 2, 1 },
+	{ "update",  3, 1 },
+	{ "upsert",  3, 1 },
+	{ "delete",  2, 1 },
+	{ "eval",    2, 0 },
+	{ "call",    2, 0 },
+};
+
+typedef struct {
+	batch_method_t method;
+	SV           **args;
+	HV            *opts;
+	SV            *cb;
+} TntBatchOp;
+
+/* Returns an error message or NULL if the operation is well-formed */
+static const char *batch_parse_op(SV *opsv, TntBatchOp *op) {
+	if (!opsv || !SvROK(opsv) || SvTYPE(SvRV(opsv)) != SVt_PVAV) {
+		return "Operation must be an ARRAYREF";
+	}
+	AV *av = (AV *) SvRV(opsv);
+	uint32_t argc = av_len(av) + 1;
+	if (argc == 0) {
+		return "Empty operation";
+	}
+
+	if (!AvARRAY(av)[0]) {
+		return "Unknown operation";
+	}
+	STRLEN len;
+	const char *name = SvPV(AvARRAY(av)[0], len);
+	op->method = BATCH_PING;
+	while (op->method < BATCH_UNKNOWN
+	       && !(strlen(batch_methods[op->method].name) == len && memcmp(batch_methods[op->method].name, name, len) == 0)) {
+		++op->method;
+	}
+	if (op->method == BATCH_UNKNOWN) {
+		return "Unknown operation";
+	}
+
+	op->args = AvARRAY(av) + 1;
+	--argc;
+	op->cb = NULL;
+	op->opts = NULL;
+
+	if (argc > 0 && op->args[argc - 1] && SvROK(op->args[argc - 1]) && SvTYPE(SvRV(op->args[argc - 1])) == SVt_PVCV) {
+		op->cb = op->args[--argc];
+	}
+	if (argc == batch_methods[op->method].nargs + 1) {
+		SV *opts = op->args[--argc];
+		if (opts && SvROK(opts) && SvTYPE(SvRV(opts)) == SVt_PVHV) {
+			op->opts = (HV *) SvRV(opts);
+		} else if (opts && SvOK(opts)) {
+			return "Opts must be a HASHREF";
+		}
+	}
+	if (argc != batch_methods[op->method].nargs) {
+		return "Wrong number of arguments";
+	}
+	for (uint32_t i = 0; i < argc; i++) {
+		if (!op->args[i]) return "Missing argument";
+	}
+	return NULL;
+}
+
+/*
+ * An operation that has to wait (see QUEUE_IF_RELOADING, QUEUE_IF_UNKNOWN)
+ * or to be repeated (see CTX_REPLAY) is queued as a call of batch_op_call
+ * with these arguments: the connection, the batch, the position in it and
+ * the operation.
+ */
+static void batch_op_args(SV **args, SV *this, TntBatch *batch, uint32_t idx, SV *opsv) {
+	args[0] = this;
+	args[1] = batch ? sv_2mortal(newSVuv(PTR2UV(batch))) : &PL_sv_undef;
+	args[2] = sv_2mortal(newSVuv(idx));
+	args[3] = opsv;
+}
+
+/*
+ * Every operation comes with a reference to the batch, which its request
+ * takes over, or its result, or the queue while it waits. Operations held
+ * back by batch() go to `held` and are queued only once the whole batch is
+ * encoded; a replayed one is queued again right away (held is NULL).
+ *
+ * Inside an aggregate batch, encoding errors go to the error slot of the
+ * batch instead of croaking, so they end up in the results at their position.
+ */
+static void batch_send_op(TntCnn *self, SV *this, CV *op_cv, TntBatch *batch, uint32_t idx, SV *opsv, TntBatchOp *op, AV **held) {
+	SV *space = batch_methods[op->method].space ? op->args[0] : NULL;
+	SV *args[4];
+
+	if (space && (unlikely(self->reload_sync) || (unlikely(self->lazy) && space_unknown(self, space)))) {
+		SV *wait = self->reload_sync ? NULL : space;
+		batch_op_args(args, this, batch, idx, opsv);
+		if (held) {
+			if (!*held) *held = (AV *) sv_2mortal((SV *) newAV());
+			av_push(*held, schema_queue_entry(wait, op_cv, args, 4));
+		} else {
+			schema_queue_call(self, wait, op_cv, args, 4);
+			if (wait) (void) lookup_start(self, wait, 0);
+		}
+		return;
+	}
+
+	TntCtx *ctx = ctx_alloc(&self->ctxs);
+	uint32_t iid;
+	SV **a = op->args;
+	SV *pkt = NULL;
+	SV *cb = batch ? batch->error : op->cb;
+
+	if (batch) {
+		SvOK_off(batch->error);
+	}
+	INIT_CTX(self, ctx, batch_methods[op->method].name, iid);
+	if (space && self->schema_retry && !self->replaying) {
+		uint32_t i;
+		batch_op_args(args, this, batch, idx, opsv);
+		ctx->replay[0] = SvREFCNT_inc_simple_NN((SV *) op_cv);
+		for (i = 0; i < 4; i++) {
+			ctx->replay[i + 1] = replay_arg(args[i]);
+		}
+		ctx->replay_n = 5;
+	}
+	switch (op->method) {
+		case BATCH_PING:
+			pkt = pkt_ping(ctx, iid);
+			break;
+		case BATCH_SELECT:
+			pkt = pkt_select(ctx, iid, self->spaces, a[0], a[1], op->opts, cb);
+			break;
+		case BATCH_REPLACE:
+			if (!op->opts) op->opts = (HV *) sv_2mortal((SV *) newHV());
+			(void) hv_stores(op->opts, "replace", newSVuv(1));
+			/* fallthrough */
+		case BATCH_INSERT:
+			pkt = pkt_insert(ctx, iid, self->spaces, a[0], a[1], op->opts, cb);
+			break;
+		case BATCH_UPDATE:
+			pkt = pkt_update(ctx, iid, self->spaces, a[0], a[1], a[2], op->opts, cb);
+			break;
+		case BATCH_UPSERT:
+			pkt = pkt_upsert(ctx, iid, self->spaces, a[0], a[1], a[2], op->opts, cb);
+			break;
+		case BATCH_DELETE:
+			pkt = pkt_delete(ctx, iid, self->spaces, a[0], a[1], op->opts, cb);
+			break;
+		case BATCH_EVAL:
+			pkt = pkt_eval(ctx, iid, self->spaces, a[0], a[1], op->opts, cb);
+			break;
+		case BATCH_CALL:
+			pkt = pkt_call(ctx, iid, self->spaces, a[0], a[1], op->opts, cb);
+			break;
+		default:
+			break;
+	}
+	EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, op->opts, op->cb);
+
+	if (batch) {
+		if (pkt) {
+			ctx->batch = batch;
+			ctx->batch_idx = idx;
+		} else {
+			SV *err = SvOK(batch->error) ? newSVsv(batch->error) : newSVpvs("Request was not sent");
+			if (op->cb) {
+				_croak_cb(op->cb, "%" SVf, SVfARG(err));
+			}
+			batch_store(batch, idx, NULL, err);
+		}
+	}
+}
+
+/* Queues the operations held back by batch() and starts the lookups they wait for */
+static void batch_queue_held(TntCnn *self, AV *held) {
+	SSize_t i;
+	for (i = 0; i <= av_len(held); i++) {
+		SV *entry = *av_fetch(held, i, 0);
+		SV *wait = *av_fetch((AV *) SvRV(entry), 0, 0);
+		if (!self->schema_queue) self->schema_queue = newAV();
+		av_push(self->schema_queue, SvREFCNT_inc_simple_NN(entry));
+		if (SvOK(wait)) {
+			(void) lookup_start(self, wait, 0);
+		}
+	}
+}
+
+/* _batch_op($this, $batch, $idx, $op): sends a queued operation of a batch */
+static void batch_op_call(pTHX_ CV *cv) {
+	dXSARGS;
+	if (items != 4) croak_xs_usage(cv, "this, batch, idx, op");
+
+	xs_ev_cnn_self(TntCnn);
+	ENC_GUARD;
+	TntBatch *batch = SvOK(ST(1)) ? INT2PTR(TntBatch *, SvUV(ST(1))) : NULL;
+	TntBatchOp op;
+	(void) batch_parse_op(ST(3), &op);
+	batch_send_op(self, ST(0), cv, batch, (uint32_t) SvUV(ST(2)), ST(3), &op, NULL);
+
+	XSRETURN_UNDEF;
+}
+
+/* Fails a queued operation like batch_send_op fails one that could not be encoded */
+static int batch_op_fail(SV **args, SV *err) {
+	TntBatch *batch = SvOK(args[1]) ? INT2PTR(TntBatch *, SvUV(args[1])) : NULL;
+	TntBatchOp op;
+	(void) batch_parse_op(args[3], &op);
+	if (op.cb) {
+		_croak_cb(op.cb, "%" SVf, SVfARG(err));
+	}
+	if (batch) {
+		batch_store(batch, (uint32_t) SvUV(args[2]), NULL, newSVsv(err));
+	}
+	return op.cb || batch;
+}
+
+/*
+ * The requests of a batch are encoded into the cork buffer and go out
+ * together when the batch is done. If an operation croaks halfway, the
+ * requests already encoded are taken back instead: the buffer is cut back
+ * to where the batch started and their contexts are dropped, so nothing of
+ * the batch is sent.
+ */
+typedef struct {
+	TntCnn   *self;
+	TntBatch *batch;
+	AV       *held;     /* operations waiting for a lookup or the reload, see batch_send_op */
+	uint32_t  first;    /* sync of the first request of the batch */
+	STRLEN    cork_len; /* cork buffer contents from before the batch */
+	uint32_t  cork_n;
+	int       sent;     /* every operation was encoded */
+} TntBatchSend;
+
+static void batch_finish(pTHX_ void *p) {
+	TntBatchSend *bs = (TntBatchSend *) p;
+	TntCnn *self = bs->self;
+	TntCtx *ctx;
+	uint32_t iid;
+
+	if (!bs->sent) {
+		for (iid = bs->first; iid != self->seq + 1; iid++) {
+			if ((ctx = reqs_take(&self->reqs, iid))) {
+				deadline_cancel(&self->deadlines, ctx);
+				if (ctx->cb) SvREFCNT_dec(ctx->cb);
+				ctx_release(&self->ctxs, ctx);
+				--self->pending;
+			}
+		}
+		if (self->cork_buf) SvCUR_set(self->cork_buf, bs->cork_len);
+		self->cork_n = bs->cork_n;
+		if (bs->batch) batch_discard(bs->batch);
+	} else {
+		if (bs->held) batch_queue_held(self, bs->held);
+		if (bs->batch) batch_unref(bs->batch);
+	}
+	cork_leave(self);
+}
+
+
+/*
+ * prepare(): the handle is an anonymous XSUB carrying its TntPrepared, which
+ * is freed with the CV through ext magic.
+ */
+
+static int prepared_mg_free(pTHX_ SV *sv, MAGIC *mg) {
+	prepared_free((TntPrepared *) mg->mg_ptr);
+	return 0;
+}
+
+static MGVTBL prepared_vtbl = { NULL, NULL, NULL, NULL, prepared_mg_free };
+
+/* $handle->($key, $cb) */
+static void prepared_call(pTHX_ CV *cv) {
+	dXSARGS;
+	if (items != 2) croak_xs_usage(cv, "key, cb");
+
+	TntPrepared *p = (TntPrepared *) CvXSUBANY(cv).any_ptr;
+	TntCnn *self = (TntCnn *) p->self;
+	SV *keys = ST(0);
+	SV *cb = ST(1);
+	SV **key;
+	ENC_GUARD;
+	tnt_checkconn_wlimit(self, cb);
+	QUEUE_IF_RELOADING(self);
+	QUEUE_IF_UNKNOWN(self, p->space);
+
+	if (unlikely(p->gen != self->schema_gen)) {
+		if (!self->spaces || !prepared_build(p, self->spaces, self->schema_gen, self->log_level, cb)) {
+			XSRETURN_UNDEF;
+		}
+	}
+
+	AV *fields;
+	if (SvROK(keys) && SvTYPE(SvRV(keys)) == SVt_PVAV) {
+		fields = (AV *) SvRV(keys);
+	} else if (SvROK(keys) && SvTYPE(SvRV(keys)) == SVt_PVHV && p->idx) {
+		fields = hash_to_array_fields((HV *) SvRV(keys), p->idx->fields, true, cb);
+	} else {
+		croak_cb_xsundef(cb, "Input container is invalid. Expecting ARRAYREF or HASHREF");
+	}
+	uint32_t keys_size = av_len(fields) + 1;
+
+	TntCtx *ctx = ctx_alloc(&self->ctxs);
+	uint32_t iid;
+	INIT_CTX(self, ctx, "select", iid);
+	CTX_REPLAY(self, ctx);
+	ctx->space = p->spc;
+	ctx->use_hash = p->use_hash;
+	ctx->compact = p->compact;
+	ctx->lazy = p->lazy;
+	ctx->f = p->spc->f;
+	ctx->f.nofree = 1;
+
+	size_t sz = HEADER_CONST_LEN + p->body_len + mp_sizeof_array(keys_size);
+	unpack_format *fmt = p->fmt;
+	create_buffer(rv, h, sz, TP_SELECT, iid, ctx->schema_id);
+	memcpy(h, p->body, p->body_len);
+	h += p->body_len;
+	h = mp_encode_array(h, keys_size);
+	encode_keys(h, sz, fields, keys_size, fmt, key);
+
+	finish_buffer(rv, h);
+
+	__EXEC_REQUEST(self, ctx, iid, rv, cb);
+	TIMEOUT_TIMER(self, ctx, iid, (p->timeout >= 0 ? p->timeout : self->cnn.rw_timeout));
+
+	XSRETURN_UNDEF;
+}
+
 INLINE SV *get_bool(const char *name) {
 	SV *sv = get_sv(name, 1);
 
@@ -816,9 +2026,29 @@ BOOT:
 
 	types_true  = get_bool("Types::Serialiser::true");
 	types_false = get_bool("Types::Serialiser::false");
+
+	tuple_stash = gv_stashpv("EV::Tarantool16::Tuple", GV_ADD);
+	result_stash = gv_stashpv("EV::Tarantool16::Result", GV_ADD);
+
+	MY_CXT_INIT;
+	tnt_utf8_init();
+
+	newXS("EV::Tarantool16::_batch_op", batch_op_call, __FILE__);
 }
 
 
+void CLONE(...)
+	CODE:
+		PERL_UNUSED_VAR(items);
+		MY_CXT_CLONE;
+		MY_CXT.encbuf = NULL;
+		MY_CXT.encops = NULL;
+		MY_CXT.encops_cap = 0;
+		MY_CXT.enc_busy = 0;
+		MY_CXT.encdest = NULL;
+		MY_CXT.rbuf_pools = NULL;
+
+
 void new(SV *pk, HV *conf)
 	PPCODE:
 		PERL_UNUSED_VAR(pk);
@@ -828,13 +2058,17 @@ void new(SV *pk, HV *conf)
 		self->on_disconnect_before = (c_cb_discon_t) on_disconnect;
 		self->cnn.on_read = (c_cb_read_t) on_greet_read;
 
-		self->reqs = newHV();
+		reqs_init(&self->reqs, TNT_REQS_INITIAL_SIZE);
+		ctx_pool_init(&self->ctxs);
+		deadlines_init(&self->deadlines, self->cnn.loop, on_request_timer);
+		ev_prepare_init(&self->flush_w, on_cork_prepare);
 		self->use_hash = 1;
 		self->spaces = NULL;
 		self->spaces = NULL;
 
 		SV **key;
 		if ((key = hv_fetchs(conf, "hash", 0)) ) self->use_hash = SvOK(*key) ? SvIV(*key) : 0;
+		if ((key = hv_fetchs(conf, "compact", 0)) ) self->compact = SvTRUE(*key) ? 1 : 0;
 		if ((key = hv_fetchs(conf, "username", 0)) && SvPOK(*key)) SvREFCNT_inc(self->username = *key);
 		if ((key = hv_fetchs(conf, "password", 0)) && SvPOK(*key)) SvREFCNT_inc(self->password = *key);
 		if ((key = hv_fetchs(conf, "log_level", 0)) && (SvOK(*key) && SvIOK(*key))) {
@@ -850,6 +2084,20 @@ void new(SV *pk, HV *conf)
 				self->wbuf_limit = TNT_WBUF_LIMIT;
 			}
 		}
+		if ((key = hv_fetchs(conf, "autocork", 0))) self->autocork = SvTRUE(*key) ? 1 : 0;
+		if ((key = hv_fetchs(conf, "shared_read_buffer", 0))) self->shared_rbuf = SvTRUE(*key) ? 1 : 0;
+		self->schema_retry = 1;
+		if ((key = hv_fetchs(conf, "schema_retry", 0))) self->schema_retry = SvTRUE(*key) ? 1 : 0;
+		if ((key = hv_fetchs(conf, "share_schema", 0))) self->share_schema = SvTRUE(*key) ? 1 : 0;
+		if ((key = hv_fetchs(conf, "spaces", 0)) && SvOK(*key)) {
+			if (!SvROK(*key) || SvTYPE(SvRV(*key)) != SVt_PVAV) croak("Option 'spaces' must be an array reference");
+			self->lazy = 1;
+			self->preload = av_make(av_len((AV *) SvRV(*key)) + 1, AvARRAY((AV *) SvRV(*key)));
+		}
+		if ((key = hv_fetchs(conf, "schema_cache", 0)) && SvOK(*key)) {
+			self->schema_file = newSVsv(*key);
+			self->kept_spaces = schema_file_load(self->schema_file, &self->kept_schema_id, self->log_level);
+		}
 
 		XSRETURN(1);
 
@@ -860,18 +2108,34 @@ void DESTROY(SV *this)
 		xs_ev_cnn_self(TntCnn);
 
 		if (!PL_dirty) {
-			if (self->reqs) {
+			streams_abort(self, "Destroyed");
+			if (self->reqs.slots) {
 				free_reqs(self, "Destroyed");
-				SvREFCNT_dec(self->reqs);
-				self->reqs = NULL;
+				reqs_destroy(&self->reqs);
 			}
+			ctx_pool_destroy(&self->ctxs);
 			if (self->spaces) {
 				destroy_spaces(self->spaces);
 				self->spaces = NULL;
 			}
+			drop_kept_spaces(self);
+			schema_reload_reset(self);
+			lookup_reset(self);
+			schema_queue_fail(self, "Destroyed");
 		}
+		deadlines_stop(&self->deadlines);
+		if (ev_is_active(&self->flush_w)) ev_prepare_stop(self->cnn.loop, &self->flush_w);
+		if (self->cork_buf) SvREFCNT_dec(self->cork_buf);
+		tnt_big_discard(self);
+		rbuf_pool_detach(&self->rb);
 		if (self->username) SvREFCNT_dec(self->username);
 		if (self->password) SvREFCNT_dec(self->password);
+		if (self->schema_file) SvREFCNT_dec(self->schema_file);
+		if (self->schema_body) SvREFCNT_dec(self->schema_body);
+		if (self->hs_index_body) SvREFCNT_dec(self->hs_index_body);
+		if (self->cluster) SvREFCNT_dec(self->cluster);
+		if (self->preload) SvREFCNT_dec(self->preload);
+		if (self->lookup_missing) SvREFCNT_dec(self->lookup_missing);
 		xs_ev_cnn_destroy(self);
 
 
@@ -879,7 +2143,12 @@ void reqs(SV *this)
 	PPCODE:
 		PERL_UNUSED_VAR(this);
 		xs_ev_cnn_self(TntCnn);
-		ST(0) = sv_2mortal(newRV_inc((SV *)self->reqs));
+		HV *view = (HV *) sv_2mortal((SV *) newHV());
+		TntReqSlot *slot;
+		reqs_foreach(&self->reqs, slot) {
+			(void) hv_store_ent(view, sv_2mortal(newSVuv(slot->id)), newSVpv(slot->ctx->call, 0), 0);
+		}
+		ST(0) = sv_2mortal(newRV_inc((SV *) view));
 		XSRETURN(1);
 
 
@@ -897,22 +2166,124 @@ void sync(SV *this)
 		ST(0) = sv_2mortal(newSViv(self->seq));
 		XSRETURN(1);
 
+void schema_id(SV *this)
+	PPCODE:
+		PERL_UNUSED_VAR(this);
+		xs_ev_cnn_self(TntCnn);
+		ST(0) = self->spaces && self->schema_id ? sv_2mortal(newSVuv(self->schema_id)) : &PL_sv_undef;
+		XSRETURN(1);
+
+void _index_parts(SV *this, SV *space, SV *index, ...)
+	PPCODE:
+		PERL_UNUSED_VAR(this);
+		xs_ev_cnn_self(TntCnn);
+		SV *cb = items > 3 ? ST(3) : NULL;
+		if (!self->spaces) croak("Not connected");
+		if (cb) QUEUE_IF_UNKNOWN(self, space);
+		TntSpace *spc = evt_find_space(space, self->spaces, self->log_level, NULL);
+		TntIndex *idx = spc && spc->indexes ? evt_find_index(spc, &index, self->log_level) : NULL;
+		if (!idx) croak("Unknown index %s in space %s", SvPV_nolen(index), SvPV_nolen(space));
+
+		/* [ field no, name, position among the unnamed fields of a hash tuple ], unique */
+		AV *parts = newAV();
+		uint32_t i, k, unnamed;
+		SV **name, **unique;
+		av_extend(parts, idx->parts_count);
+		for (i = 0; i < idx->parts_count; i++) {
+			AV *part = newAV();
+			name = spc->fields ? av_fetch(spc->fields, idx->parts[i], 0) : NULL;
+			av_push(part, newSVuv(idx->parts[i]));
+			av_push(part, name && *name ? SvREFCNT_inc_NN(*name) : newSV(0));
+			for (k = 0, unnamed = 0; k < idx->parts[i]; k++) {
+				SV **n = spc->fields ? av_fetch(spc->fields, k, 0) : NULL;
+				if (!n || !*n) ++unnamed;
+			}
+			av_push(part, newSVuv(unnamed));
+			av_push(parts, newRV_noinc((SV *) part));
+		}
+		unique = idx->opts ? hv_fetchs(idx->opts, "unique", 0) : NULL;
+		SV *parts_rv = sv_2mortal(newRV_noinc((SV *) parts));
+		SV *is_unique = idx->id == 0 || (unique && SvTRUE(*unique)) ? &PL_sv_yes : &PL_sv_no;
+
+		/* with a callback, the lookup of a lazy space is waited for */
+		if (cb) {
+			ENTER; SAVETMPS;
+
+			PUSHMARK(SP);
+			EXTEND(SP, 2);
+			PUSHs( parts_rv );
+			PUSHs( is_unique );
+			PUTBACK;
+
+			(void) call_sv(cb, G_DISCARD | G_VOID);
+
+			SPAGAIN;
+			FREETMPS; LEAVE;
+			XSRETURN_UNDEF;
+		}
+		EXTEND(SP, 2);
+		ST(0) = parts_rv;
+		ST(1) = is_unique;
+		XSRETURN(2);
+
+void cork(SV *this)
+	PPCODE:
+		PERL_UNUSED_VAR(this);
+		xs_ev_cnn_self(TntCnn);
+		++self->corked;
+		XSRETURN_UNDEF;
+
+void uncork(SV *this)
+	PPCODE:
+		PERL_UNUSED_VAR(this);
+		xs_ev_cnn_self(TntCnn);
+		cork_leave(self);
+		XSRETURN_UNDEF;
+
+void autocork(SV *this, ...)
+	PPCODE:
+		PERL_UNUSED_VAR(this);
+		xs_ev_cnn_self(TntCnn);
+		if (items > 1) {
+			self->autocork = SvTRUE(ST(1)) ? 1 : 0;
+			if (!self->autocork && !self->corked) {
+				cork_flush(self);
+			}
+		}
+		ST(0) = sv_2mortal(newSVuv(self->autocork));
+		XSRETURN(1);
+
+void ctx_pool_stats(SV *this)
+	PPCODE:
+		PERL_UNUSED_VAR(this);
+		xs_ev_cnn_self(TntCnn);
+		HV *stats = (HV *) sv_2mortal((SV *) newHV());
+		UV allocated = (UV) self->ctxs.nslabs * TNT_CTX_SLAB_SIZE;
+		(void) hv_stores(stats, "hits", newSVuv(self->ctxs.hits));
+		(void) hv_stores(stats, "misses", newSVuv(self->ctxs.misses));
+		(void) hv_stores(stats, "slabs", newSVuv(self->ctxs.nslabs));
+		(void) hv_stores(stats, "allocated", newSVuv(allocated));
+		(void) hv_stores(stats, "free", newSVuv(self->ctxs.nfree));
+		(void) hv_stores(stats, "in_use", newSVuv(allocated - self->ctxs.nfree));
+		ST(0) = sv_2mortal(newRV_inc((SV *) stats));
+		XSRETURN(1);
+
 
 void ping(SV *this, ... )
 	PPCODE:
 		PERL_UNUSED_VAR(this);
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 3 ? ST( 1 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "ping", iid);
-		SV *pkt = pkt_ping(iid);
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		SV *pkt = pkt_ping(ctx, iid);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
 
 		XSRETURN_UNDEF;
 
@@ -922,36 +2293,65 @@ void select( SV *this, SV *space, SV *keys, ... )
 		PERL_UNUSED_VAR(this);
 		// TODO: croak cleanup may be solved with refcnt+mortal
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
+		QUEUE_IF_RELOADING(self);
+		QUEUE_IF_UNKNOWN(self, space);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 5 ? ST( 3 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "select", iid);
+		CTX_REPLAY(self, ctx);
 		SV *pkt = pkt_select(ctx, iid, self->spaces, space, keys, opts, cb );
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
 
 		XSRETURN_UNDEF;
 
 
+void prepare( SV *this, SV *method, SV *space, ... )
+	PPCODE:
+		xs_ev_cnn_self(TntCnn);
+		if (!strEQ(SvPV_nolen(method), "select")) croak("Only select can be prepared, not %s", SvPV_nolen(method));
+		if (!self->spaces) croak("Not connected");
+
+		HV *opts = NULL;
+		GET_OPTS(opts, items == 4 ? ST( 3 ) : 0, NULL);
+		TntPrepared *p = prepared_new(space, opts, self->use_hash, self->compact, self->log_level);
+		p->self = self;
+		p->owner = SvREFCNT_inc(SvRV(this));
+
+		CV *cv = newXS(NULL, prepared_call, __FILE__);
+		CvXSUBANY(cv).any_ptr = p;
+		sv_magicext((SV *) cv, NULL, PERL_MAGIC_ext, &prepared_vtbl, (char *) p, 0);
+		ST(0) = sv_2mortal(newRV_noinc((SV *) cv));
+
+		if (!self->lazy || !space_unknown(self, space)) {
+			(void) prepared_build(p, self->spaces, self->schema_gen, self->log_level, NULL);
+		}
+		XSRETURN(1);
+
+
 void insert( SV *this, SV *space, SV *t, ... )
 	PPCODE:
 		PERL_UNUSED_VAR(this);
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
+		QUEUE_IF_RELOADING(self);
+		QUEUE_IF_UNKNOWN(self, space);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 5 ? ST( 3 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "insert", iid);
+		CTX_REPLAY(self, ctx);
 		SV *pkt = pkt_insert(ctx, iid, self->spaces, space, t, opts, cb );
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
 
 		XSRETURN_UNDEF;
 
@@ -959,18 +2359,21 @@ void replace( SV *this, SV *space, SV *t, ... )
 	PPCODE:
 		PERL_UNUSED_VAR(this);
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
+		QUEUE_IF_RELOADING(self);
+		QUEUE_IF_UNKNOWN(self, space);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 5 ? ST( 3 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "replace", iid);
+		CTX_REPLAY(self, ctx);
 		(void) hv_stores(opts, "replace", newSVuv(1));
 		SV *pkt = pkt_insert(ctx, iid, self->spaces, space, t, opts, cb );
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
 
 		XSRETURN_UNDEF;
 
@@ -979,17 +2382,20 @@ void update( SV *this, SV *space, SV *key, SV *operations, ... )
 	PPCODE:
 		PERL_UNUSED_VAR(this);
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
+		QUEUE_IF_RELOADING(self);
+		QUEUE_IF_UNKNOWN(self, space);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 6 ? ST( 4 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "update", iid);
+		CTX_REPLAY(self, ctx);
 		SV *pkt = pkt_update(ctx, iid, self->spaces, space, key, operations, opts, cb );
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
 
 		XSRETURN_UNDEF;
 
@@ -998,17 +2404,20 @@ void upsert( SV *this, SV *space, SV *tuple, SV *operations, ... )
 	PPCODE:
 		PERL_UNUSED_VAR(this);
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
+		QUEUE_IF_RELOADING(self);
+		QUEUE_IF_UNKNOWN(self, space);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 6 ? ST( 4 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "upsert", iid);
+		CTX_REPLAY(self, ctx);
 		SV *pkt = pkt_upsert(ctx, iid, self->spaces, space, tuple, operations, opts, cb );
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
 
 		XSRETURN_UNDEF;
 
@@ -1017,17 +2426,20 @@ void delete( SV *this, SV *space, SV *t, ... )
 	PPCODE:
 		PERL_UNUSED_VAR(this);
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
+		QUEUE_IF_RELOADING(self);
+		QUEUE_IF_UNKNOWN(self, space);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 5 ? ST( 3 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "delete", iid);
+		CTX_REPLAY(self, ctx);
 		SV *pkt = pkt_delete(ctx, iid, self->spaces, space, t, opts, cb );
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
 
 		XSRETURN_UNDEF;
 
@@ -1037,17 +2449,17 @@ void eval( SV *this, SV *expression, SV *t, ... )
 		PERL_UNUSED_VAR(this);
 		// TODO: croak cleanup may be solved with refcnt+mortal
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 5 ? ST( 3 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "eval", iid);
 		SV *pkt = pkt_eval(ctx, iid, self->spaces, expression, t, opts, cb );
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
 
 		XSRETURN_UNDEF;
 
@@ -1057,16 +2469,259 @@ void call( SV *this, SV *function_name, SV *t, ... )
 		PERL_UNUSED_VAR(this);
 		// TODO: croak cleanup may be solved with refcnt+mortal
 		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
 		SV *cb = ST(items-1);
-		xs_ev_cnn_checkconn_wlimit(self, cb, self->wbuf_limit);
+		tnt_checkconn_wlimit(self, cb);
 
 		HV *opts = NULL;
 		GET_OPTS(opts, items == 5 ? ST( 3 ) : 0, cb);
-		dSVX(ctxsv, ctx, TntCtx);
-		sv_2mortal(ctxsv);
+		TntCtx *ctx = ctx_alloc(&self->ctxs);
 		uint32_t iid;
 		INIT_CTX(self, ctx, "call", iid);
 		SV *pkt = pkt_call(ctx, iid, self->spaces, function_name, t, opts, cb );
-		EXEC_REQUEST_TIMEOUT(self, ctxsv, ctx, iid, pkt, opts, cb);
+		EXEC_REQUEST_TIMEOUT(self, ctx, iid, pkt, opts, cb);
+
+		XSRETURN_UNDEF;
+
+
+void _encode(SV *data, ...)
+	PPCODE:
+		ENC_GUARD;
+		char fmt = items > 1 && SvOK(ST(1)) ? *SvPV_nolen(ST(1)) : FMT_UNKNOWN;
+		size_t sz = 0;
+		SV *rv = sv_2mortal(newSV(16));
+		SvPOK_on(rv);
+		char *h = encode_obj(data, SvPVX(rv), rv, &sz, fmt);
+		SvCUR_set(rv, h - SvPVX(rv));
+		ST(0) = rv;
+		XSRETURN(1);
+
+void _encode_tuple(SV *tuple, SV *format, int compiled)
+	PPCODE:
+		ENC_GUARD;
+		if (!SvROK(tuple) || SvTYPE(SvRV(tuple)) != SVt_PVAV) croak("Tuple must be an ARRAYREF");
+		AV *fields = (AV *) SvRV(tuple);
+		uint32_t keys_size = av_len(fields) + 1;
+		STRLEN flen;
+		unpack_format f;
+		unpack_format *fmt = &f;
+		size_t sz = 0;
+		SV **key;
+		SV *rv = sv_2mortal(newSV(16));
+		SvPOK_on(rv);
+		char *h = SvPVX(rv);
+
+		ENTER;
+		f.f = SvPV(format, flen);
+		f.size = flen;
+		f.nofree = 1;
+		f.def = FMT_UNKNOWN;
+		f.enc = compiled ? enc_compile(f.f, f.size) : NULL;
+		if (f.enc) SAVEFREEPV(f.enc);
+		encode_keys(h, sz, fields, keys_size, fmt, key);
+		SvCUR_set(rv, h - SvPVX(rv));
+		LEAVE;
+
+		ST(0) = rv;
+		XSRETURN(1);
+
+void batch(SV *this, SV *ops, ...)
+	PPCODE:
+		PERL_UNUSED_VAR(this);
+		xs_ev_cnn_self(TntCnn);
+		ENC_GUARD;
+		SV *cb = items > 2 && SvOK(ST(items-1)) ? ST(items-1) : NULL;
+		tnt_checkconn_wlimit(self, cb);
+
+		if (!SvROK(ops) || SvTYPE(SvRV(ops)) != SVt_PVAV) {
+			croak_cb_xsundef(cb, "Operations must be an ARRAYREF");
+		}
+		AV *list = (AV *) SvRV(ops);
+		uint32_t count = av_len(list) + 1;
+		uint32_t i;
+		TntBatchOp op;
+
+		for (i = 0; i < count; i++) {
+			SV **opsv = av_fetch(list, i, 0);
+			const char *err = batch_parse_op(opsv ? *opsv : NULL, &op);
+			if (err) {
+				croak_cb_xsundef(cb, "Bad batch operation #%u: %s", (unsigned) i, err);
+			}
+		}
+
+		TntBatchSend *bs;
+
+		ENTER;
+		/* on the heap: a croak may unwind the scope after this frame is gone */
+		Newx(bs, 1, TntBatchSend);
+		SAVEFREEPV(bs);
+		bs->self = self;
+		bs->batch = cb ? batch_new(cb, count) : NULL;
+		bs->held = NULL;
+		bs->first = self->seq + 1;
+		bs->cork_len = self->cork_buf ? SvCUR(self->cork_buf) : 0;
+		bs->cork_n = self->cork_n;
+		bs->sent = 0;
+		++self->corked;
+		SAVEDESTRUCTOR_X(batch_finish, bs);
+
+		CV *op_cv = get_cv("EV::Tarantool16::_batch_op", 0);
+		for (i = 0; i < count; i++) {
+			SV *opsv = *av_fetch(list, i, 0);
+			(void) batch_parse_op(opsv, &op);
+			if (bs->batch) ++bs->batch->left;
+			batch_send_op(self, ST(0), op_cv, bs->batch, i, opsv, &op, &bs->held);
+		}
+		bs->sent = 1;
+
+		LEAVE;
+		XSRETURN_UNDEF;
+
+
+MODULE = EV::Tarantool16      PACKAGE = EV::Tarantool16::Tuple
+
+void DESTROY(SV *this)
+	PPCODE:
+		xs_tuple_self(t);
+		tuple_destroy(t);
+		XSRETURN_UNDEF;
+
+void size(SV *this)
+	PPCODE:
+		xs_tuple_self(t);
+		ST(0) = sv_2mortal(newSVuv(t->size));
+		XSRETURN(1);
+
+void get(SV *this, UV i)
+	PPCODE:
+		xs_tuple_self(t);
+		SV *v = i <= (UV) UINT32_MAX ? tuple_get(t, (uint32_t) i) : NULL;
+		ST(0) = v ? sv_2mortal(newSVsv(v)) : &PL_sv_undef;
+		XSRETURN(1);
+
+void field(SV *this, SV *name)
+	PPCODE:
+		xs_tuple_self(t);
+		uint32_t no;
+		SV *v = tuple_field_no(t, name, &no) ? tuple_get(t, no) : NULL;
+		ST(0) = v ? sv_2mortal(newSVsv(v)) : &PL_sv_undef;
+		XSRETURN(1);
+
+void exists(SV *this, SV *name)
+	PPCODE:
+		xs_tuple_self(t);
+		uint32_t no;
+		ST(0) = tuple_field_no(t, name, &no) && no < t->size ? &PL_sv_yes : &PL_sv_no;
+		XSRETURN(1);
+
+void names(SV *this)
+	PPCODE:
+		xs_tuple_self(t);
+		uint32_t i, n = t->fields ? av_len(t->fields) + 1 : 0;
+		if (n > t->size) n = t->size;
+		EXTEND(SP, n);
+		for (i = 0; i < n; i++) {
+			SV **name = av_fetch(t->fields, i, 0);
+			PUSHs(name ? sv_2mortal(newSVsv(*name)) : &PL_sv_undef);
+		}
+		XSRETURN(n);
+
+void array(SV *this)
+	PPCODE:
+		xs_tuple_self(t);
+		AV *arr = newAV();
+		uint32_t i;
+		av_extend(arr, t->size);
+		for (i = 0; i < t->size; i++) {
+			av_push(arr, newSVsv(tuple_get(t, i)));
+		}
+		ST(0) = sv_2mortal(newRV_noinc((SV *) arr));
+		XSRETURN(1);
+
+void hash(SV *this)
+	PPCODE:
+		xs_tuple_self(t);
+		HV *hv = newHV();
+		AV *unknown_fields = NULL;
+		uint32_t i, known = t->fields ? av_len(t->fields) + 1 : 0;
+		hv_ksplit(hv, known);
+		SV **name;
+		for (i = 0; i < t->size; i++) {
+			SV *v = newSVsv(tuple_get(t, i));
+			if (i < known && (name = av_fetch(t->fields, i, 0)) && *name) {
+				(void) hv_store_ent(hv, *name, v, 0);
+			} else {
+				if (unknown_fields == NULL) {
+					unknown_fields = newAV();
+				}
+				av_push(unknown_fields, v);
+			}
+		}
+		if (unknown_fields != NULL) {
+			(void) hv_stores(hv, "", newRV_noinc((SV *) unknown_fields));
+		}
+		ST(0) = sv_2mortal(newRV_noinc((SV *) hv));
+		XSRETURN(1);
+
+
+MODULE = EV::Tarantool16      PACKAGE = EV::Tarantool16::Result
 
+void DESTROY(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		result_destroy(r);
 		XSRETURN_UNDEF;
+
+void code(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		ST(0) = sv_2mortal(newSViv(r->code));
+		XSRETURN(1);
+
+void sync(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		ST(0) = sv_2mortal(newSViv(r->sync));
+		XSRETURN(1);
+
+void schema_id(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		ST(0) = r->schema_id > 0 ? sv_2mortal(newSViv(r->schema_id)) : &PL_sv_undef;
+		XSRETURN(1);
+
+void status(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		SV *status = result_status(r);
+		ST(0) = status ? sv_2mortal(status) : &PL_sv_undef;
+		XSRETURN(1);
+
+void errstr(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		ST(0) = r->errstr ? sv_2mortal(newSVsv(r->errstr)) : &PL_sv_undef;
+		XSRETURN(1);
+
+void count(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		ST(0) = r->tuples ? sv_2mortal(newSViv(av_len(r->tuples) + 1))
+		      : r->rest   ? sv_2mortal(newSViv(r->count)) : &PL_sv_undef;
+		XSRETURN(1);
+
+void tuples(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		ST(0) = r->tuples ? sv_2mortal(newRV_inc((SV *) r->tuples)) : &PL_sv_undef;
+		XSRETURN(1);
+
+void hash(SV *this)
+	PPCODE:
+		xs_result_self(r);
+		if (!r->hv) {
+			r->hv = newHV();
+			result_store_hv(r, r->hv, 0);
+		}
+		ST(0) = sv_2mortal(newRV_inc((SV *) r->hv));
+		XSRETURN(1);
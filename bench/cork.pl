@@ -0,0 +1,78 @@
+#!/usr/bin/env perl
+# Compares write syscalls per request with plain, corked and autocorked writes.
+# Needs a running tarantool with the 'tester' space from t/tnt/app.lua:
+#   perl bench/cork.pl --port 3301 --count 1000 --rounds 20
+
+use strict;
+use 5.010;
+use FindBin;
+use lib "t/lib","lib","$FindBin::Bin/../blib/lib","$FindBin::Bin/../blib/arch";
+use EV;
+use EV::Tarantool16;
+use Time::HiRes 'time';
+use Getopt::Long;
+
+my $host   = '127.0.0.1';
+my $port   = 3301;
+my $space  = 'tester';
+my $count  = 1000;
+my $rounds = 20;
+
+GetOptions(
+	"host=s"   => \$host,
+	"port=i"   => \$port,
+	"space=s"  => \$space,
+	"count=i"  => \$count,
+	"rounds=i" => \$rounds,
+) or die("Error in command line arguments\n");
+
+# write(2)/writev(2) calls done by this process so far (Linux only)
+sub syscw() {
+	open my $f, '<', '/proc/self/io' or die "/proc/self/io: $!";
+	while (<$f>) {
+		return $1 if /^syscw:\s*(\d+)/;
+	}
+	die "no syscw in /proc/self/io";
+}
+
+my $c = EV::Tarantool16->new({
+	host => $host,
+	port => $port,
+	connected => sub { EV::unloop },
+	connfail  => sub { die "connfail: $_[1]\n" },
+	disconnected => sub { die "disconnected: @_\n" },
+});
+$c->connect;
+EV::loop;
+
+sub run {
+	my ($mode) = @_;
+	$c->autocork($mode eq 'autocork' ? 1 : 0);
+
+	my $w0 = syscw;
+	my $t0 = time;
+	for (1..$rounds) {
+		my $left = $count;
+		# all requests of a round are issued from one callback
+		my $t; $t = EV::timer 0, 0, sub {
+			undef $t;
+			$c->cork if $mode eq 'cork';
+			for my $i (1..$count) {
+				$c->select($space, [$i], { limit => 1 }, sub {
+					EV::unloop unless --$left;
+				});
+			}
+			$c->uncork if $mode eq 'cork';
+		};
+		EV::loop;
+	}
+	my $elapsed = time - $t0;
+	my $writes = syscw - $w0;
+	my $total = $count * $rounds;
+	printf "%-9s %8d requests %8d writes %8.4f writes/req %10.0f req/s\n",
+		$mode, $total, $writes, $writes / $total, $total / $elapsed;
+}
+
+run($_) for qw(plain cork autocork);
+
+$c->disconnect;
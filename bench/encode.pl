@@ -0,0 +1,35 @@
+#!/usr/bin/env perl
+# Encoder microbenchmark: msgpack encoding of wide tuples and nested
+# arrays/hashes, without a server.
+#   perl bench/encode.pl --count 100000
+
+use strict;
+use 5.010;
+use FindBin;
+use lib "lib","$FindBin::Bin/../blib/lib","$FindBin::Bin/../blib/arch";
+use EV::Tarantool16;
+use Time::HiRes 'time';
+use Getopt::Long;
+
+my $count = 100000;
+
+GetOptions(
+	"count=i" => \$count,
+) or die("Error in command line arguments\n");
+
+my %data = (
+	flat   => [ 1..10, 'a'..'j' ],
+	wide   => [ map { ($_, -$_, "field$_", $_ / 7) } 1..100 ],
+	nested => [ map { { id => $_, tags => [ 'x'..'z' ], meta => { a => [ 1, 2, { b => 'c' x 20 } ] } } } 1..20 ],
+	string => [ 'x' x 65536 ],
+);
+
+for my $name (qw(flat wide nested string)) {
+	my $v = $data{$name};
+	my $len = length EV::Tarantool16::_encode($v);
+	my $t0 = time;
+	EV::Tarantool16::_encode($v) for 1..$count;
+	my $elapsed = time - $t0;
+	printf "%-7s %8d bytes %10.0f enc/s %8.1f MB/s\n",
+		$name, $len, $count / $elapsed, $len * $count / $elapsed / 1048576;
+}
@@ -0,0 +1,62 @@
+#!/usr/bin/env perl
+# Measures reply processing cost per request as pipeline depth grows.
+# All requests of a round are corked into one write, so replies arrive
+# back to back and are framed out of the same read buffer; with bounded
+# per-packet framing the cost per reply should stay flat across depths.
+# Needs a running tarantool with the 'tester' space from t/tnt/app.lua:
+#   perl bench/pipeline.pl --port 3301 --depths 1,10,100,1000,10000
+
+use strict;
+use 5.010;
+use FindBin;
+use lib "t/lib","lib","$FindBin::Bin/../blib/lib","$FindBin::Bin/../blib/arch";
+use EV;
+use EV::Tarantool16;
+use Time::HiRes 'time';
+use Getopt::Long;
+
+my $host   = '127.0.0.1';
+my $port   = 3301;
+my $space  = 'tester';
+my $depths = '1,10,100,1000,10000';
+my $total  = 100000;
+
+GetOptions(
+	"host=s"   => \$host,
+	"port=i"   => \$port,
+	"space=s"  => \$space,
+	"depths=s" => \$depths,
+	"total=i"  => \$total,
+) or die("Error in command line arguments\n");
+
+my $c = EV::Tarantool16->new({
+	host => $host,
+	port => $port,
+	connected => sub { EV::unloop },
+	connfail  => sub { die "connfail: $_[1]\n" },
+	disconnected => sub { die "disconnected: @_\n" },
+});
+$c->connect;
+EV::loop;
+
+for my $depth (split /,/, $depths) {
+	my $rounds = int($total / $depth) || 1;
+	my $t0 = time;
+	for (1..$rounds) {
+		my $left = $depth;
+		$c->cork;
+		for my $i (1..$depth) {
+			$c->select($space, [$i], { limit => 1 }, sub {
+				EV::unloop unless --$left;
+			});
+		}
+		$c->uncork;
+		EV::loop;
+	}
+	my $elapsed = time - $t0;
+	my $n = $rounds * $depth;
+	printf "depth %6d %8d requests %8.2f us/req %10.0f req/s\n",
+		$depth, $n, $elapsed / $n * 1e6, $n / $elapsed;
+}
+
+$c->disconnect;
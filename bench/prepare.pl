@@ -0,0 +1,66 @@
+#!/usr/bin/env perl
+# Compares primary key selects issued with select() and with a prepared handle.
+# Needs a running tarantool with the 'tester' space from t/tnt/app.lua:
+#   perl bench/prepare.pl --port 3301 --count 10000 --rounds 20
+
+use strict;
+use 5.010;
+use FindBin;
+use lib "t/lib","lib","$FindBin::Bin/../blib/lib","$FindBin::Bin/../blib/arch";
+use EV;
+use EV::Tarantool16;
+use Time::HiRes 'time';
+use Getopt::Long;
+
+my $host   = '127.0.0.1';
+my $port   = 3301;
+my $space  = 'tester';
+my $count  = 10000;
+my $rounds = 20;
+
+GetOptions(
+	"host=s"   => \$host,
+	"port=i"   => \$port,
+	"space=s"  => \$space,
+	"count=i"  => \$count,
+	"rounds=i" => \$rounds,
+) or die("Error in command line arguments\n");
+
+my $c = EV::Tarantool16->new({
+	host => $host,
+	port => $port,
+	autocork => 1,
+	connected => sub { EV::unloop },
+	connfail  => sub { die "connfail: $_[1]\n" },
+	disconnected => sub { die "disconnected: @_\n" },
+});
+$c->connect;
+EV::loop;
+
+my %opts = (index => 0, limit => 1, iterator => 'EQ');
+my $get = $c->prepare(select => $space, \%opts);
+
+sub run {
+	my ($mode) = @_;
+	my $t0 = time;
+	for (1..$rounds) {
+		my $left = $count;
+		my $done = sub { EV::unloop unless --$left };
+		my $t; $t = EV::timer 0, 0, sub {
+			undef $t;
+			if ($mode eq 'prepared') {
+				$get->(['t1','t2',$_], $done) for 1..$count;
+			} else {
+				$c->select($space, ['t1','t2',$_], \%opts, $done) for 1..$count;
+			}
+		};
+		EV::loop;
+	}
+	my $elapsed = time - $t0;
+	my $total = $count * $rounds;
+	printf "%-9s %8d requests %10.0f req/s\n", $mode, $total, $total / $elapsed;
+}
+
+run($_) for qw(select prepared);
+
+$c->disconnect;
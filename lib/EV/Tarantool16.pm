@@ -3,6 +3,7 @@ package EV::Tarantool16;
 use 5.010;
 use strict;
 use warnings;
+use Carp;
 use Types::Serialiser;
 
 our $VERSION = '1.40';
@@ -12,6 +13,9 @@ use EV ();
 require XSLoader;
 XSLoader::load('EV::Tarantool16', $VERSION);
 
+use EV::Tarantool16::Tuple;
+use EV::Tarantool16::Result;
+
 use constant {
 	INDEX_EQ => 0,
 	INDEX_REQ => 1,
@@ -120,13 +124,45 @@ Enable (1) or disable(0) evcnn tracing.
 
 Enable (1) or disable(0) c-ares connection reuse (default = 0).
 
+=item read_buffer => $read_buffer
+
+Size of the read buffer in bytes. A reply that does not fit is reassembled in a separate buffer of its exact size, so the read buffer only has to be large enough for typical replies.
+
+=item shared_read_buffer => $shared
+
+Read into a buffer shared by all connections with this option on the same loop instead of an own read_buffer (default = 0). Partial replies are kept per connection, so the shared buffer is empty between reads; it grows while reads fill it and shrinks back when idle. The connection's own read buffer is released while it is connected, and the shared buffer is freed when the last of its connections disconnects. Callbacks of such connections must not run the event loop recursively.
+
 =item wbuf_limit => $wbuf_limit
 
-Write vector buffer length limit. Defaults to 16384. Set wbuf_limit = 0 to disable write buffer length check on every request.
+Write vector buffer length limit. Defaults to 16384. Set wbuf_limit = 0 to disable write buffer length check on every request. Requests held back by 'cork' or 'autocork' count against the limit too.
+
+=item autocork => $autocork
+
+Enable (1) or disable(0) automatic corking (default = 0). When enabled, requests issued during one event loop iteration are buffered and sent with a single write right before the loop blocks again. See 'cork'.
+
+=item compact => $compact
+
+Default for the per-request 'compact' option (default = 0): return results as EV::Tarantool16::Result objects (see 'Results').
+
+=item schema_cache => $file
+
+Save the schema to $file after it is loaded, and start from the schema in $file when the connection is created. Either way, the handshake skips loading the schema if the server reports the same schema_id as the saved one (see 'schema_id'). The file must not be shared between different servers.
+
+=item schema_retry => $retry
+
+Repeat requests that the server rejected because the schema changed after they were sent (default = 1). See 'Schema changes'. With 0 such requests fail with the server's error, which saves keeping a copy of the arguments of every request.
+
+=item spaces => [ $space_name, ... ]
+
+Load spaces on demand instead of fetching all of them on connect, for servers with very many spaces. The listed spaces are looked up right after connecting, and 'connected' is called once they are known; any other space is looked up by name the first time a request names it, and requests to a space wait until its lookup is done. A lookup takes two round trips (C<_vspace> by name, then C<_vindex> by space id). After a schema change the spaces are looked up again on use. Spaces given by number are not looked up and have no format, and methods that return at once ('prepare' aside, which resolves the space on its first call) only see spaces already looked up. 'batch' operations and 'scan' wait for the lookup like single requests. 'schema_cache' is read but not written in this mode.
+
+=item share_schema => $share
+
+Share one copy of the spaces information among the connections to the same cluster (default = 0). The cluster uuid is read from C<_schema> during the handshake; a connection that finds the same cluster and schema_id already loaded by another one in the process uses that copy instead of loading its own, and on a reconnect waits for the authentication reply before selecting spaces and indexes if a schema of its cluster is shared (the reply tells whether they are needed). A new connection does not know its cluster yet, so it sends the selects right away and drops their replies if a shared schema applies. A schema change loaded by one connection is taken over by the others when they see the new schema_id. EV::Tarantool16::Pool and EV::Tarantool16::Multi turn this on. The user needs read access to C<_schema>; without it the connection keeps a copy of its own.
 
 =item connected => $sub
 
-Called when connection to Tarantool 1.6 instance is established, authenticated successfully and retrieved spaces information from it.
+Called when connection to Tarantool 1.6 instance is established, authenticated successfully and retrieved spaces information from it. The authentication request and the selects of spaces and indexes are sent together right after the greeting, so this takes a single round trip. On reconnect the spaces of the previous connection are reused without fetching if the server's schema_id has not changed; it is checked in the authentication reply (or with a ping when there is no username).
 
 =item connfail => $sub
 
@@ -153,6 +189,12 @@ Disconnect from Tarantool 1.6 instance. EV::Tarantool16->disconnected is called
 
 =cut
 
+=head2 schema_id
+
+Returns the server's schema_id the current spaces were loaded at, or undef if not connected or unknown (the schema changed while it was being loaded).
+
+=cut
+
 =head2 ping $opts, $cb->($result)
 
 Execute ping request
@@ -203,10 +245,38 @@ Request execution timeout
 
 This space definition will be used to decode response tuple
 
+=item lazy => $lazy
+
+Return tuples as EV::Tarantool16::Tuple objects, which keep the raw reply and decode a field only when it is accessed (see 'Tuples').
+
+=item compact => $compact
+
+Return the result as an EV::Tarantool16::Result object instead of a plain hash (see 'Results').
+
+=item fields => [ $name_or_no, ... ]
+
+Decode only the listed fields (names from the space format or field numbers; a string that is not a field name but reads as a number is a field number, and a field may be listed only once); the others are skipped without being converted to Perl values. Array tuples contain the listed fields in the given order, hash tuples only the listed keys. Ignored with 'lazy'.
+
+=item on_chunk => $sub
+
+Deliver the tuples in chunks: $sub->($tuples) is called with an ARRAYREF of at most 'chunk' tuples from successive event loop iterations, then the callback gets the result without 'tuples' (its 'count' is the total). Replies of other requests may be delivered in between.
+
+=item chunk => $chunk
+
+Maximum number of tuples per on_chunk call (default = 1000).
+
 =item in => $in
 
 Format for parsing input (string). One char is for one argument ('s' = string, 'n' = number, 'a' = array, '*' = anything (type is determined automatically))
 
+=item out => $out
+
+Format for decoding result tuples (string), one char per field ('u' = unsigned, 'i' = integer, 'n' = number, 's' = string, 'b' = boolean, 'a' = array, 'm' = map, 'x' = raw bytes, '*' = anything). Defaults to the space format.
+
+=item binary => 1 | [ $name_or_no, ... ]
+
+Return strings of the listed fields (or of all string and untyped fields with 1) as raw bytes, without UTF-8 decoding. Fields beyond the space format can be listed by number up to 1023. Useful for opaque blobs; strings nested in arrays and maps are still decoded.
+
 =back
 
 =back
@@ -241,10 +311,38 @@ Request execution timeout
 
 This space definition will be used to decode response tuple
 
+=item lazy => $lazy
+
+Return tuples as EV::Tarantool16::Tuple objects, which keep the raw reply and decode a field only when it is accessed (see 'Tuples').
+
+=item compact => $compact
+
+Return the result as an EV::Tarantool16::Result object instead of a plain hash (see 'Results').
+
+=item fields => [ $name_or_no, ... ]
+
+Decode only the listed fields (names from the space format or field numbers; a string that is not a field name but reads as a number is a field number, and a field may be listed only once); the others are skipped without being converted to Perl values. Array tuples contain the listed fields in the given order, hash tuples only the listed keys. Ignored with 'lazy'.
+
+=item on_chunk => $sub
+
+Deliver the tuples in chunks: $sub->($tuples) is called with an ARRAYREF of at most 'chunk' tuples from successive event loop iterations, then the callback gets the result without 'tuples' (its 'count' is the total). Replies of other requests may be delivered in between.
+
+=item chunk => $chunk
+
+Maximum number of tuples per on_chunk call (default = 1000).
+
 =item in => $in
 
 Format for parsing input (string). One char is for one argument ('s' = string, 'n' = number, 'a' = array, '*' = anything (type is determined automatically))
 
+=item out => $out
+
+Format for decoding result tuples (string), one char per field ('u' = unsigned, 'i' = integer, 'n' = number, 's' = string, 'b' = boolean, 'a' = array, 'm' = map, 'x' = raw bytes, '*' = anything). Defaults to the space format.
+
+=item binary => 1 | [ $name_or_no, ... ]
+
+Return strings of the listed fields (or of all string and untyped fields with 1) as raw bytes, without UTF-8 decoding. Fields beyond the space format can be listed by number up to 1023. Useful for opaque blobs; strings nested in arrays and maps are still decoded.
+
 =back
 
 =back
@@ -279,6 +377,26 @@ Request execution timeout
 
 Use hash as result
 
+=item compact => $compact
+
+Return the result as an EV::Tarantool16::Result object instead of a plain hash (see 'Results').
+
+=item lazy => $lazy
+
+Return tuples as EV::Tarantool16::Tuple objects, which keep the raw reply and decode a field only when it is accessed (see 'Tuples').
+
+=item fields => [ $name_or_no, ... ]
+
+Decode only the listed fields (names from the space format or field numbers; a string that is not a field name but reads as a number is a field number, and a field may be listed only once); the others are skipped without being converted to Perl values. Array tuples contain the listed fields in the given order, hash tuples only the listed keys. Ignored with 'lazy'.
+
+=item on_chunk => $sub
+
+Deliver the tuples in chunks: $sub->($tuples) is called with an ARRAYREF of at most 'chunk' tuples from successive event loop iterations, then the callback gets the result without 'tuples' (its 'count' is the total). Replies of other requests may be delivered in between.
+
+=item chunk => $chunk
+
+Maximum number of tuples per on_chunk call (default = 1000).
+
 =item index => $index
 
 Index name or id to use
@@ -333,12 +451,33 @@ You can also use string names as the value to this option (like 'EQ' or 'LT').
 
 Format for parsing input (string). One char is for one argument ('s' = string, 'n' = number, 'a' = array, '*' = anything (type is determined automatically))
 
+=item out => $out
+
+Format for decoding result tuples (string), one char per field ('u' = unsigned, 'i' = integer, 'n' = number, 's' = string, 'b' = boolean, 'a' = array, 'm' = map, 'x' = raw bytes, '*' = anything). Defaults to the space format.
+
+=item binary => 1 | [ $name_or_no, ... ]
+
+Return strings of the listed fields (or of all string and untyped fields with 1) as raw bytes, without UTF-8 decoding. Fields beyond the space format can be listed by number up to 1023. Useful for opaque blobs; strings nested in arrays and maps are still decoded.
+
 =back
 
 =back
 
 =cut
 
+=head2 prepare select => $space_name, $opts
+
+Returns a prepared select: a CODEREF called as $handle->($keys, $cb->($result)), same as 'select' with the given options.
+
+	my $get = $c->prepare(select => 'tester', { index => 'pk', limit => 1 });
+	$get->([ $id ], sub { my $res = shift or return warn $_[0]; ... });
+
+Space and index are looked up and the constant part of the request is encoded once, so a call only encodes the keys. They are looked up again automatically after the schema is reloaded (eg. on reconnect). The handle keeps the connection object alive.
+
+Options are those of 'select' (timeout, hash, compact, lazy, index, limit, offset, iterator, in), except 'fields', 'out', 'binary' and 'on_chunk'.
+
+=cut
+
 =head2 insert $space_name, $tuple, $opts, $cb->($result)
 
 Execute insert request
@@ -367,6 +506,10 @@ Request execution timeout
 
 Use hash as result
 
+=item compact => $compact
+
+Return the result as an EV::Tarantool16::Result object instead of a plain hash (see 'Results').
+
 =item replace => $replace
 
 Insert(0) or replace(1) a tuple
@@ -375,6 +518,14 @@ Insert(0) or replace(1) a tuple
 
 Format for parsing input (string). One char is for one argument ('s' = string, 'n' = number, 'a' = array, '*' = anything (type is determined automatically))
 
+=item out => $out
+
+Format for decoding result tuples (string), one char per field ('u' = unsigned, 'i' = integer, 'n' = number, 's' = string, 'b' = boolean, 'a' = array, 'm' = map, 'x' = raw bytes, '*' = anything). Defaults to the space format.
+
+=item binary => 1 | [ $name_or_no, ... ]
+
+Return strings of the listed fields (or of all string and untyped fields with 1) as raw bytes, without UTF-8 decoding. Fields beyond the space format can be listed by number up to 1023. Useful for opaque blobs; strings nested in arrays and maps are still decoded.
+
 =back
 
 =back
@@ -421,6 +572,10 @@ Request execution timeout
 
 Use hash as result
 
+=item compact => $compact
+
+Return the result as an EV::Tarantool16::Result object instead of a plain hash (see 'Results').
+
 =item index => $index
 
 Index name or id to use
@@ -429,6 +584,14 @@ Index name or id to use
 
 Format for parsing input (string). One char is for one argument ('s' = string, 'n' = number, 'a' = array, '*' = anything (type is determined automatically))
 
+=item out => $out
+
+Format for decoding result tuples (string), one char per field ('u' = unsigned, 'i' = integer, 'n' = number, 's' = string, 'b' = boolean, 'a' = array, 'm' = map, 'x' = raw bytes, '*' = anything). Defaults to the space format.
+
+=item binary => 1 | [ $name_or_no, ... ]
+
+Return strings of the listed fields (or of all string and untyped fields with 1) as raw bytes, without UTF-8 decoding. Fields beyond the space format can be listed by number up to 1023. Useful for opaque blobs; strings nested in arrays and maps are still decoded.
+
 =back
 
 =back
@@ -469,10 +632,22 @@ Request execution timeout
 
 Use hash as result
 
+=item compact => $compact
+
+Return the result as an EV::Tarantool16::Result object instead of a plain hash (see 'Results').
+
 =item in => $in
 
 Format for parsing input (string). One char is for one argument ('s' = string, 'n' = number, 'a' = array, '*' = anything (type is determined automatically))
 
+=item out => $out
+
+Format for decoding result tuples (string), one char per field ('u' = unsigned, 'i' = integer, 'n' = number, 's' = string, 'b' = boolean, 'a' = array, 'm' = map, 'x' = raw bytes, '*' = anything). Defaults to the space format.
+
+=item binary => 1 | [ $name_or_no, ... ]
+
+Return strings of the listed fields (or of all string and untyped fields with 1) as raw bytes, without UTF-8 decoding. Fields beyond the space format can be listed by number up to 1023. Useful for opaque blobs; strings nested in arrays and maps are still decoded.
+
 =back
 
 =back
@@ -507,6 +682,10 @@ Request execution timeout
 
 Use hash as result
 
+=item compact => $compact
+
+Return the result as an EV::Tarantool16::Result object instead of a plain hash (see 'Results').
+
 =item index => $index
 
 Index name or id to use
@@ -515,6 +694,14 @@ Index name or id to use
 
 Format for parsing input (string). One char is for one argument ('s' = string, 'n' = number, 'a' = array, '*' = anything (type is determined automatically))
 
+=item out => $out
+
+Format for decoding result tuples (string), one char per field ('u' = unsigned, 'i' = integer, 'n' = number, 's' = string, 'b' = boolean, 'a' = array, 'm' = map, 'x' = raw bytes, '*' = anything). Defaults to the space format.
+
+=item binary => 1 | [ $name_or_no, ... ]
+
+Return strings of the listed fields (or of all string and untyped fields with 1) as raw bytes, without UTF-8 decoding. Fields beyond the space format can be listed by number up to 1023. Useful for opaque blobs; strings nested in arrays and maps are still decoded.
+
 =back
 
 =back
@@ -529,6 +716,208 @@ Execute call request (added for backward compatibility with EV::Tarantool). See
 
 *lua = \&call;
 
+=head2 Tuples
+
+With the 'lazy' option every tuple of the result is an EV::Tarantool16::Tuple. Fields are decoded on first access and cached:
+
+	$c->select('tester', [], { lazy => 1 }, sub {
+		my $t = $_[0]{tuples}[0];
+		$t->get(0);         # field by number
+		$t->field('name');  # field by name from the space format
+		$t->[0];            # array-style access
+		$t->{name};         # hash-style access
+	});
+
+Methods: get($no), field($name), exists($name) (whether the tuple has a field of that name), names (undef for fields without a name), size, array (fully decoded ARRAYREF), hash (fully decoded HASHREF, like 'hash => 1'). Values are returned as copies, so changing them does not affect the tuple.
+
+=cut
+
+=head2 Results
+
+With the 'compact' option the callback gets an EV::Tarantool16::Result instead of a hash. It is a small C struct holding the reply header and the tuples array; the usual hash is built only if the result is dereferenced as one:
+
+	$c->select('tester', [], { compact => 1 }, sub {
+		my $res = shift or return warn $_[0];
+		$res->tuples;       # same ARRAYREF as $res->{tuples}
+		$res->{count};      # hash-style access still works
+	});
+
+Methods: code, sync, schema_id, status, errstr, count, tuples, hash.
+
+=cut
+
+=head2 batch $operations, $cb->($results)
+
+Send many requests with a single call. Every operation is an ARRAYREF of a method name and the arguments that method takes, with optional $opts and callback at the end:
+
+	$c->batch([
+		[ select => 'tester', [1], { index => 'pk' } ],
+		[ insert => 'tester', [2, 'two'], sub { my ($res, $err) = @_; ... } ],
+		[ call   => 'func', [] ],
+	], sub {
+		my $results = shift;
+		# $results->[1] is [ $res ] or [ undef, $err, $res ], same as arguments of 'insert' callback
+	});
+
+Supported methods: ping, select, insert, replace, update, upsert, delete, eval, call. All requests are encoded in one XS call and sent with a single write. If an operation croaks while being encoded, the batch croaks as a whole and none of its requests is sent. Operations that depend on the schema are held back and repeated on a schema change like single requests (see 'Schema changes'), and keep their positions in the results.
+
+An operation's own callback is called when its reply arrives. $cb, if defined, is called once after all the requests are answered (or timed out, or failed) with an ARRAYREF holding, in order, the argument list every operation's callback gets. Requests that could not be encoded are reported there as [ undef, $error ]. $cb may be undef when every operation has its own callback.
+
+=cut
+
+=head2 Schema changes
+
+select, insert, replace, update, upsert, delete and prepared handles send the schema_id of the connection's spaces, so the server rejects them if the schema has changed since. When any reply reports a new schema_id, _vspace and _vindex are selected again in the background. Such requests issued during the reload wait for it, and rejected ones are repeated afterwards with the new spaces ('schema_retry'), so DDL does not need a reconnect. The arguments are encoded again when the request is repeated, so field names are resolved against the new format. A request is repeated at most once; if it croaks then (say, its tuple no longer fits the new format), its callback gets (undef, $error). Arguments are kept by reference when they are temporaries or constants, and copied otherwise. The same goes for such 'batch' operations, one by one. If the reload fails, the connection is dropped. With 'share_schema' the spaces already reloaded by another connection to the same cluster are taken over without selecting.
+
+=cut
+
+=head2 cork
+
+Hold back requests in a connection-local buffer instead of sending them one by one. Calls may be nested; requests are sent with a single write by the matching 'uncork'. The handshake of a (re)connect is never held back by a cork.
+
+	$c->cork;
+	$c->select($space, [$_], sub { ... }) for 1..1000;
+	$c->uncork;
+
+=head2 uncork
+
+Leave a 'cork' section. The outermost 'uncork' sends all held requests at once.
+
+=head2 autocork [$autocork]
+
+Get or set automatic corking (see 'autocork' option of 'new'). Disabling it sends pending requests immediately.
+
+=head2 ctx_pool_stats
+
+Returns a HASHREF with counters of the connection's request context pool:
+
+=over 4
+
+=item hits
+
+Requests whose context was taken from the free list
+
+=item misses
+
+Requests that had to allocate a new slab of contexts
+
+=item slabs, allocated, free, in_use
+
+Number of slabs, total contexts in them, contexts on the free list and contexts held by in-flight requests
+
+=back
+
+=cut
+
+=head2 scan $space_name, $start_key, $opts, $on_batch->($tuples), $on_done->($count)
+
+Walk a range of an index page by page. Every page is a 'select' starting from the key of the last tuple of the previous page (keyset pagination), so the cost of a page does not depend on how far the scan is. $on_batch gets the tuples of each page in index order, $on_done the total count once the range is exhausted, or (undef, $error) if a request fails.
+
+	$c->scan('tester', [], { index => 'pk', batch => 1000, prefetch => 2 }, sub {
+		my $tuples = shift;
+		...
+	}, sub {
+		my ($count, $err) = @_;
+	});
+
+=over 4
+
+=item $start_key
+
+Key to start from, [] for the whole index. Pages continue from the whole key of the last tuple, so the index must be unique: scan croaks on a non-unique one, or passes the error to $on_done if the space was still being looked up (see 'spaces').
+
+=item $opts
+
+Options of 'select' (except 'limit', 'offset', 'fields' and 'on_chunk'), and:
+
+=over 4
+
+=item batch => $batch
+
+Tuples per page (default = 1000).
+
+=item prefetch => $prefetch
+
+Pages requested at once (default = 1). The pages of one round start from the same key with increasing offsets, and the next round is sent as soon as the last page of the current one arrives.
+
+=item iterator => $iterator
+
+GE (default), GT or ALL to scan forward, LE or LT to scan backward.
+
+=back
+
+=back
+
+=cut
+
+my %SCAN_NEXT = (GE => 'GT', GT => 'GT', ALL => 'GT', LE => 'LT', LT => 'LT');
+my %ITERATOR_NAME = (
+	INDEX_ALL, 'ALL', INDEX_LT, 'LT', INDEX_LE, 'LE', INDEX_GE, 'GE', INDEX_GT, 'GT',
+);
+
+sub scan {
+	my ($self, $space, $key, $opts, $on_batch, $on_done) = @_;
+	my %sel = %{ $opts || {} };
+	my $batch    = delete $sel{batch}    || 1000;
+	my $prefetch = delete $sel{prefetch} || 1;
+	my $it       = delete $sel{iterator} // 'GE';
+	delete @sel{qw(limit offset on_chunk chunk)};
+	croak "Option 'fields' is not supported by scan" if $sel{fields};
+	$it = $ITERATOR_NAME{$it} // $it if $it =~ /^\d+$/;
+	croak "Iterator $it is not supported by scan" unless $SCAN_NEXT{$it};
+	$sel{index} //= 0;
+
+	# waits for the lookup of a space not known yet with the 'spaces' option
+	$self->_index_parts($space, $sel{index}, sub {
+		my $parts = shift or return $on_done && $on_done->(undef, $_[0]);
+		my $unique = shift;
+		croak "Index $sel{index} of space $space is not unique, scan would skip tuples" unless $unique;
+		my $key_of = sub {
+			my $t = shift;
+			return [ map $t->[$_->[0]], @$parts ] if ref $t eq 'ARRAY';
+			return [ map { defined $_->[1] ? $t->{$_->[1]} : $t->{''}[$_->[2]] } @$parts ] if ref $t eq 'HASH';
+			return [ map $t->get($_->[0]), @$parts ];
+		};
+
+		my ($sent, $delivered, $count, $done, $last) = (0, 0, 0, 0, undef);
+		my (%ready, $round);
+		my $finish = sub {
+			return if $done++;
+			undef $round;
+			$on_done->(@_) if $on_done;
+		};
+		my $deliver = sub {
+			while (!$done && exists $ready{$delivered}) {
+				my $n = $delivered++;
+				my $tuples = delete $ready{$n};
+				$count += @$tuples;
+				$on_batch->($tuples) if @$tuples;
+				return $finish->($count) if defined $last && $n >= $last;
+			}
+		};
+		$round = sub {
+			my ($from, $iterator) = @_;
+			my $tail = $sent + $prefetch - 1;
+			for my $i (0..$prefetch-1) {
+				my $n = $sent++;
+				$self->select($space, $from, { %sel, iterator => $iterator, limit => $batch, offset => $i * $batch }, sub {
+					return if $done;
+					my $res = shift or return $finish->(undef, $_[0]);
+					my $tuples = $res->{tuples} || [];
+					$last = $n if @$tuples < $batch && (!defined $last || $n < $last);
+					if ($n == $tail && !defined $last) {
+						$round->($key_of->($tuples->[-1]), $SCAN_NEXT{$iterator});
+					}
+					$ready{$n} = $tuples;
+					$deliver->();
+				});
+			}
+		};
+		$round->($key, $it);
+	});
+	return;
+}
+
 =head2 stats $cb->($result)
 
 Get Tarantool stats
@@ -23,6 +23,9 @@ sub new {
 		cnntrace => 1,
 		ares_reuse => 0,
 		wbuf_limit => 16000,
+		read_buffer => 0x10000,
+		shared_read_buffer => 0,
+		share_schema => 1,
 		servers => [],
 		log_level => 3,
 		one_connected => undef,
@@ -70,7 +73,9 @@ sub new {
 			port => $srv->{port},
 			timeout => $self->{timeout},
 			reconnect => $self->{reconnect},
-			read_buffer => 2*1024*1024,
+			read_buffer => $self->{read_buffer},
+			shared_read_buffer => $self->{shared_read_buffer},
+			share_schema => $self->{share_schema},
 			cnntrace => $self->{cnntrace},
 			ares_reuse => $self->{ares_reuse},
 			wbuf_limit => $self->{wbuf_limit},
@@ -62,6 +62,7 @@ sub new {
 		cnntrace => 1,
 		ares_reuse => 0,
 		wbuf_limit => 16000,
+		share_schema => 1,
 		servers => [],
 		log_level => 3,
 		connected => undef,
@@ -79,10 +80,10 @@ sub new {
 		my %inst_cfg;
 		my $name;
 		if (ref $peer) {
-			%inst_cfg = (read_buffer => 0x100000, %$peer);
+			%inst_cfg = (read_buffer => 0x10000, %$peer);
 		}
 		elsif ($peer =~ m{^(?:|(?<username>[^:@]+):(?<password>[^:]+)\@)(?<host>[^:]+)(?::(?<port>\d+)|)$}) {
-			%inst_cfg = (read_buffer => 0x100000, %+);
+			%inst_cfg = (read_buffer => 0x10000, %+);
 		}
 		else {
 			die "Bad peer config: $peer\n";
@@ -0,0 +1,13 @@
+package EV::Tarantool16::Result;
+
+use 5.010;
+use strict;
+use warnings;
+
+# Methods (code, sync, schema_id, status, errstr, count, tuples, hash) are implemented in Tarantool16.xs
+
+use overload
+	'%{}' => sub { $_[0]->hash },
+	fallback => 1;
+
+1;
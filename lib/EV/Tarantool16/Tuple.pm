@@ -0,0 +1,42 @@
+package EV::Tarantool16::Tuple;
+
+use 5.010;
+use strict;
+use warnings;
+use Carp;
+
+# Methods (get, field, exists, names, size, array, hash) are implemented in Tarantool16.xs
+
+use overload
+	'@{}' => sub {
+		tie my @a, 'EV::Tarantool16::Tuple::Array', $_[0];
+		\@a;
+	},
+	'%{}' => sub {
+		tie my %h, 'EV::Tarantool16::Tuple::Hash', $_[0];
+		\%h;
+	},
+	fallback => 1;
+
+package EV::Tarantool16::Tuple::Array;
+
+sub TIEARRAY  { bless [ $_[1] ], $_[0] }
+sub FETCH     { $_[0][0]->get($_[1]) }
+sub FETCHSIZE { $_[0][0]->size }
+sub EXISTS    { $_[1] < $_[0][0]->size }
+sub STORE     { Carp::croak "Tuple is read-only" }
+{ no warnings 'once'; *STORESIZE = *DELETE = *CLEAR = *PUSH = *POP = *SHIFT = *UNSHIFT = *SPLICE = \&STORE; }
+
+package EV::Tarantool16::Tuple::Hash;
+
+sub TIEHASH  { bless [ $_[1], undef ], $_[0] }
+sub FETCH    { $_[0][0]->field($_[1]) }
+sub EXISTS   { $_[0][0]->exists($_[1]) }
+# names has undef for the fields without a name, which are not keys
+sub FIRSTKEY { my $self = shift; $self->[1] = [ grep defined, $self->[0]->names ]; shift @{ $self->[1] } }
+sub NEXTKEY  { shift @{ $_[0][1] } }
+sub SCALAR   { scalar grep defined, $_[0][0]->names }
+sub STORE    { Carp::croak "Tuple is read-only" }
+{ no warnings 'once'; *DELETE = *CLEAR = \&STORE; }
+
+1;
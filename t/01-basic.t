@@ -6,7 +6,7 @@ use FindBin;
 use lib "t/lib","lib","$FindBin::Bin/../blib/lib","$FindBin::Bin/../blib/arch";
 use EV;
 use Time::HiRes 'sleep','time';
-use Scalar::Util 'weaken';
+use Scalar::Util 'weaken', 'refaddr';
 use Errno;
 use EV::Tarantool16;
 use Test::More;
@@ -29,6 +29,23 @@ my %test_exec = (
 	call => 1,
 	lua => 1,
 	select => 1,
+	batch => 1,
+	lazy => 1,
+	fields => 1,
+	out => 1,
+	compact => 1,
+	chunk => 1,
+	bigreply => 1,
+	sharedbuf => 1,
+	scan => 1,
+	prepare => 1,
+	binary => 1,
+	cork => 1,
+	schemacache => 1,
+	reload => 1,
+	shareschema => 1,
+	lazyspaces => 1,
+	handshake => 1,
 	insert => 1,
 	replace => 1,
 	delete => 1,
@@ -305,6 +322,821 @@ subtest 'Select tests', sub {
 };
 
 
+subtest 'Batch tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{batch};
+	diag '==== Batch tests ====' if $ENV{TEST_VERBOSE};
+
+	my $reply = sub {
+		return {
+			count => scalar @_,
+			tuples => [ @_ ],
+			status => 'ok',
+			code => 0,
+			sync => ignore(),
+			schema_id => ignore(),
+		};
+	};
+
+	my @seen;
+	$c->batch([
+		[ ping => ],
+		[ select => $SPACE_NAME, ['t1','t2',17], {hash => 0}, sub { push @seen, 'select' } ],
+		[ call => 'string_function', [] ],
+		[ select => $SPACE_NAME, ['tt1','tt2',456], {hash => 1} ],
+	], sub {
+		my $res = shift;
+		cmp_deeply $res, [
+			[ { schema_id => ignore(), sync => ignore(), code => 0 } ],
+			[ $reply->(['t1','t2',17,-745,'heyo']) ],
+			[ $reply->(['hello world']) ],
+			[ $reply->({_t1 => 'tt1', _t2 => 'tt2', _t3 => 456, _t4 => 5, _t5 => 's'}) ],
+		] or diag Dumper $res;
+		cmp_deeply \@seen, ['select'], 'per-operation callback called before the aggregate one';
+		EV::unloop;
+	});
+	EV::loop;
+
+	$c->batch([ [ select => 'unknown_space', [] ] ], sub {
+		cmp_deeply $_[0], [ [ undef, 'Unknown space unknown_space' ] ];
+		EV::unloop;
+	});
+	EV::loop;
+
+	$c->batch([ [ frobnicate => 1 ] ], sub {
+		cmp_deeply \@_, [ undef, 'Bad batch operation #0: Unknown operation' ];
+	});
+
+	my $answered = 0;
+	ok !eval {
+		$c->batch([
+			[ select => $SPACE_NAME, ['t1','t2',17], sub { $answered++ } ],
+			[ select => 'unknown_space', [] ],
+		]);
+		1;
+	}, 'batch croaks when an operation cannot be encoded';
+	like $@, qr/Unknown space unknown_space/, 'encode error';
+	$c->ping(sub {
+		is $answered, 0, 'no operation of a failed batch was sent';
+		EV::unloop;
+	});
+	EV::loop;
+};
+
+subtest 'Lazy tuples tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{lazy};
+	diag '==== Lazy tuples tests ====' if $ENV{TEST_VERBOSE};
+
+	$c->select($SPACE_NAME, ['t1','t2',17], {lazy => 1}, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{count}, 1, 'count';
+		my $t = $a->{tuples}[0];
+		isa_ok $t, 'EV::Tarantool16::Tuple';
+		is $t->size, 5, 'size';
+		is $t->get(3), -745, 'get by number';
+		is $t->field('_t5'), 'heyo', 'get by name';
+		is $t->get(5), undef, 'out of range';
+		$_ .= 'x' for $t->get(4), $t->field('_t5'), $t->names;
+		is $t->get(4), 'heyo', 'returned values are copies';
+		is +($t->names)[0], '_t1', 'returned names are copies';
+		is $t->[2], 17, 'array access';
+		is $t->{_t1}, 't1', 'hash access';
+		ok exists $t->{_t5} && !exists $t->{_t6}, 'exists on hash access';
+		cmp_deeply [ sort keys %$t ], [qw(_t1 _t2 _t3 _t4 _t5)], 'keys on hash access';
+		is scalar(%$t), 5, 'hash access in scalar context';
+		cmp_deeply [ $t->names ], [qw(_t1 _t2 _t3 _t4 _t5)], 'names';
+		cmp_deeply $t->array, ['t1','t2',17,-745,'heyo'], 'array';
+		cmp_deeply $t->hash, {_t1 => 't1', _t2 => 't2', _t3 => 17, _t4 => -745, _t5 => 'heyo'}, 'hash';
+		EV::unloop;
+	});
+	EV::loop;
+};
+
+subtest 'Projected fields tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{fields};
+	diag '==== Projected fields tests ====' if $ENV{TEST_VERBOSE};
+
+	my $_plan = [
+		[{hash => 0, fields => ['_t4', 2]}, [ [-745, 17] ]],
+		[{hash => 1, fields => ['_t5', '_t1']}, [ {_t1 => 't1', _t5 => 'heyo'} ]],
+		[{hash => 0, fields => [4, 10]}, [ ['heyo', undef] ]],
+		[{hash => 0, fields => ['4', 0]}, [ ['heyo', 't1'] ]],
+		[{hash => 0, fields => [4_000_000_000]}, [ [undef] ]],
+	];
+
+	for my $p (@$_plan) {
+		$c->select($SPACE_NAME, ['t1','t2',17], $p->[0], sub {
+			my $a = $_[0];
+			diag Dumper \@_ if !$a;
+			cmp_deeply $a->{tuples}, $p->[1];
+			EV::unloop;
+		});
+		EV::loop;
+	}
+
+	$c->select($SPACE_NAME, [], {fields => ['nope']}, sub {
+		cmp_deeply \@_, [undef, re(qr/^Unknown field name: 'nope'/)];
+	});
+
+	$c->select($SPACE_NAME, [], {fields => ['_t1', 0]}, sub {
+		cmp_deeply \@_, [undef, 'Field 0 is listed twice'];
+	});
+};
+
+subtest 'Out format tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{out};
+	diag '==== Out format tests ====' if $ENV{TEST_VERBOSE};
+
+	my $_plan = [
+		[{hash => 0, out => 'ssui*'}, [ ['t1','t2',17,-745,'heyo'] ]],
+		[{hash => 0, out => 'ss'}, [ ['t1','t2',17,-745,'heyo'] ]],
+		[{hash => 1, out => 'ssui'}, [ {_t1 => 't1', _t2 => 't2', _t3 => 17, _t4 => -745, _t5 => 'heyo'} ]],
+		[{hash => 0, out => 'uuuuu'}, [ ['t1','t2',17,-745,'heyo'] ]],
+	];
+
+	for my $p (@$_plan) {
+		$c->select($SPACE_NAME, ['t1','t2',17], $p->[0], sub {
+			my $a = $_[0];
+			diag Dumper \@_ if !$a;
+			cmp_deeply $a->{tuples}, $p->[1];
+			EV::unloop;
+		});
+		EV::loop;
+	}
+
+	$c->select($SPACE_NAME, [], {out => 'x'}, sub {
+		cmp_deeply \@_, [undef, 'Unknown pattern in format: x'];
+	});
+};
+
+subtest 'Compact result tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{compact};
+	diag '==== Compact result tests ====' if $ENV{TEST_VERBOSE};
+
+	$c->select($SPACE_NAME, ['t1','t2',17], {hash => 0, compact => 1}, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		isa_ok $a, 'EV::Tarantool16::Result';
+		is $a->code, 0;
+		is $a->status, 'ok';
+		is $a->count, 1;
+		cmp_deeply $a->tuples, [ ['t1','t2',17,-745,'heyo'] ];
+		cmp_deeply $a->{tuples}, $a->tuples;
+		is $a->{count}, 1;
+		is $a->{sync}, $a->sync;
+		EV::unloop;
+	});
+	EV::loop;
+
+	$c->eval("box.error{reason='compact error',code=42}", [], {compact => 1}, sub {
+		my ($a, $err, $res) = @_;
+		ok !defined $a;
+		like $err, qr/compact error/;
+		isa_ok $res, 'EV::Tarantool16::Result';
+		is $res->status, 'error';
+		is $res->errstr, $err;
+		is $res->{errstr}, $err;
+		EV::unloop;
+	});
+	EV::loop;
+};
+
+subtest 'Chunked delivery tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{chunk};
+	diag '==== Chunked delivery tests ====' if $ENV{TEST_VERBOSE};
+
+	my @chunks;
+	$c->eval("local t = {} for i = 1, 2500 do t[i] = {i} end return unpack(t)", [], {
+		chunk => 1000,
+		on_chunk => sub { push @chunks, $_[0] },
+	}, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{count}, 2500;
+		ok !exists $a->{tuples};
+		cmp_deeply [ map scalar @$_, @chunks ], [ 1000, 1000, 500 ];
+		cmp_deeply [ map @$_, @chunks ], [ map [$_], 1..2500 ];
+		EV::unloop;
+	});
+	EV::loop;
+
+	@chunks = ();
+	$c->select($SPACE_NAME, ['t1','t2',17], {hash => 0, on_chunk => sub { push @chunks, $_[0] }}, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{count}, 1;
+		cmp_deeply \@chunks, [ [ ['t1','t2',17,-745,'heyo'] ] ];
+		EV::unloop;
+	});
+	EV::loop;
+};
+
+subtest 'Large reply tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{bigreply};
+	diag '==== Large reply tests ====' if $ENV{TEST_VERBOSE};
+
+	my $s = EV::Tarantool16->new({
+		host => $tnt->{host},
+		port => $tnt->{port},
+		username => $tnt->{username},
+		password => $tnt->{password},
+		read_buffer => 4096,
+		log_level => $ENV{TEST_VERBOSE} ? 4 : 0,
+		connected => sub { EV::unloop },
+		connfail => sub { diag "@_"; EV::unloop },
+	});
+	$s->connect;
+	EV::loop;
+
+	my @sizes = (100, 200000, 300, 4091, 1000000);
+	my $left = @sizes;
+	my @got;
+	for my $i (0..$#sizes) {
+		$s->eval("return string.rep('x', ...)", [ $sizes[$i] ], sub {
+			my $a = $_[0];
+			diag Dumper \@_ if !$a;
+			$got[$i] = length $a->{tuples}[0];
+			EV::unloop unless --$left;
+		});
+	}
+	EV::loop;
+	cmp_deeply \@got, \@sizes, 'replies around and over read_buffer';
+
+	$s->ping(sub {
+		ok $_[0], 'small reply after large ones';
+		EV::unloop;
+	});
+	EV::loop;
+
+	$s->disconnect;
+};
+
+subtest 'Shared read buffer tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{sharedbuf};
+	diag '==== Shared read buffer tests ====' if $ENV{TEST_VERBOSE};
+
+	my @s = map {
+		EV::Tarantool16->new({
+			host => $tnt->{host},
+			port => $tnt->{port},
+			username => $tnt->{username},
+			password => $tnt->{password},
+			shared_read_buffer => 1,
+			log_level => $ENV{TEST_VERBOSE} ? 4 : 0,
+			connected => sub { EV::unloop },
+			connfail => sub { diag "@_"; EV::unloop },
+		})
+	} 1..2;
+	for (@s) { $_->connect; EV::loop; }
+
+	my @sizes = (10, 70000, 3, 300000, 65531, 1);
+	my $left = 2 * @sizes;
+	my %got;
+	for my $n (0..1) {
+		for my $i (0..$#sizes) {
+			$s[$n]->eval("return string.rep('y', ...)", [ $sizes[$i] ], sub {
+				my $a = $_[0];
+				diag Dumper \@_ if !$a;
+				$got{$n}[$i] = length $a->{tuples}[0];
+				EV::unloop unless --$left;
+			});
+		}
+	}
+	EV::loop;
+	cmp_deeply \%got, { 0 => \@sizes, 1 => \@sizes }, 'interleaved replies through a shared buffer';
+
+	$_->disconnect for @s;
+};
+
+subtest 'Scan tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{scan};
+	diag '==== Scan tests ====' if $ENV{TEST_VERBOSE};
+
+	my @pages;
+	$c->scan($SPACE_NAME, [], {hash => 0, batch => 1, prefetch => 2}, sub {
+		push @pages, [ map $_->[2], @{ $_[0] } ];
+	}, sub {
+		my ($count, $err) = @_;
+		diag $err if !defined $count;
+		is $count, 4;
+		cmp_deeply \@pages, [ [2], [3], [17], [456] ];
+		EV::unloop;
+	});
+	EV::loop;
+
+	my @got;
+	$c->scan($SPACE_NAME, ['tt1','tt2',456], {hash => 1, batch => 2, iterator => 'LT'}, sub {
+		push @got, map $_->{_t3}, @{ $_[0] };
+	}, sub {
+		is $_[0], 3;
+		cmp_deeply \@got, [ 17, 3, 2 ];
+		EV::unloop;
+	});
+	EV::loop;
+
+	eval { $c->scan($SPACE_NAME, [], {iterator => 'EQ'}, sub {}, sub {}) };
+	like $@, qr/not supported by scan/;
+
+	eval { $c->scan($SPACE_NAME, [], {index => 'tt'}, sub {}, sub {}) };
+	like $@, qr/Index tt of space tester is not unique/;
+};
+
+subtest 'Prepared select tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{prepare};
+	diag '==== Prepared select tests ====' if $ENV{TEST_VERBOSE};
+
+	my $get = $c->prepare(select => $SPACE_NAME, { index => 'primary', hash => 0 });
+	is ref $get, 'CODE';
+
+	$get->(['t1','t2',17], sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{count}, 1;
+		cmp_deeply $a->{tuples}, [ ['t1','t2',17,-745,'heyo'] ];
+		EV::unloop;
+	});
+	EV::loop;
+
+	my $range = $c->prepare(select => $SPACE_NAME, { iterator => 'GT', limit => 2, hash => 1 });
+	$range->({ _t1 => 't1', _t2 => 't2', _t3 => 2 }, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		cmp_deeply [ map $_->{_t3}, @{ $a->{tuples} } ], [ 3, 17 ];
+		EV::unloop;
+	});
+	EV::loop;
+
+	eval { $c->prepare(insert => $SPACE_NAME) };
+	like $@, qr/Only select can be prepared/;
+	eval { $c->prepare(select => 'no_such_space') };
+	like $@, qr/Unknown space/;
+};
+
+subtest 'String decoding tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{binary};
+	diag '==== String decoding tests ====' if $ENV{TEST_VERBOSE};
+
+	my $ru = "\x{43f}\x{440}\x{438}\x{432}\x{435}\x{442}";
+	my $lua = "return 'abc', ..., string.rep('x', 40) .. ...";
+	my @args = ( $ru );
+
+	$c->eval($lua, [ @args ], sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		my ($ascii, $text, $long) = map $_->[0], @{ $a->{tuples} };
+		is $ascii, 'abc';
+		ok !utf8::is_utf8($ascii), 'ascii string is not flagged';
+		is $text, $ru;
+		is $long, ('x' x 40) . $ru, 'non-ascii after a long ascii run';
+		EV::unloop;
+	});
+	EV::loop;
+
+	$c->eval($lua, [ @args ], { binary => 1 }, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		my $text = $a->{tuples}[1][0];
+		ok !utf8::is_utf8($text);
+		is length $text, 12, 'raw bytes with binary => 1';
+		EV::unloop;
+	});
+	EV::loop;
+
+	$c->select($SPACE_NAME, ['t1','t2',17], { hash => 1, binary => ['_t1'] }, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{tuples}[0]{_t1}, 't1';
+		is $a->{tuples}[0]{_t5}, 'heyo';
+		EV::unloop;
+	});
+	EV::loop;
+
+	$c->select($SPACE_NAME, [], { binary => [4_000_000_000] }, sub {
+		cmp_deeply \@_, [undef, 'Binary field number 4000000000 is too large'];
+	});
+};
+
+subtest 'Cork tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{cork};
+	diag '==== Cork tests ====' if $ENV{TEST_VERBOSE};
+
+	my $new = sub {
+		EV::Tarantool16->new({
+			host => $tnt->{host},
+			port => $tnt->{port},
+			username => $tnt->{username},
+			password => $tnt->{password},
+			log_level => $ENV{TEST_VERBOSE} ? 4 : 0,
+			connected => sub { EV::unloop },
+			connfail => sub { diag "@_"; EV::unloop },
+			disconnected => sub { EV::unloop },
+			@_,
+		});
+	};
+	my $wait = sub {
+		my $t = EV::timer shift, 0, sub { EV::unloop };
+		EV::loop;
+	};
+
+	my $k = $new->();
+	$k->cork;
+	$k->connect;
+	EV::loop;
+	ok $k->ok, 'a cork left open does not hold back the handshake';
+
+	my $base = $k->sync;
+	my @got;
+	$k->ping(sub { push @got, $_[0]{sync} }) for 1..3;
+	$k->cork;
+	$k->ping(sub { push @got, $_[0]{sync} });
+	$k->uncork;
+	$wait->(0.2);
+	is_deeply \@got, [], 'nothing is sent while corked';
+
+	$k->uncork;
+	$wait->(0.2);
+	is_deeply \@got, [ $base + 1 .. $base + 4 ], 'outermost uncork sends everything in order';
+
+	@got = ();
+	$k->autocork(1);
+	$k->ping(sub { push @got, $_[0]{sync}; EV::unloop if @got == 3 }) for 1..3;
+	is_deeply \@got, [], 'autocork holds requests until the loop blocks';
+	EV::loop;
+	is_deeply \@got, [ $base + 5 .. $base + 7 ], 'autocorked requests are flushed in order';
+	$k->autocork(0);
+
+	{
+		package T16::Nested;
+		sub TIESCALAR { my ($class, $code) = @_; bless { code => $code }, $class }
+		sub FETCH { $_[0]{code}->(); 'nested' }
+	}
+	my %res;
+	tie my $arg, 'T16::Nested', sub { $k->ping(sub { $res{ping} = $_[0]{status} }) };
+	my $big = 'x' x 100_000;
+	$k->cork;
+	$k->eval("return ...", [ $big ], sub { $res{big} = $_[0]{tuples}[0][0] });
+	$k->eval("return ...", [ $arg ], sub { $res{tied} = $_[0]{tuples}[0][0] });
+	$k->uncork;
+	$wait->(0.5);
+	is_deeply \%res, { big => $big, tied => 'nested', ping => 'ok' }, 'corked requests, a large one and one sent while encoding another, arrive intact';
+
+	$k->disconnect;
+	EV::loop;
+
+	my $l = $new->(wbuf_limit => 3);
+	$l->connect;
+	EV::loop;
+	my @err;
+	$l->cork;
+	$l->ping(sub { push @err, $_[1] }) for 1..4;
+	is_deeply \@err, [ 'Write buffer limit exceeded: 3 requests corked' ], 'corked requests are held to wbuf_limit';
+	$l->uncork;
+	$wait->(0.2);
+	is scalar(@err), 4, 'the held requests are sent';
+	$l->disconnect;
+	EV::loop;
+};
+
+subtest 'Schema cache tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{schemacache};
+	diag '==== Schema cache tests ====' if $ENV{TEST_VERBOSE};
+
+	require File::Temp;
+	my $dir = File::Temp::tempdir(CLEANUP => 1);
+	my $new = sub {
+		EV::Tarantool16->new({
+			host => $tnt->{host},
+			port => $tnt->{port},
+			username => $tnt->{username},
+			password => $tnt->{password},
+			schema_cache => "$dir/schema",
+			log_level => $ENV{TEST_VERBOSE} ? 4 : 0,
+			connected => sub { EV::unloop },
+			connfail => sub { diag "@_"; EV::unloop },
+			disconnected => sub { EV::unloop },
+		});
+	};
+	my $check = sub {
+		my ($s, $name) = @_;
+		$s->select($SPACE_NAME, ['t1','t2',17], { hash => 1 }, sub {
+			my $a = $_[0];
+			diag Dumper \@_ if !$a;
+			is $a->{tuples}[0]{_t5}, 'heyo', $name;
+			EV::unloop;
+		});
+		EV::loop;
+	};
+
+	my $s = $new->();
+	$s->connect;
+	EV::loop;
+	is $s->sync, 3, 'auth, _vspace and _vindex on first connect';
+	ok $s->schema_id, 'schema_id is known';
+	ok -s "$dir/schema", 'schema saved';
+	my $schema_id = $s->schema_id;
+
+	$s->disconnect;
+	EV::loop;
+	ok !defined $s->schema_id, 'no schema_id while disconnected';
+
+	my $sync = $s->sync;
+	$s->connect;
+	EV::loop;
+	is $s->sync, $sync + 1, 'only auth on reconnect';
+	is $s->schema_id, $schema_id;
+	$check->($s, 'kept schema works');
+	$s->disconnect;
+	EV::loop;
+
+	my $f = $new->();
+	$f->connect;
+	EV::loop;
+	is $f->sync, 1, 'only auth with schema from file';
+	$check->($f, 'schema from file works');
+	$f->disconnect;
+	EV::loop;
+
+	# well-formed msgpack that the schema parser rejects: a field format map with only a name
+	my $bin = sub { "\xc4" . chr(length $_[0]) . $_[0] };
+	my $spaces = "\x81\x30" . EV::Tarantool16::_encode([ [ 512, 1, 'x', 'memtx', 0, {}, [ { name => 'a' } ] ] ]);
+	my $index = "\x81\x30\x90";
+	open my $fh, '>', "$dir/schema" or die $!;
+	binmode $fh;
+	print $fh "T16S\x01\x93\x01" . $bin->($spaces) . $bin->($index);
+	close $fh;
+
+	my $b = eval { $new->() };
+	ok $b, 'a schema cache that does not parse is ignored' or diag $@;
+	$b->connect;
+	EV::loop;
+	is $b->sync, 3, 'schema loaded from the server';
+	$check->($b, 'schema from server works');
+	$b->disconnect;
+	EV::loop;
+};
+
+subtest 'Shared schema tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{shareschema};
+	diag '==== Shared schema tests ====' if $ENV{TEST_VERBOSE};
+
+	my $new = sub {
+		EV::Tarantool16->new({
+			host => $tnt->{host},
+			port => $tnt->{port},
+			username => $tnt->{username},
+			password => $tnt->{password},
+			share_schema => 1,
+			log_level => $ENV{TEST_VERBOSE} ? 4 : 0,
+			connected => sub { EV::unloop },
+			connfail => sub { diag "@_"; EV::unloop },
+			disconnected => sub { EV::unloop },
+		});
+	};
+
+	my $s1 = $new->();
+	$s1->connect;
+	EV::loop;
+	is $s1->sync, 4, 'auth, cluster, _vspace and _vindex on first connect';
+
+	my $s2 = $new->();
+	$s2->connect;
+	EV::loop;
+	is $s2->sync, 4, 'selects are not held back before the cluster is known';
+	is $s2->schema_id, $s1->schema_id;
+	is refaddr($s2->spaces), refaddr($s1->spaces), 'spaces are shared';
+
+	my $sync = $s2->sync;
+	$s2->disconnect;
+	EV::loop;
+	$s2->connect;
+	EV::loop;
+	is $s2->sync, $sync + 2, 'only auth and cluster on reconnect to a cluster with a shared schema';
+	is refaddr($s2->spaces), refaddr($s1->spaces), 'spaces are still shared';
+
+	$s2->select($SPACE_NAME, ['t1','t2',17], { hash => 1 }, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{tuples}[0]{_t5}, 'heyo', 'shared schema works';
+		EV::unloop;
+	});
+	EV::loop;
+
+	$s1->disconnect;
+	EV::loop;
+	$s2->disconnect;
+	EV::loop;
+};
+
+subtest 'Lazy spaces tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{lazyspaces};
+	diag '==== Lazy spaces tests ====' if $ENV{TEST_VERBOSE};
+
+	my $s = EV::Tarantool16->new({
+		host => $tnt->{host},
+		port => $tnt->{port},
+		username => $tnt->{username},
+		password => $tnt->{password},
+		spaces => [ $SPACE_NAME ],
+		log_level => $ENV{TEST_VERBOSE} ? 4 : 0,
+		connected => sub { EV::unloop },
+		connfail => sub { diag "@_"; EV::unloop },
+		disconnected => sub { EV::unloop },
+	});
+	$s->connect;
+	EV::loop;
+	ok $s->schema_id, 'schema_id is known';
+	is $s->sync, 3, 'auth and the lookup of the preloaded space';
+	ok exists $s->spaces->{$SPACE_NAME}, 'preloaded space is known when connected';
+	ok eval { $s->_index_parts($SPACE_NAME, 0) }, 'methods that need the space work when connected' or diag $@;
+
+	my $left = 3;
+	$s->select($SPACE_NAME, ['t1','t2',17], { hash => 1 }, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{tuples}[0]{_t5}, 'heyo', 'preloaded space works';
+		--$left or EV::unloop;
+	});
+	$s->select('_vspace', [], { limit => 1 }, sub {
+		ok $_[0], 'space looked up on use';
+		--$left or EV::unloop;
+	});
+	$s->select('unknown_space', [], sub {
+		like $_[1], qr/Unknown space/, 'missing space fails';
+		--$left or EV::unloop;
+	});
+	EV::loop;
+
+	$left = 2;
+	$s->batch([
+		[ select => '_vuser', [], { limit => 1 } ],
+		[ select => $SPACE_NAME, ['t1','t2',17] ],
+		[ select => 'unknown_space', [] ],
+	], sub {
+		my $r = shift;
+		ok $r->[0][0], 'batch operation waits for the lookup of its space' or diag Dumper $r;
+		ok $r->[1][0], 'other operations of the batch keep their positions';
+		like $r->[2][1], qr/Unknown space/, 'batch operation on a missing space fails';
+		--$left or EV::unloop;
+	});
+	my $scanned = 0;
+	$s->scan('_vfunc', [], { batch => 1 }, sub { $scanned += @{ $_[0] } }, sub {
+		my ($count, $err) = @_;
+		ok defined $count, 'scan waits for the lookup of its space' or diag $err;
+		is $count, $scanned, 'scan went through the space';
+		--$left or EV::unloop;
+	});
+	EV::loop;
+	ok exists $s->spaces->{_vuser} && exists $s->spaces->{_vfunc}, 'spaces of batch and scan looked up';
+
+	ok !exists $s->spaces->{_vindex}, 'other spaces are not loaded';
+
+	my $base = $s->sync;
+	$left = 3;
+	$s->select('_vindex', [], { limit => 1 }, sub {
+		ok $_[0], 'calls on a space being looked up all get it';
+		--$left or EV::unloop;
+	}) for 1..3;
+	EV::loop;
+	is $s->sync - $base, 2 + 3, 'one lookup for all the calls waiting for the space';
+
+	$s->disconnect;
+	EV::loop;
+};
+
+subtest 'Handshake tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{handshake};
+	diag '==== Handshake tests ====' if $ENV{TEST_VERBOSE};
+
+	my ($connected, $failed);
+	my $new = sub {
+		my $password = shift // $tnt->{password};
+		($connected, $failed) = (0, undef);
+		EV::Tarantool16->new({
+			host => $tnt->{host},
+			port => $tnt->{port},
+			username => $tnt->{username},
+			password => $password,
+			log_level => $ENV{TEST_VERBOSE} ? 4 : 0,
+			connected => sub { $connected = 1; EV::unloop },
+			connfail => sub { $failed = $_[1]; EV::unloop },
+			disconnected => sub { $failed //= $_[1]; EV::unloop },
+		});
+	};
+	my $set_delay = sub {
+		$c->call('set_auth_delay', [ $_[0] ], sub { diag Dumper \@_ if !$_[0]; EV::unloop });
+		EV::loop;
+	};
+
+	my $s = $new->();
+	$s->connect;
+	EV::loop;
+	ok $connected, 'connected';
+	is $s->sync, 3, 'auth, _vspace and _vindex sent at once';
+	ok exists $s->spaces->{$SPACE_NAME}, 'spaces loaded';
+	$s->disconnect;
+	EV::loop;
+
+	$set_delay->(0.2);
+
+	$s = $new->();
+	$s->connect;
+	EV::loop;
+	ok $connected, 'connected with a slow auth' or diag $failed;
+	is $s->sync, 5, 'selects answered before auth are sent again';
+	$s->select($SPACE_NAME, ['t1','t2',17], { hash => 1 }, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{tuples}[0]{_t5}, 'heyo', 'spaces from the repeated selects work';
+		EV::unloop;
+	});
+	EV::loop;
+	$s->disconnect;
+	EV::loop;
+
+	$s = $new->('wrong password');
+	$s->connect;
+	EV::loop;
+	ok !$connected, 'not connected with a wrong password';
+	ok $failed, 'auth failure reported while the selects are in flight';
+	my $w = EV::timer 0.4, 0, sub { EV::unloop };
+	EV::loop;
+	ok !$connected, 'late replies of the selects are ignored';
+
+	$set_delay->(0);
+};
+
+subtest 'Schema reload tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{reload};
+	diag '==== Schema reload tests ====' if $ENV{TEST_VERBOSE};
+
+	my $s = EV::Tarantool16->new({
+		host => $tnt->{host},
+		port => $tnt->{port},
+		username => $tnt->{username},
+		password => $tnt->{password},
+		log_level => $ENV{TEST_VERBOSE} ? 4 : 0,
+		connected => sub { EV::unloop },
+		connfail => sub { diag "@_"; EV::unloop },
+	});
+	$s->connect;
+	EV::loop;
+
+	my $ddl = q{
+		local s = box.schema.space.create('reloader', {if_not_exists = true})
+		s:create_index('pk', {if_not_exists = true})
+		s:format({ {name = 'id', type = 'unsigned'}, {name = 'v', type = '*'} })
+	};
+	my $old = $c->schema_id;
+	my @failed;
+	my $left = 2;
+	$c->eval($ddl, [], sub {
+		diag Dumper \@_ if !$_[0];
+		$c->insert('reloader', { id => [], v => 'bad' }, sub { @failed = @_ });
+		$c->insert('reloader', { id => 1, v => 'one' }, sub {
+			my $a = $_[0];
+			diag Dumper \@_ if !$a;
+			cmp_deeply $a->{tuples}, [ { id => 1, v => 'one' } ], 'request issued during reload waits for the new schema';
+			--$left or EV::unloop;
+		});
+		$c->batch([
+			[ ping => ],
+			[ insert => 'reloader', { id => 2, v => 'two' } ],
+		], sub {
+			my $r = shift;
+			ok $r->[0][0], 'batch operation that does not need the schema is sent';
+			cmp_deeply $r->[1][0]{tuples}, [ { id => 2, v => 'two' } ], 'batch operation issued during reload waits for the new schema'
+				or diag Dumper $r;
+			--$left or EV::unloop;
+		});
+	});
+	EV::loop;
+	isnt $c->schema_id, $old, 'schema_id updated';
+	cmp_deeply \@failed, [ undef, re(qr/Incompatible types/) ], 'a waiting request that croaks gets the error in its callback';
+
+	$left = 2;
+	$s->select($SPACE_NAME, ['t1','t2',17], { hash => 1 }, sub {
+		my $a = $_[0];
+		diag Dumper \@_ if !$a;
+		is $a->{tuples}[0]{_t5}, 'heyo', 'stale request repeated after reload';
+		is $s->schema_id, $c->schema_id, 'schema reloaded';
+		--$left or EV::unloop;
+	});
+	$s->batch([
+		[ ping => ],
+		[ select => $SPACE_NAME, ['t1','t2',17], { hash => 1 } ],
+	], sub {
+		my $r = shift;
+		is $r->[1][0]{tuples}[0]{_t5}, 'heyo', 'stale batch operation repeated after reload, at its position'
+			or diag Dumper $r;
+		--$left or EV::unloop;
+	});
+	EV::loop;
+
+	$c->eval("box.space.reloader:drop()", [], sub { EV::unloop });
+	EV::loop;
+	$s->disconnect;
+};
+
 subtest 'Insert tests', sub {
 	plan( skip_all => 'skip') if !$test_exec{insert};
 	diag '==== Insert tests ====' if $ENV{TEST_VERBOSE};
@@ -26,6 +26,7 @@ my %test_exec = (
 	delete => 1,
 	update => 1,
 	upsert => 1,
+	many => 1,
 );
 
 my $cfs = 0;
@@ -520,5 +521,27 @@ subtest 'Upsert tests', sub {
 
 };
 
+subtest 'Many timeouts tests', sub {
+	plan( skip_all => 'skip') if !$test_exec{many};
+	diag '==== Many timeouts tests ===' if $ENV{TEST_VERBOSE};
+
+	# more distinct values than there are deadline queues, twice, so that
+	# drained queues get reused
+	for my $round (1, 2) {
+		my @timeouts = map { 0.02 * $_ + 0.005 * $round } 1 .. 12;
+		my @order;
+		my $left = @timeouts;
+		for my $t (reverse(@timeouts[0 .. 5]), @timeouts[6 .. 11]) {
+			$c->eval("require('fiber').sleep(1)", [], { timeout => $t }, sub {
+				is $_[1], "Request timed out";
+				push @order, $t;
+				--$left or EV::unloop;
+			});
+		}
+		EV::loop;
+		is_deeply \@order, \@timeouts, "round $round: requests expire in deadline order";
+	}
+};
+
 
 done_testing();
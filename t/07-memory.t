@@ -192,6 +192,10 @@ subtest 'basic memory test', sub {
 	memcheck 50000, $c, "update",[$SPACE_NAME,{_t1 => 't1',_t2 => 't2',_t3 => 17}, [ [3 => '+', 1] ], { hash => 1 }];
 	memcheck 50000, $c, "upsert",[$SPACE_NAME,{_t1 => 't1',_t2 => 't2',_t3 => 17}, [ [3 => '=', 1] ], { hash => 1 }];
 	memcheck 50000, $c, "eval",["return {box.info}", [], { timeout => 0.00001 }];
+
+	my $pool = $c->ctx_pool_stats;
+	is $pool->{in_use}, 0, 'all request contexts returned to the pool';
+	cmp_ok $pool->{misses}, '<=', 2, 'request contexts are reused' or diag Dumper $pool;
 };
 
 done_testing;
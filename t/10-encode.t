@@ -0,0 +1,84 @@
+use strict;
+use warnings;
+
+use FindBin;
+use lib "t/lib","lib","$FindBin::Bin/../blib/lib","$FindBin::Bin/../blib/arch";
+
+use Test::More;
+use EV::Tarantool16;
+
+{
+	package Counter;
+	sub TIESCALAR { my $n = 0; bless \$n, shift }
+	sub FETCH     { my $self = shift; 'x' x ++$$self }
+}
+
+subtest 'Encoder tests', sub {
+	is unpack('H*', EV::Tarantool16::_encode([ 1, -1, 'ab', undef, { a => 1 } ])), '9501ffa26162c081a16101';
+	is unpack('H*', EV::Tarantool16::_encode([ [ [ 300 ] ], [], {} ])), '939191cd012c9080';
+	is unpack('H*', EV::Tarantool16::_encode(1.5)), 'cb3ff8000000000000';
+	is unpack('H*', EV::Tarantool16::_encode(42, 's')), 'a23432';
+	is unpack('H*', EV::Tarantool16::_encode('17', 'u')), '11';
+
+	my $big = [ map { { n => $_, s => 'v' x $_ } } 1..200 ];
+	my $enc = EV::Tarantool16::_encode($big);
+	my $size = 3;  # array16
+	for (1..200) {
+		$size += 1 + 2 + 2;                   # fixmap, keys 'n' and 's'
+		$size += $_ < 128 ? 1 : 2;            # positive fixint or uint8
+		$size += ($_ < 32 ? 1 : 2) + $_;      # fixstr or str8
+	}
+	is length $enc, $size, 'exact size of a nested structure';
+
+	eval { EV::Tarantool16::_encode([], 'u') };
+	like $@, qr/Incompatible types/;
+};
+
+subtest 'Magical values', sub {
+	# @_ aliases the magical scalars, so the encoder fetches them itself
+	my $encode = sub { EV::Tarantool16::_encode(\@_) };
+
+	tie my $s, 'Counter';
+	is unpack('H*', $encode->($s, $s)), '92a178a27878', 'every fetch of a tied scalar is kept';
+	is unpack('H*', EV::Tarantool16::_encode($s, 's')), 'a3787878', 'tied scalar with a format';
+
+	'abc' =~ /(b)/;
+	is unpack('H*', $encode->($1, $1)), '92a162a162', 'capture variable';
+};
+
+subtest 'Compiled field encoders', sub {
+	my %values = (
+		s => [ 'abc', '', 42, -7, 1.5, "\x{43f}" ],
+		x => [ "\xff\x00", 'abc', 42 ],
+		n => [ 1.5, 3, -3, '2.5', '17', 0 ],
+		u => [ 7, '17', 0, 2**40 ],
+		i => [ -5, 5, '-9', '12' ],
+		a => [ [], [ 1, 'a', [ 2 ] ] ],
+		m => [ {}, { a => 1, b => [ 2 ] } ],
+		r => [ 'str', 1, -1, 2.5 ],
+		b => [ 1, 0, 'yes' ],
+		'*' => [ undef, 1, 'abc', [ 1 ], { a => 1 } ],
+	);
+	my $encode = sub {
+		my ($tuple, $format, $compiled) = @_;
+		my $enc = eval { EV::Tarantool16::_encode_tuple($tuple, $format, $compiled) };
+		return defined $enc ? unpack('H*', $enc) : "error: $@";
+	};
+	for my $fmt (sort keys %values) {
+		for my $v (@{ $values{$fmt} }) {
+			my $name = sprintf "format '%s', value %s", $fmt, defined $v ? $v : 'undef';
+			is $encode->([ $v ], $fmt, 1), $encode->([ $v ], $fmt, 0), $name;
+		}
+	}
+	for my $bad ([ u => [] ], [ i => [] ], [ n => {} ], [ a => {} ], [ m => [] ]) {
+		my ($fmt, $v) = @$bad;
+		like $encode->([ $v ], $fmt, 1), qr/^error: Incompatible types/, "format '$fmt' rejects a mismatch";
+		is $encode->([ $v ], $fmt, 1), $encode->([ $v ], $fmt, 0), "format '$fmt' mismatch error";
+	}
+
+	my $format = 'sxnuiamrb*';
+	my @tuple = ('abc', "\x01", 1.5, 7, -5, [ 1 ], { a => 1 }, 'r', 1, undef, 'beyond the format');
+	is $encode->(\@tuple, $format, 1), $encode->(\@tuple, $format, 0), 'whole tuple';
+};
+
+done_testing;
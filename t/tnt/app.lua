@@ -184,6 +184,19 @@ function string_function()
   return "hello world"
 end
 
+-- delays authentication, so the requests sent along with auth are answered first
+auth_delay = 0
+box.session.on_auth(function()
+	if auth_delay > 0 then
+		require('fiber').sleep(auth_delay)
+	end
+end)
+
+function set_auth_delay(delay)
+	auth_delay = delay
+	return 'ok'
+end
+
 function timeout_test(timeout)
 	local fiber = require('fiber')
 	local ch = fiber.channel(1)
@@ -0,0 +1,74 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include "xsmy.h"
+#include "types.h"
+
+/*
+ * Aggregate state of a batch() call.
+ *
+ * Every request of the batch stores the arguments its own callback would get
+ * into `results` at its position. The batch holds one extra reference while
+ * requests are being sent, so the aggregate callback fires exactly once: when
+ * the last reply (or timeout, or disconnect) arrives after sending is done.
+ */
+
+static TntBatch *batch_new(SV *cb, uint32_t count) {
+	TntBatch *b;
+	Newxz(b, 1, TntBatch);
+	b->cb = SvREFCNT_inc(cb);
+	b->results = newAV();
+	b->error = err_slot_new();
+	if (count > 0) {
+		av_extend(b->results, count - 1);
+	}
+	b->left = 1;
+	return b;
+}
+
+static void batch_unref(TntBatch *b) {
+	if (--b->left > 0) return;
+
+	SV *cb = b->cb;
+	SV *results = newRV_noinc((SV *) b->results);
+	SvREFCNT_dec(b->error);
+	Safefree(b);
+
+	dSP;
+	ENTER; SAVETMPS;
+
+	PUSHMARK(SP);
+	EXTEND(SP, 1);
+	PUSHs( sv_2mortal(results) );
+	PUTBACK;
+
+	(void) call_sv(cb, G_DISCARD | G_VOID);
+
+	SvREFCNT_dec(cb);
+
+	FREETMPS; LEAVE;
+}
+
+/* Drops a batch that was never sent, without calling its callback */
+static void batch_discard(TntBatch *b) {
+	SvREFCNT_dec(b->cb);
+	SvREFCNT_dec((SV *) b->results);
+	SvREFCNT_dec(b->error);
+	Safefree(b);
+}
+
+/* Takes ownership of result and err: stores [ result ] or [ undef, err, result? ] */
+static void batch_store(TntBatch *b, uint32_t idx, SV *result, SV *err) {
+	AV *args = newAV();
+	if (err) {
+		av_push(args, newSV(0));
+		av_push(args, err);
+		if (result) av_push(args, result);
+	} else {
+		av_push(args, result);
+	}
+	(void) av_store(b->results, idx, newRV_noinc((SV *) args));
+	batch_unref(b);
+}
+
+#endif // _BATCH_H_
@@ -0,0 +1,140 @@
+#ifndef _CTXPOOL_H_
+#define _CTXPOOL_H_
+
+#include "xsmy.h"
+#include "types.h"
+
+#ifndef TNT_CTX_SLAB_SIZE
+#  define TNT_CTX_SLAB_SIZE 64
+#endif
+
+/*
+ * Per-connection allocator for request contexts.
+ *
+ * Contexts are carved out of slabs of TNT_CTX_SLAB_SIZE entries and recycled
+ * through a free list, so once the pool has grown to the connection's peak
+ * number of in-flight requests no more malloc/free happens for them.
+ * Slabs are only returned to the system when the connection is destroyed.
+ */
+
+typedef struct _TntCtxSlab {
+	struct _TntCtxSlab *next;
+	TntCtx              ctx[TNT_CTX_SLAB_SIZE];
+} TntCtxSlab;
+
+typedef struct {
+	TntCtxSlab *slabs;
+	TntCtx     *free;
+	TntCtx     *building; /* handed out, but not yet committed to a request */
+	uint32_t    nslabs;
+	uint32_t    nfree;
+	uint64_t    hits;
+	uint64_t    misses;
+} TntCtxPool;
+
+static inline void ctx_pool_init(TntCtxPool *pool) {
+	memset(pool, 0, sizeof(TntCtxPool));
+}
+
+static inline void ctx_pool_destroy(TntCtxPool *pool) {
+	TntCtxSlab *slab = pool->slabs;
+	while (slab) {
+		TntCtxSlab *next = slab->next;
+		Safefree(slab);
+		slab = next;
+	}
+	ctx_pool_init(pool);
+}
+
+static inline void lookup_free(TntLookup *lk) {
+	SvREFCNT_dec(lk->name);
+	if (lk->spaces) SvREFCNT_dec(lk->spaces);
+	Safefree(lk);
+}
+
+/* Per-request data owned by the context: reply format, field projection, schema, replay and lookup */
+static inline void ctx_free_data(TntCtx *ctx) {
+	if (ctx->f.size && !ctx->f.nofree) {
+		safefree(ctx->f.f);
+	}
+	ctx->f.size = 0;
+	if (ctx->proj) {
+		Safefree(ctx->proj);
+		ctx->proj = NULL;
+	}
+	if (ctx->on_chunk) {
+		SvREFCNT_dec(ctx->on_chunk);
+		ctx->on_chunk = NULL;
+	}
+	if (ctx->spaces) {
+		SvREFCNT_dec(ctx->spaces);
+		ctx->spaces = NULL;
+	}
+	while (ctx->replay_n) {
+		SvREFCNT_dec(ctx->replay[--ctx->replay_n]);
+	}
+	if (ctx->lookup) {
+		lookup_free(ctx->lookup);
+		ctx->lookup = NULL;
+	}
+}
+
+static inline void ctx_release(TntCtxPool *pool, TntCtx *ctx) {
+	if (pool->building == ctx) {
+		pool->building = NULL;
+	}
+	ctx_free_data(ctx);
+	ctx->next = pool->free;
+	pool->free = ctx;
+	++pool->nfree;
+}
+
+static void ctx_pool_grow(TntCtxPool *pool) {
+	TntCtxSlab *slab;
+	int i;
+
+	Newx(slab, 1, TntCtxSlab);
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	++pool->nslabs;
+
+	for (i = TNT_CTX_SLAB_SIZE - 1; i >= 0; --i) {
+		slab->ctx[i].next = pool->free;
+		pool->free = &slab->ctx[i];
+	}
+	pool->nfree += TNT_CTX_SLAB_SIZE;
+}
+
+/*
+ * Returns a zeroed context. It stays marked as `building` until it is either
+ * committed to the request table or released, so a context abandoned by a
+ * croak during packet encoding is reclaimed on the next allocation.
+ */
+static inline TntCtx *ctx_alloc(TntCtxPool *pool) {
+	TntCtx *ctx;
+
+	if (unlikely(pool->building != NULL)) {
+		ctx = pool->building;
+		ctx_free_data(ctx);
+	} else {
+		if (likely(pool->free != NULL)) {
+			++pool->hits;
+		} else {
+			++pool->misses;
+			ctx_pool_grow(pool);
+		}
+		ctx = pool->free;
+		pool->free = ctx->next;
+		--pool->nfree;
+	}
+
+	memset(ctx, 0, sizeof(TntCtx));
+	pool->building = ctx;
+	return ctx;
+}
+
+#define ctx_commit(pool, ctx) STMT_START { \
+	if ((pool)->building == (ctx)) (pool)->building = NULL; \
+} STMT_END
+
+#endif // _CTXPOOL_H_
@@ -0,0 +1,29 @@
+#ifndef _CXT_H_
+#define _CXT_H_
+
+#include "xsmy.h"
+
+/*
+ * Per-interpreter state, see "Safely Storing Static Data in XS" in perlxs.
+ * Set up by MY_CXT_INIT in BOOT; a new thread starts with none of it, see
+ * CLONE.
+ */
+
+#define MY_CXT_KEY "EV::Tarantool16::_guts" XS_VERSION
+
+struct _TntEncOp;
+struct _TntRbufPool;
+
+typedef struct {
+	SV                  *encbuf;     /* shared encode buffer, see encbuf_acquire */
+	struct _TntEncOp    *encops;     /* shared encode ops, see enc_plan_init */
+	uint32_t             encops_cap;
+	int                  enc_busy;   /* ENC_BUSY_*: shared buffers in use */
+	SV                  *encdest;    /* buffer of held requests being appended to */
+	STRLEN               encdest_start;
+	struct _TntRbufPool *rbuf_pools; /* shared read buffers, one per loop */
+} my_cxt_t;
+
+START_MY_CXT
+
+#endif // _CXT_H_
@@ -0,0 +1,151 @@
+#ifndef _DEADLINES_H_
+#define _DEADLINES_H_
+
+#include "xsmy.h"
+#include "types.h"
+
+#ifndef TNT_DEADLINE_QUEUES
+#  define TNT_DEADLINE_QUEUES 8
+#endif
+
+/*
+ * Request deadlines of a connection, driven by a single ev_timer.
+ *
+ * Requests sharing the same timeout value expire in the order they were
+ * sent, so each distinct timeout gets its own FIFO queue: scheduling is an
+ * append and cancelling an unlink, both O(1). The timer is armed for the
+ * earliest queue head. A queue that has drained is taken over by the next
+ * new timeout value. Only while TNT_DEADLINE_QUEUES - 1 distinct timeouts
+ * are pending at once do further ones share the last queue, which is kept
+ * sorted by deadline (insertion scans from the tail).
+ */
+
+typedef void (*tnt_deadline_cb_t)(TntCtx *ctx);
+
+typedef struct {
+	double   timeout;
+	TntCtx  *head;
+	TntCtx  *tail;
+} TntDeadlineQueue;
+
+typedef struct {
+	ev_timer          t;
+	struct ev_loop   *loop;
+	tnt_deadline_cb_t on_expire;
+	ev_tstamp         armed; /* deadline the timer is set for, 0 if stopped */
+	uint32_t          nq;
+	TntDeadlineQueue  q[TNT_DEADLINE_QUEUES];
+} TntDeadlines;
+
+#define TNT_DEADLINE_MIXED (TNT_DEADLINE_QUEUES - 1)
+
+static void on_deadlines_timer(EV_P_ ev_timer *t, int flags);
+
+static inline void deadlines_init(TntDeadlines *dl, struct ev_loop *loop, tnt_deadline_cb_t on_expire) {
+	memset(dl, 0, sizeof(TntDeadlines));
+	dl->loop = loop;
+	dl->on_expire = on_expire;
+	ev_timer_init(&dl->t, on_deadlines_timer, 0., 0.);
+}
+
+static inline void deadlines_stop(TntDeadlines *dl) {
+	if (dl->loop) {
+		ev_timer_stop(dl->loop, &dl->t);
+	}
+	dl->armed = 0;
+}
+
+static inline void _deadlines_arm(TntDeadlines *dl, ev_tstamp deadline) {
+	ev_tstamp after = deadline - ev_now(dl->loop);
+	ev_timer_stop(dl->loop, &dl->t);
+	ev_timer_set(&dl->t, after > 0 ? after : 0., 0.);
+	ev_timer_start(dl->loop, &dl->t);
+	dl->armed = deadline;
+}
+
+static inline TntDeadlineQueue *_deadlines_queue(TntDeadlines *dl, double timeout, uint32_t *qi) {
+	uint32_t i, spare = TNT_DEADLINE_MIXED;
+	for (i = 0; i < dl->nq; ++i) {
+		if (dl->q[i].timeout == timeout) {
+			*qi = i;
+			return &dl->q[i];
+		}
+		if (!dl->q[i].head && spare == TNT_DEADLINE_MIXED) {
+			spare = i;
+		}
+	}
+	if (spare == TNT_DEADLINE_MIXED && dl->nq < TNT_DEADLINE_MIXED) {
+		spare = dl->nq++;
+	}
+	if (spare != TNT_DEADLINE_MIXED) {
+		*qi = spare;
+		dl->q[spare].timeout = timeout;
+		return &dl->q[spare];
+	}
+	*qi = TNT_DEADLINE_MIXED;
+	return &dl->q[TNT_DEADLINE_MIXED];
+}
+
+static inline void deadline_schedule(TntDeadlines *dl, TntCtx *ctx, double timeout) {
+	uint32_t qi;
+	TntDeadlineQueue *q = _deadlines_queue(dl, timeout, &qi);
+	TntCtx *after = q->tail;
+
+	ctx->deadline = ev_now(dl->loop) + timeout;
+	ctx->dq = qi + 1;
+
+	if (qi == TNT_DEADLINE_MIXED) {
+		while (after && after->deadline > ctx->deadline) {
+			after = after->dprev;
+		}
+	}
+
+	ctx->dprev = after;
+	ctx->dnext = after ? after->dnext : q->head;
+	if (ctx->dnext) ctx->dnext->dprev = ctx; else q->tail = ctx;
+	if (after) after->dnext = ctx; else q->head = ctx;
+
+	if (!dl->armed || ctx->deadline < dl->armed) {
+		_deadlines_arm(dl, ctx->deadline);
+	}
+}
+
+/* The timer is left as is: if it fires early it just re-arms for the next head */
+static inline void deadline_cancel(TntDeadlines *dl, TntCtx *ctx) {
+	if (!ctx->dq) return;
+
+	TntDeadlineQueue *q = &dl->q[ctx->dq - 1];
+	if (ctx->dprev) ctx->dprev->dnext = ctx->dnext; else q->head = ctx->dnext;
+	if (ctx->dnext) ctx->dnext->dprev = ctx->dprev; else q->tail = ctx->dprev;
+	ctx->dprev = ctx->dnext = NULL;
+	ctx->dq = 0;
+}
+
+static inline TntCtx *_deadlines_earliest(TntDeadlines *dl) {
+	TntCtx *first = NULL;
+	uint32_t i;
+	for (i = 0; i < TNT_DEADLINE_QUEUES; ++i) {
+		TntCtx *head = dl->q[i].head;
+		if (head && (!first || head->deadline < first->deadline)) {
+			first = head;
+		}
+	}
+	return first;
+}
+
+static void on_deadlines_timer(EV_P_ ev_timer *t, int flags) {
+	TntDeadlines *dl = (TntDeadlines *) t;
+	TntCtx *ctx;
+	ev_tstamp now = ev_now(dl->loop);
+
+	dl->armed = 0;
+	while ((ctx = _deadlines_earliest(dl)) && ctx->deadline <= now) {
+		deadline_cancel(dl, ctx);
+		dl->on_expire(ctx);
+	}
+	if (ctx && (!dl->armed || ctx->deadline < dl->armed)) {
+		_deadlines_arm(dl, ctx->deadline);
+	}
+}
+
+#endif // _DEADLINES_H_
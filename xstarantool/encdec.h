@@ -2,6 +2,8 @@
 #define _ENCDEC_H_
 
 #include "types.h"
+#include "utf8.h"
+#include "cxt.h"
 
 #define TNT_GREET_LENGTH 128
 #define TNT_VER_LENGTH 64
@@ -25,89 +27,239 @@ static SV *types_true, *types_false;
 } STMT_END
 
 
-#define create_buffer(NAME, P_NAME, sz, tp_operation, iid) \
-	SV *NAME = sv_2mortal(newSV((sz))); \
-	SvUPGRADE(NAME, SVt_PV); \
-	SvPOK_on(NAME); \
+#ifndef TNT_ENCBUF_INITIAL
+#  define TNT_ENCBUF_INITIAL 4096
+#endif
+
+#ifndef TNT_ENCBUF_KEEP
+#  define TNT_ENCBUF_KEEP (1024*1024)
+#endif
+
+/*
+ * Requests are encoded into one reusable buffer and copied out by do_write
+ * right away, so no SV is created per request and nothing needs to be kept
+ * until the reply. A nested encode (tied or overloaded values calling back
+ * into the client) gets a private mortal buffer instead. The buffer is
+ * released as soon as the request is written or dropped; for a croak while
+ * encoding, every XSUB that encodes saves the busy flags once with ENC_GUARD.
+ *
+ * While a connection holds its requests back (cork, autocork, handshake),
+ * a request is appended straight to the buffer of held requests given as
+ * `dest` instead of being copied there afterwards. The request starts at
+ * SvCUR of its buffer and is only counted in by finish_buffer. One such
+ * append is in progress at a time; nested encodes meanwhile use the buffers
+ * above, and see encbuf_building before touching a buffer of held requests.
+ */
+#define ENC_BUSY_BUF  1
+#define ENC_BUSY_OPS  2
+#define ENC_BUSY_DEST 4
+
+#define ENC_GUARD STMT_START { \
+	dMY_CXT; \
+	SAVEINT(MY_CXT.enc_busy); \
+} STMT_END
+
+static SV *encbuf_acquire(size_t sz, SV *dest) {
+	dMY_CXT;
+	SV *sv;
+	if (dest && likely(!(MY_CXT.enc_busy & ENC_BUSY_DEST))) {
+		/* a reference left over by a croak while appending */
+		if (unlikely(MY_CXT.encdest != NULL)) SvREFCNT_dec(MY_CXT.encdest);
+		/* kept until released, the connection may let go of it meanwhile */
+		sv = MY_CXT.encdest = SvREFCNT_inc_simple_NN(dest);
+		MY_CXT.encdest_start = SvCUR(sv);
+		MY_CXT.enc_busy |= ENC_BUSY_DEST;
+	}
+	else if (unlikely(MY_CXT.enc_busy & ENC_BUSY_BUF)) {
+		sv = sv_2mortal(newSV(sz));
+		SvUPGRADE(sv, SVt_PV);
+	} else {
+		if (unlikely(!MY_CXT.encbuf)) {
+			MY_CXT.encbuf = newSV(sz > TNT_ENCBUF_INITIAL ? sz : TNT_ENCBUF_INITIAL);
+			SvUPGRADE(MY_CXT.encbuf, SVt_PV);
+		}
+		sv = MY_CXT.encbuf;
+		MY_CXT.enc_busy |= ENC_BUSY_BUF;
+		SvCUR_set(sv, 0);
+	}
+	if (SvLEN(sv) <= SvCUR(sv) + sz) {
+		sv_grow(sv, SvCUR(sv) + sz + 1);
+	}
+	SvPOK_on(sv);
+	return sv;
+}
+
+static inline void encbuf_release(SV *sv) {
+	dMY_CXT;
+	if (likely(sv == MY_CXT.encbuf)) {
+		SvCUR_set(sv, 0);
+		MY_CXT.enc_busy &= ~ENC_BUSY_BUF;
+		if (unlikely(SvLEN(sv) > TNT_ENCBUF_KEEP)) {
+			/* do not hold on to the memory of an occasional huge request */
+			SvREFCNT_dec(MY_CXT.encbuf);
+			MY_CXT.encbuf = NULL;
+		}
+	}
+	else if (sv == MY_CXT.encdest) {
+		MY_CXT.encdest = NULL;
+		MY_CXT.enc_busy &= ~ENC_BUSY_DEST;
+		SvREFCNT_dec(sv);
+	}
+}
+
+/* True while a request is being appended to sv */
+static inline int encbuf_building(SV *sv) {
+	dMY_CXT;
+	return (MY_CXT.enc_busy & ENC_BUSY_DEST) && sv == MY_CXT.encdest;
+}
+
+/* The request last finished in sv: all of it, or its tail for a dest of encbuf_acquire */
+static inline char *encbuf_pkt(SV *sv, STRLEN *len) {
+	dMY_CXT;
+	STRLEN start = (MY_CXT.enc_busy & ENC_BUSY_DEST) && sv == MY_CXT.encdest ? MY_CXT.encdest_start : 0;
+	*len = SvCUR(sv) - start;
+	return SvPVX(sv) + start;
+}
+
+/* The buffer of held requests of the connection of ctx to append to, or NULL; see Tarantool16.xs */
+static SV *tnt_wbuf(TntCtx *ctx);
+
+/*
+ * A nonzero schema_id makes the server reject the request if its schema has changed since.
+ * Expects the TntCtx of the request as `ctx`.
+ */
+#define create_buffer(NAME, P_NAME, sz, tp_operation, iid, schema_id) \
+	SV *NAME = encbuf_acquire((sz), tnt_wbuf(ctx)); \
 	\
-	char *P_NAME = (char *) SvPVX(NAME); \
-	P_NAME = mp_encode_map(P_NAME + 5, 2); \
+	char *P_NAME = (char *) SvPVX(NAME) + SvCUR(NAME); \
+	P_NAME = mp_encode_map(P_NAME + 5, (schema_id) ? 3 : 2); \
 	P_NAME = mp_encode_uint(P_NAME, TP_CODE); \
 	P_NAME = mp_encode_uint(P_NAME, (tp_operation)); \
 	P_NAME = mp_encode_uint(P_NAME, TP_SYNC); \
 	write_iid(P_NAME, (iid)); \
+	if (schema_id) { \
+		P_NAME = mp_encode_uint(P_NAME, TP_SCHEMA_ID); \
+		P_NAME = mp_encode_uint(P_NAME, (schema_id)); \
+	} \
+
+/* Fills in the length of the request begun by create_buffer, P_NAME being its end */
+#define finish_buffer(NAME, P_NAME) STMT_START { \
+	char *_pkt = SvPVX(NAME) + SvCUR(NAME); \
+	write_length(_pkt, P_NAME - _pkt - 5); \
+	SvCUR_set(NAME, P_NAME - SvPVX(NAME)); \
+} STMT_END
 
 #define sv_size_check(svx, svx_end, totalneed) STMT_START { \
-	if ( totalneed < SvLEN(svx) ) { \
+	if ( SvCUR(svx) + totalneed < SvLEN(svx) ) { \
 	} \
 	else { \
 		STRLEN used = svx_end - SvPVX(svx); \
-		svx_end = sv_grow(svx, totalneed); \
+		svx_end = sv_grow(svx, SvCUR(svx) + totalneed); \
 		svx_end += used; \
 	} \
 } STMT_END
 
-#define encode_keys(h, sz, fields, keys_size, fmt, key) STMT_START { \
-	uint32_t k; \
-	for (k = 0; k < keys_size; k++) { \
-		key = av_fetch( fields, k, 0 ); \
-		if (key && *key && SvOK(*key)) { \
-			char _fmt = k < fmt->size ? fmt->f[k] : fmt->def; \
-			h = encode_obj(*key, h, rv, &sz, _fmt); \
-		} else { \
-			h = encode_obj(&PL_sv_undef, h, rv, &sz, FMT_UNKNOWN); \
-			/*cwarn("Passed key is invalid. Consider revising.");*/ \
-		} \
-	} \
-} STMT_END
-
-#define encode_str(dest, sz, rv, str, str_len) STMT_START { \
-	*sz += mp_sizeof_str(str_len); \
-	sv_size_check(rv, dest, *sz); \
-	dest = mp_encode_str(dest, str, str_len); \
-} STMT_END
-
-#define encode_double(dest, sz, rv, v) STMT_START { \
-	*sz += mp_sizeof_double(v); \
-	sv_size_check(rv, dest, *sz); \
-	dest = mp_encode_double(dest, v); \
-} STMT_END
-
-#define encode_uint(dest, sz, rv, v) STMT_START { \
-	*sz += mp_sizeof_uint(v); \
-	sv_size_check(rv, dest, *sz); \
-	dest = mp_encode_uint(dest, v); \
-} STMT_END
-
-#define encode_int(dest, sz, rv, v) STMT_START { \
-	*sz += mp_sizeof_int(v); \
-	sv_size_check(rv, dest, *sz); \
-	dest = mp_encode_int(dest, v); \
-} STMT_END
-
-#define encode_bool(dest, sz, rv, v) STMT_START { \
-	*sz += 1; \
-	sv_size_check(rv, dest, *sz); \
-	dest = mp_encode_bool(dest, v); \
-} STMT_END
+/*
+ * Values are encoded in two passes. The plan pass walks the Perl structure
+ * once, running get magic and making every type decision, and records one
+ * op per msgpack value together with the exact total size. The buffer is
+ * then grown once and the emit pass writes the ops without any capacity
+ * checks or calls back into perl. The op array is reused like the encode
+ * buffer; a nested encode (from magic) gets a private one.
+ */
+
+enum {
+	ENC_NIL,
+	ENC_BOOL,
+	ENC_UINT,
+	ENC_INT,
+	ENC_DOUBLE,
+	ENC_STR,
+	ENC_ARRAY,
+	ENC_MAP
+};
+
+typedef struct _TntEncOp {
+	uint8_t  kind;
+	uint32_t len;   /* string length, array or map size */
+	union {
+		uint64_t    u;
+		int64_t     i;
+		double      d;
+		bool        b;
+		const char *s;
+		SV         *c;  /* container, while planning */
+	} v;
+} TntEncOp;
+
+typedef struct _TntEncPlan {
+	TntEncOp *ops;
+	uint32_t  n;
+	uint32_t  cap;
+	size_t    size;  /* exact encoded size of the ops */
+	int       shared;
+} TntEncPlan;
+
+#ifndef TNT_ENCOPS_INITIAL
+#  define TNT_ENCOPS_INITIAL 256
+#endif
+
+#ifndef TNT_ENCOPS_KEEP
+#  define TNT_ENCOPS_KEEP 65536
+#endif
+
+static void enc_plan_init(TntEncPlan *pl) {
+	dMY_CXT;
+	pl->n = 0;
+	pl->size = 0;
+	if (likely(!(MY_CXT.enc_busy & ENC_BUSY_OPS))) {
+		if (unlikely(!MY_CXT.encops)) {
+			MY_CXT.encops_cap = TNT_ENCOPS_INITIAL;
+			Newx(MY_CXT.encops, MY_CXT.encops_cap, TntEncOp);
+		}
+		MY_CXT.enc_busy |= ENC_BUSY_OPS;
+		pl->ops = MY_CXT.encops;
+		pl->cap = MY_CXT.encops_cap;
+		pl->shared = 1;
+	} else {
+		pl->cap = TNT_ENCOPS_INITIAL;
+		Newx(pl->ops, pl->cap, TntEncOp);
+		SAVEFREEPV(pl->ops);
+		pl->shared = 0;
+	}
+}
 
-#define encode_nil(dest, sz, rv) STMT_START { \
-	*sz += 1; \
-	sv_size_check(rv, dest, *sz); \
-	dest = mp_encode_nil(dest); \
-} STMT_END
+static uint32_t enc_plan_grow(TntEncPlan *pl) {
+	if (pl->shared) {
+		dMY_CXT;
+		Renew(pl->ops, pl->cap * 2, TntEncOp);
+		MY_CXT.encops = pl->ops;
+		MY_CXT.encops_cap = pl->cap = pl->cap * 2;
+	} else {
+		/* the old array is freed by its SAVEFREEPV */
+		TntEncOp *ops;
+		Newx(ops, pl->cap * 2, TntEncOp);
+		SAVEFREEPV(ops);
+		Copy(pl->ops, ops, pl->n, TntEncOp);
+		pl->ops = ops;
+		pl->cap *= 2;
+	}
+	return pl->n++;
+}
 
-#define encode_array(dest, sz, rv, arr_size) STMT_START { \
-	*sz += mp_sizeof_array(arr_size); \
-	sv_size_check(rv, dest, *sz); \
-	dest = mp_encode_array(dest, arr_size); \
-} STMT_END
+#define enc_plan_push(pl) (likely((pl)->n < (pl)->cap) ? (pl)->n++ : enc_plan_grow(pl))
 
-#define encode_map(dest, sz, rv, keys_size) STMT_START { \
-	*sz += mp_sizeof_map(keys_size); \
-	sv_size_check(rv, dest, *sz); \
-	dest = mp_encode_map(dest, keys_size); \
-} STMT_END
+static inline void enc_plan_release(TntEncPlan *pl) {
+	if (likely(pl->shared)) {
+		dMY_CXT;
+		MY_CXT.enc_busy &= ~ENC_BUSY_OPS;
+		if (unlikely(MY_CXT.encops_cap > TNT_ENCOPS_KEEP)) {
+			Safefree(MY_CXT.encops);
+			MY_CXT.encops = NULL;
+			MY_CXT.encops_cap = 0;
+		}
+	}
+}
 
 #define REAL_SV(sv, real_sv, stash) \
 	HV *stash = NULL; \
@@ -121,114 +273,94 @@ static SV *types_true, *types_false;
 		real_sv = sv; \
 	}
 
-
-#define encode_AV(src, rv, dest, sz) STMT_START {\
-	AV *arr = (AV *) src; \
-	uint32_t arr_size = av_len(arr) + 1; \
-	uint32_t i = 0; \
-	encode_array(dest, sz, rv, arr_size); \
-	\
-	SV **elem; \
-	for (i = 0; i < arr_size; ++i) { \
-		elem = av_fetch(arr, i, 0); \
-		if (elem && *elem && SvTYPE(*elem) != SVt_NULL) { \
-			dest = encode_obj(*elem, dest, rv, sz, FMT_UNKNOWN); \
-		} else { \
-			encode_nil(dest, sz, rv); \
-		} \
+/*
+ * Ops keep pointers into string buffers until the emit pass. A magical
+ * value (tied, $1, ...) may be fetched again meanwhile and move its buffer,
+ * so it is planned from a mortal copy.
+ */
+#define enc_get_magic(sv) STMT_START { \
+	if (unlikely(SvGMAGICAL(sv))) { \
+		sv = sv_2mortal(newSVsv(sv)); \
 	} \
 } STMT_END
 
-
-#define encode_HV(src, rv, dest, sz) STMT_START { \
-	HV *hv = (HV *) src; \
-	HE *he; \
-	\
-	uint32_t keys_size = hv_iterinit(hv); \
-	\
-	encode_map(dest, sz, rv, keys_size); \
-	STRLEN nlen; \
-	while ((he = hv_iternext(hv))) { \
-		char *name = HePV(he, nlen); \
-		encode_str(dest, sz, rv, name, nlen); \
-		dest = encode_obj(HeVAL(he), dest, rv, sz, FMT_UNKNOWN); \
-	} \
+#define enc_op_set(op, k, field, value) STMT_START { \
+	(op)->kind = (k); \
+	(op)->v.field = (value); \
+	return; \
 } STMT_END
 
+/* Rules for the 's' format */
+static inline void enc_classify_str(SV *src, TntEncOp *op) {
+	STRLEN str_len = 0;
+	char *str = NULL;
 
+	if (SvPOK(src)) {
+		str = SvPV_nolen(src);
+		str_len = SvCUR(src);
+	} else {
+		str = SvPV(src, str_len);
+		str_len = SvCUR(src);
+	}
 
-static char *encode_obj(SV *initial_src, char *dest, SV *rv, size_t *sz, char fmt) {
-	// cwarn("fmt = %d", fmt);
-
-	SvGETMAGIC(initial_src);
-	REAL_SV(initial_src, src, stash);
-
-	if (fmt == FMT_STRING) {
-		STRLEN str_len = 0;
-		char *str = NULL;
+	op->len = str_len;
+	enc_op_set(op, ENC_STR, s, str);
+}
 
-		if (SvPOK(src)) {
-			str = SvPV_nolen(src);
-			str_len = SvCUR(src);
-		} else {
-			str = SvPV(src, str_len);
-			str_len = SvCUR(src);
+/* Rules for the 'n', 'u' and 'i' formats */
+static inline void enc_classify_num(SV *src, char fmt, TntEncOp *op) {
+	if (fmt == FMT_NUMBER) {
+		if (SvNOK(src)) {
+			enc_op_set(op, ENC_DOUBLE, d, SvNVX(src));
 		}
+	}
 
-		encode_str(dest, sz, rv, str, str_len);
-		return dest;
-
-	} else if (fmt == FMT_NUMBER || fmt == FMT_UNSIGNED || fmt == FMT_INTEGER)  {
-
-		if (fmt == FMT_NUMBER) {
-			if (SvNOK(src)) {
-				encode_double(dest, sz, rv, SvNVX(src));
-				return dest;
+	if (SvIOK(src)) {
+		if (SvUOK(src)) {
+			enc_op_set(op, ENC_UINT, u, SvUVX(src));
+		} else {
+			IV num = SvIVX(src);
+			if (num >= 0) {
+				enc_op_set(op, ENC_UINT, u, num);
+			} else {
+				enc_op_set(op, ENC_INT, i, num);
 			}
 		}
-
-		if (SvIOK(src)) {
+	} else if (SvPOK(src)) {
+		if (fmt == FMT_NUMBER) {
+			enc_op_set(op, ENC_DOUBLE, d, SvNV(src));
+		} else {
+			NV num = SvNV(src);
 			if (SvUOK(src)) {
-				encode_uint(dest, sz, rv, SvUVX(src));
-				return dest;
+				enc_op_set(op, ENC_UINT, u, SvUV(src));
 			} else {
-				IV num = SvIVX(src);
 				if (num >= 0) {
-					encode_uint(dest, sz, rv, num);
-					return dest;
-				} else {
-					encode_int(dest, sz, rv, num);
-					return dest;
-				}
-			}
-		} else if (SvPOK(src)) {
-			if (fmt == FMT_NUMBER) {
-				encode_double(dest, sz, rv, SvNV(src));
-				return dest;
-			} else {
-				NV num = SvNV(src);
-				if (SvUOK(src)) {
-					encode_uint(dest, sz, rv, SvUV(src));
-					return dest;
+					enc_op_set(op, ENC_UINT, u, SvIV(src));
 				} else {
-					if (num >= 0) {
-						encode_uint(dest, sz, rv, SvIV(src));
-						return dest;
-					} else {
-						encode_int(dest, sz, rv, SvIV(src));
-						return dest;
-					}
+					enc_op_set(op, ENC_INT, i, SvIV(src));
 				}
 			}
-		} else {
-			croak("Incompatible types. Format expects: %c", fmt);
 		}
-		
+	} else {
+		croak("Incompatible types. Format expects: %c", fmt);
+	}
+}
+
+/* Decides how a value is encoded with the given format char */
+static void enc_classify(SV *initial_src, char fmt, TntEncOp *op) {
+	enc_get_magic(initial_src);
+	REAL_SV(initial_src, src, stash);
+
+	if (fmt == FMT_STRING || fmt == FMT_BINARY) {
+		enc_classify_str(src, op);
+
+	} else if (fmt == FMT_NUMBER || fmt == FMT_UNSIGNED || fmt == FMT_INTEGER)  {
+		enc_classify_num(src, fmt, op);
+
 	} else if (fmt == FMT_ARRAY) {
 
 		if (SvTYPE(src) == SVt_PVAV) {
-			encode_AV(src, rv, dest, sz);
-			return dest;
+			enc_op_set(op, ENC_ARRAY, c, src);
 		} else {
 			croak("Incompatible types. Format expects: %c", fmt);
 		}
@@ -236,8 +368,7 @@ static char *encode_obj(SV *initial_src, char *dest, SV *rv, size_t *sz, char fm
 	} else if (fmt == FMT_MAP) {
 
 		if (SvTYPE(src) == SVt_PVHV) {
-			encode_HV(src, rv, dest, sz);
-			return dest;
+			enc_op_set(op, ENC_MAP, c, src);
 		} else {
 			croak("Incompatible types. Format expects: %c", fmt);
 		}
@@ -247,44 +378,36 @@ static char *encode_obj(SV *initial_src, char *dest, SV *rv, size_t *sz, char fm
 		HV *boolean_stash = types_boolean_stash ? types_boolean_stash : gv_stashpv ("Types::Serialiser::Boolean", 1);
 
 		if (stash == boolean_stash) {
-			bool v = (bool) SvIV(src);
-			encode_bool(dest, sz, rv, v);
-			return dest;
+			enc_op_set(op, ENC_BOOL, b, (bool) SvIV(src));
 		} else {
 
 			if (SvTYPE(src) == SVt_NULL) {
-				encode_nil(dest, sz, rv);
-				return dest;
+				enc_op_set(op, ENC_NIL, u, 0);
 
 			} else if (fmt != FMT_SCALAR && SvTYPE(src) == SVt_PVAV) {  // array
-				encode_AV(src, rv, dest, sz);
-				return dest;
+				enc_op_set(op, ENC_ARRAY, c, src);
 
 			} else if (fmt != FMT_SCALAR && SvTYPE(src) == SVt_PVHV) {  // hash
-				encode_HV(src, rv, dest, sz);
-				return dest;
+				enc_op_set(op, ENC_MAP, c, src);
 
 			} else if (SvNOK(src)) {  // double
-				encode_double(dest, sz, rv, SvNVX(src));
-				return dest;
+				enc_op_set(op, ENC_DOUBLE, d, SvNVX(src));
+
 			} else if (SvUOK(src)) {  // uint
-				encode_uint(dest, sz, rv, SvUVX(src));
-				return dest;
+				enc_op_set(op, ENC_UINT, u, SvUVX(src));
 
 			} else if (SvIOK(src)) {  // int or uint
 				IV num = SvIVX(src);
 				if (num >= 0) {
-					encode_uint(dest, sz, rv, num);
-					return dest;
+					enc_op_set(op, ENC_UINT, u, num);
 				} else {
-					encode_int(dest, sz, rv, num);
-					return dest;
+					enc_op_set(op, ENC_INT, i, num);
 				}
 			} else if (SvPOK(src)) {  // string
-				encode_str(dest, sz, rv, SvPV_nolen(src), SvCUR(src));
-				return dest;
+				op->len = SvCUR(src);
+				enc_op_set(op, ENC_STR, s, SvPV_nolen(src));
 			} else if (!SvOK(src)) {
-				encode_nil(dest, sz, rv);
+				enc_op_set(op, ENC_NIL, u, 0);
 			} else {
 				croak("What the heck are you trying to encode? (PV = %.*s) (type = %d)", SvCUR(src), SvPV_nolen(src), SvTYPE(src));
 			}
@@ -293,7 +416,177 @@ static char *encode_obj(SV *initial_src, char *dest, SV *rv, size_t *sz, char fm
 	} else {
 		croak("Not implemented");
 	}
+}
+
+/* Plan pass: appends the ops of a value and adds their exact size */
+static void enc_plan_add(TntEncPlan *pl, SV *src, char fmt) {
+	uint32_t at = enc_plan_push(pl);
+	TntEncOp *op = &pl->ops[at];
+
+	enc_classify(src, fmt, op);
+	switch (op->kind) {
+	case ENC_NIL:
+	case ENC_BOOL:
+		pl->size += 1;
+		break;
+	case ENC_UINT:
+		pl->size += mp_sizeof_uint(op->v.u);
+		break;
+	case ENC_INT:
+		pl->size += mp_sizeof_int(op->v.i);
+		break;
+	case ENC_DOUBLE:
+		pl->size += mp_sizeof_double(op->v.d);
+		break;
+	case ENC_STR:
+		pl->size += mp_sizeof_str(op->len);
+		break;
+	case ENC_ARRAY: {
+		AV *arr = (AV *) op->v.c;
+		uint32_t arr_size = av_len(arr) + 1;
+		uint32_t i;
+		SV **elem;
+
+		op->len = arr_size;
+		pl->size += mp_sizeof_array(arr_size);
+		for (i = 0; i < arr_size; ++i) {
+			elem = av_fetch(arr, i, 0);
+			if (elem && *elem && SvTYPE(*elem) != SVt_NULL) {
+				enc_plan_add(pl, *elem, FMT_UNKNOWN);
+			} else {
+				pl->ops[enc_plan_push(pl)].kind = ENC_NIL;
+				pl->size += 1;
+			}
+		}
+		break;
+	}
+	case ENC_MAP: {
+		HV *hv = (HV *) op->v.c;
+		HE *he;
+		STRLEN nlen;
+		uint32_t count = 0;
+		uint32_t k;
+
+		(void) hv_iterinit(hv);
+		while ((he = hv_iternext(hv))) {
+			char *name = HePV(he, nlen);
+			if (SvRMAGICAL(hv)) {
+				/* the key of a tied hash does not outlive the iteration */
+				name = SvPV(sv_2mortal(newSVpvn(name, nlen)), nlen);
+			}
+			k = enc_plan_push(pl);
+			pl->ops[k].kind = ENC_STR;
+			pl->ops[k].len = nlen;
+			pl->ops[k].v.s = name;
+			pl->size += mp_sizeof_str(nlen);
+			enc_plan_add(pl, hv_iterval(hv, he), FMT_UNKNOWN);
+			++count;
+		}
+		pl->ops[at].len = count;
+		pl->size += mp_sizeof_map(count);
+		break;
+	}
+	}
+}
+
+/*
+ * Per-field encoders of a schema format. A space or index format is
+ * compiled once at schema load into one function per field, so string and
+ * numeric fields go straight to their rules instead of through the generic
+ * format dispatch of enc_plan_add, which still handles the other formats.
+ */
+
+static void enc_field_str(TntEncPlan *pl, SV *initial_src, char fmt) {
+	TntEncOp *op = &pl->ops[enc_plan_push(pl)];
+	PERL_UNUSED_ARG(fmt);
+	enc_get_magic(initial_src);
+	REAL_SV(initial_src, src, stash);
+	PERL_UNUSED_VAR(stash);
+	enc_classify_str(src, op);
+	pl->size += mp_sizeof_str(op->len);
+}
+
+static void enc_field_num(TntEncPlan *pl, SV *initial_src, char fmt) {
+	TntEncOp *op = &pl->ops[enc_plan_push(pl)];
+	enc_get_magic(initial_src);
+	REAL_SV(initial_src, src, stash);
+	PERL_UNUSED_VAR(stash);
+	enc_classify_num(src, fmt, op);
+	pl->size += op->kind == ENC_UINT ? mp_sizeof_uint(op->v.u)
+	          : op->kind == ENC_INT  ? mp_sizeof_int(op->v.i)
+	          :                        mp_sizeof_double(op->v.d);
+}
+
+static tnt_enc_fn *enc_compile(const char *f, size_t size) {
+	tnt_enc_fn *enc;
+	size_t i;
+	if (!size) return NULL;
+
+	Newx(enc, size, tnt_enc_fn);
+	for (i = 0; i < size; i++) {
+		switch (f[i]) {
+		case FMT_STRING:
+		case FMT_BINARY:   enc[i] = enc_field_str; break;
+		case FMT_NUMBER:
+		case FMT_UNSIGNED:
+		case FMT_INTEGER:  enc[i] = enc_field_num; break;
+		default:           enc[i] = enc_plan_add; break;
+		}
+	}
+	return enc;
+}
 
+/* Emit pass: dest must have room for pl->size bytes */
+static char *enc_plan_emit(TntEncPlan *pl, char *dest) {
+	TntEncOp *op = pl->ops;
+	TntEncOp *end = op + pl->n;
+
+	for (; op < end; ++op) {
+		switch (op->kind) {
+		case ENC_NIL:    dest = mp_encode_nil(dest); break;
+		case ENC_BOOL:   dest = mp_encode_bool(dest, op->v.b); break;
+		case ENC_UINT:   dest = mp_encode_uint(dest, op->v.u); break;
+		case ENC_INT:    dest = mp_encode_int(dest, op->v.i); break;
+		case ENC_DOUBLE: dest = mp_encode_double(dest, op->v.d); break;
+		case ENC_STR:    dest = mp_encode_str(dest, op->v.s, op->len); break;
+		case ENC_ARRAY:  dest = mp_encode_array(dest, op->len); break;
+		case ENC_MAP:    dest = mp_encode_map(dest, op->len); break;
+		}
+	}
+	return dest;
+}
+
+#define encode_keys(h, sz, fields, keys_size, fmt, key) STMT_START { \
+	TntEncPlan _pl; \
+	uint32_t k; \
+	enc_plan_init(&_pl); \
+	for (k = 0; k < keys_size; k++) { \
+		key = av_fetch( fields, k, 0 ); \
+		if (key && *key && SvOK(*key)) { \
+			if (k < fmt->size) { \
+				(fmt->enc ? fmt->enc[k] : enc_plan_add)(&_pl, *key, fmt->f[k]); \
+			} else { \
+				enc_plan_add(&_pl, *key, fmt->def); \
+			} \
+		} else { \
+			enc_plan_add(&_pl, &PL_sv_undef, FMT_UNKNOWN); \
+			/*cwarn("Passed key is invalid. Consider revising.");*/ \
+		} \
+	} \
+	sz += _pl.size; \
+	sv_size_check(rv, h, sz); \
+	h = enc_plan_emit(&_pl, h); \
+	enc_plan_release(&_pl); \
+} STMT_END
+
+static char *encode_obj(SV *src, char *dest, SV *rv, size_t *sz, char fmt) {
+	TntEncPlan pl;
+	enc_plan_init(&pl);
+	enc_plan_add(&pl, src, fmt);
+	*sz += pl.size;
+	sv_size_check(rv, dest, *sz);
+	dest = enc_plan_emit(&pl, dest);
+	enc_plan_release(&pl);
 	return dest;
 }
 
@@ -341,9 +634,11 @@ static SV *decode_obj(const char **p) {
 	}
 	case MP_STR: {
 		str = mp_decode_str(p, &str_len);
-		SV *sv = newSVpvn(str, str_len);
-		sv_utf8_decode(sv);
-		return sv;
+		return newSVstr_utf8(str, str_len);
+	}
+	case MP_BIN: {
+		str = mp_decode_bin(p, &str_len);
+		return newSVpvn(str, str_len);
 	}
 	case MP_BOOL: {
 		bool value = mp_decode_bool(p);
@@ -384,8 +679,7 @@ static SV *decode_obj(const char **p) {
 			switch(mp_typeof(**p)) {
 			case MP_STR: {
 				map_key_str = mp_decode_str(p, &map_key_len);
-				key = newSVpvn(map_key_str, map_key_len);
-				(void) sv_utf8_decode(key);
+				key = newSVstr_utf8(map_key_str, map_key_len);
 				break;
 			}
 			case MP_UINT: {
@@ -421,4 +715,73 @@ static SV *decode_obj(const char **p) {
 }
 
 
+/*
+ * Decodes a value the format says to expect. Known scalar types are built
+ * directly; anything that does not match the format (or a format without a
+ * scalar type) falls back to decode_obj, and is counted in *mismatch.
+ */
+static inline SV *decode_field(const char **p, char fmt, uint32_t *mismatch) {
+	enum mp_type type = mp_typeof(**p);
+	const char *str;
+	uint32_t str_len;
+
+	switch (fmt) {
+	case FMT_UNSIGNED:
+		if (likely(type == MP_UINT)) {
+			return newSVuv(mp_decode_uint(p));
+		}
+		break;
+	case FMT_INTEGER:
+		if (likely(type == MP_UINT)) {
+			return newSVuv(mp_decode_uint(p));
+		} else if (type == MP_INT) {
+			return newSViv(mp_decode_int(p));
+		}
+		break;
+	case FMT_NUMBER:
+		if (type == MP_DOUBLE) {
+			return newSVnv(mp_decode_double(p));
+		} else if (type == MP_UINT) {
+			return newSVuv(mp_decode_uint(p));
+		} else if (type == MP_INT) {
+			return newSViv(mp_decode_int(p));
+		} else if (type == MP_FLOAT) {
+			return newSVnv((double) mp_decode_float(p));
+		}
+		break;
+	case FMT_STRING:
+		if (likely(type == MP_STR)) {
+			str = mp_decode_str(p, &str_len);
+			return newSVstr_utf8(str, str_len);
+		}
+		break;
+	case FMT_BINARY:
+		/* bytes as they are; other types decode as usual */
+		if (likely(type == MP_STR)) {
+			str = mp_decode_str(p, &str_len);
+			return newSVpvn(str, str_len);
+		}
+		return decode_obj(p);
+	case FMT_BOOLEAN:
+		if (likely(type == MP_BOOL)) {
+			return newSVsv(mp_decode_bool(p) ? types_true : types_false);
+		}
+		break;
+	case FMT_ARRAY:
+		if (likely(type == MP_ARRAY)) return decode_obj(p);
+		break;
+	case FMT_MAP:
+		if (likely(type == MP_MAP)) return decode_obj(p);
+		break;
+	default:
+		return decode_obj(p);
+	}
+
+	if (type != MP_NIL) ++*mismatch;
+	return decode_obj(p);
+}
+
+#define format_at(format, k) (!(format) ? FMT_UNKNOWN : (k) < (format)->size ? (format)->f[k] : (format)->def)
+
+
 #endif // _ENCDEC_H_
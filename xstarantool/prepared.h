@@ -0,0 +1,148 @@
+#ifndef _PREPARED_H_
+#define _PREPARED_H_
+
+#include "xsmy.h"
+#include "types.h"
+#include "xstnt16.h"
+
+/*
+ * Prepared select (prepare method).
+ *
+ * The space and index are resolved and the constant part of the body
+ * (space, index, limit, offset, iterator) is encoded once into `body`;
+ * a call only writes the header with its sync and appends the key. The
+ * template refers to the connection's schema, so it remembers the schema
+ * generation it was built for and is rebuilt when the schema has been
+ * reloaded (or dropped on disconnect) since.
+ */
+
+#define TNT_PREPARED_BODY_MAX (1 + 10 + 10 + 10 + 10 + 2 + 1)
+
+typedef struct {
+	void           *self;     /* TntCnn */
+	SV             *owner;    /* connection object, kept alive by the handle */
+	SV             *space;
+	SV             *index;
+	uint32_t        limit;
+	uint32_t        offset;
+	tnt_iterator_t  iterator;
+	U32             use_hash;
+	U32             compact;
+	U32             lazy;
+	double          timeout;  /* < 0 for the connection default */
+	SV             *in;       /* `in` option, if given */
+	unpack_format   in_fmt;
+
+	uint32_t        gen;      /* schema generation of the template, 0 if not built */
+	TntSpace       *spc;
+	TntIndex       *idx;
+	unpack_format  *fmt;      /* key format */
+	char            body[TNT_PREPARED_BODY_MAX];
+	uint32_t        body_len;
+} TntPrepared;
+
+static void prepared_free(TntPrepared *p) {
+	if (p->owner) SvREFCNT_dec(p->owner);
+	if (p->space) SvREFCNT_dec(p->space);
+	if (p->index) SvREFCNT_dec(p->index);
+	if (p->in) SvREFCNT_dec(p->in);
+	Safefree(p);
+}
+
+static TntPrepared *prepared_new(SV *space, HV *opt, U32 use_hash, U32 compact, uint8_t log_level) {
+	TntPrepared *p;
+	TntCtx tmp;
+	dUnpackFormat(in);
+	SV *in_sv = NULL;
+	SV **key;
+	uint32_t limit = 0xffffffff;
+	uint32_t offset = -1;
+	tnt_iterator_t iterator = -1;
+	U32 lazy = 0;
+	double timeout = -1;
+
+	if (!SvIOK(space) && !SvPOK(space)) {
+		croak("Space must be either a string or a number");
+	}
+	tmp.log_level = log_level;
+	if (opt) {
+		if ((key = hv_fetchs(opt, "fields", 0)) && SvOK(*key)) croak("Option 'fields' is not supported by prepare");
+		if ((key = hv_fetchs(opt, "out", 0)) && SvOK(*key)) croak("Option 'out' is not supported by prepare");
+		if ((key = hv_fetchs(opt, "binary", 0)) && SvOK(*key)) croak("Option 'binary' is not supported by prepare");
+		if ((key = hv_fetchs(opt, "on_chunk", 0)) && SvOK(*key)) croak("Option 'on_chunk' is not supported by prepare");
+		if ((key = hv_fetchs(opt, "limit", 0)) && SvOK(*key)) limit = SvUV(*key);
+		if ((key = hv_fetchs(opt, "offset", 0)) && SvOK(*key)) offset = SvUV(*key);
+		if ((key = hv_fetchs(opt, "iterator", 0)) && SvOK(*key)) iterator = get_iterator(&tmp, *key);
+		if ((key = hv_fetchs(opt, "hash", 0)) ) use_hash = SvOK(*key) ? SvIV( *key ) : 0;
+		if ((key = hv_fetchs(opt, "compact", 0)) ) compact = SvTRUE(*key) ? 1 : 0;
+		if ((key = hv_fetchs(opt, "lazy", 0)) ) lazy = SvTRUE(*key) ? 1 : 0;
+		if ((key = hv_fetchs(opt, "timeout", 0)) && SvOK(*key)) timeout = SvNV(*key);
+		if ((key = hv_fetchs(opt, "in", 0)) && SvOK(*key)) {
+			in_sv = sv_2mortal(newSVsv(*key));
+			dExtractFormat2(in, in_sv, NULL);
+		}
+	}
+
+	Newxz(p, 1, TntPrepared);
+	p->space = newSVsv(space);
+	if (opt && (key = hv_fetchs(opt, "index", 0)) && SvOK(*key)) {
+		p->index = newSVsv(*key);
+	}
+	p->limit = limit;
+	p->offset = offset;
+	p->iterator = iterator;
+	p->use_hash = use_hash;
+	p->compact = compact;
+	p->lazy = lazy;
+	p->timeout = timeout;
+	p->in = in_sv ? SvREFCNT_inc_NN(in_sv) : NULL;
+	p->in_fmt = in;
+	return p;
+}
+
+/* Resolves space and index against the current schema and encodes the body template */
+static TntSpace *prepared_build(TntPrepared *p, HV *spaces, uint32_t gen, uint8_t log_level, SV *cb) {
+	TntSpace *spc;
+	TntIndex *idx = NULL;
+	uint32_t index = 0;
+	SV **key;
+
+	if (!( spc = evt_find_space(p->space, spaces, log_level, cb) )) {
+		return NULL;
+	}
+	if (p->index && spc->indexes) {
+		key = &p->index;
+		if (( idx = evt_find_index(spc, key, log_level) ))
+			index = idx->id;
+	}
+	if (!idx && spc->indexes && (key = hv_fetch(spc->indexes, (char *) &index, sizeof(U32), 0)) && *key) {
+		idx = (TntIndex *) SvPVX(*key);
+	}
+
+	char *h = p->body;
+	h = mp_encode_map(h, 4 + (p->offset != -1) + (p->iterator != -1));
+	h = mp_encode_uint(h, TP_SPACE);
+	h = mp_encode_uint(h, spc->id);
+	h = mp_encode_uint(h, TP_LIMIT);
+	h = mp_encode_uint(h, p->limit);
+	h = mp_encode_uint(h, TP_INDEX);
+	h = mp_encode_uint(h, index);
+	if (p->offset != -1) {
+		h = mp_encode_uint(h, TP_OFFSET);
+		h = mp_encode_uint(h, p->offset);
+	}
+	if (p->iterator != -1) {
+		h = mp_encode_uint(h, TP_ITERATOR);
+		h = mp_encode_uint(h, p->iterator);
+	}
+	h = mp_encode_uint(h, TP_KEY);
+	p->body_len = h - p->body;
+
+	p->spc = spc;
+	p->idx = idx;
+	p->fmt = p->in ? &p->in_fmt : idx ? &idx->f : &p->in_fmt;
+	p->gen = gen;
+	return spc;
+}
+
+#endif // _PREPARED_H_
@@ -0,0 +1,175 @@
+#ifndef _RBUFPOOL_H_
+#define _RBUFPOOL_H_
+
+#include "xsmy.h"
+#include "cxt.h"
+
+#ifndef TNT_RBUF_MIN
+#  define TNT_RBUF_MIN (64*1024)
+#endif
+
+#ifndef TNT_RBUF_MAX
+#  define TNT_RBUF_MAX (4*1024*1024)
+#endif
+
+#ifndef TNT_RBUF_IDLE
+#  define TNT_RBUF_IDLE 10.
+#endif
+
+/*
+ * Read buffer shared by the connections of one event loop
+ * (shared_read_buffer option).
+ *
+ * Reads are synchronous, and a sharing connection consumes everything it
+ * read before returning: complete replies are dispatched and a trailing
+ * partial one is moved to the connection's own reassembly buffer. So the
+ * buffer is always empty between reads and one buffer can serve every
+ * connection on the loop, with no tail memmove. It doubles when a read
+ * fills it completely. It halves after TNT_RBUF_IDLE seconds without
+ * such a read, down to TNT_RBUF_MIN. The pool is freed along with its
+ * buffer when the last connection detaches.
+ *
+ * Partial replies are reassembled outside of the read buffer, so a
+ * connection frees its own buffer while attached and allocates it again
+ * on detach.
+ *
+ * A sharing connection's callbacks must not run the event loop
+ * recursively: a nested read by another connection would overwrite
+ * replies that are not yet dispatched.
+ */
+
+struct _TntRbufPool;
+
+typedef struct _TntRbufUser {
+	ev_cnn                 *cnn;
+	struct _TntRbufPool    *pool;
+	size_t                  own_len;  /* size of the connection's own buffer, restored on detach */
+	struct _TntRbufUser    *prev;
+	struct _TntRbufUser    *next;
+} TntRbufUser;
+
+typedef struct _TntRbufPool {
+	struct ev_loop      *loop;
+	char                *buf;
+	size_t               len;
+	size_t               want;   /* size to switch to once no read is in progress */
+	uint32_t             busy;   /* reads in progress */
+	uint32_t             fills;  /* reads that filled the buffer in this idle period */
+	ev_timer             idle;
+	TntRbufUser         *users;
+	struct _TntRbufPool *next;
+} TntRbufPool;
+
+static void rbuf_pool_resize(TntRbufPool *pool, size_t len) {
+	TntRbufUser *u;
+	Safefree(pool->buf);
+	Newx(pool->buf, len, char);
+	pool->len = pool->want = len;
+	for (u = pool->users; u; u = u->next) {
+		u->cnn->rbuf = pool->buf;
+		u->cnn->rlen = pool->len;
+	}
+}
+
+static void rbuf_pool_free(TntRbufPool *pool) {
+	dMY_CXT;
+	TntRbufPool **pp;
+	for (pp = &MY_CXT.rbuf_pools; *pp != pool; pp = &(*pp)->next);
+	*pp = pool->next;
+	ev_ref(pool->loop);
+	ev_timer_stop(pool->loop, &pool->idle);
+	Safefree(pool->buf);
+	Safefree(pool);
+}
+
+static void on_rbuf_pool_idle(EV_P_ ev_timer *t, int flags) {
+	TntRbufPool *pool = (TntRbufPool *) ((char *) t - offsetof(TntRbufPool, idle));
+	if (pool->busy > 0) return;
+	if (pool->fills == 0 && pool->len > TNT_RBUF_MIN) {
+		rbuf_pool_resize(pool, pool->len / 2 > TNT_RBUF_MIN ? pool->len / 2 : TNT_RBUF_MIN);
+	}
+	pool->fills = 0;
+}
+
+static void rbuf_pool_attach(TntRbufUser *u, ev_cnn *cnn) {
+	dMY_CXT;
+	TntRbufPool *pool;
+	if (u->pool) return;
+
+	for (pool = MY_CXT.rbuf_pools; pool && pool->loop != cnn->loop; pool = pool->next);
+	if (!pool) {
+		Newxz(pool, 1, TntRbufPool);
+		pool->loop = cnn->loop;
+		ev_timer_init(&pool->idle, on_rbuf_pool_idle, TNT_RBUF_IDLE, TNT_RBUF_IDLE);
+		ev_timer_start(pool->loop, &pool->idle);
+		ev_unref(pool->loop);
+		pool->next = MY_CXT.rbuf_pools;
+		MY_CXT.rbuf_pools = pool;
+		pool->len = pool->want = TNT_RBUF_MIN;
+		Newx(pool->buf, pool->len, char);
+	}
+
+	u->cnn = cnn;
+	u->pool = pool;
+	u->own_len = cnn->rlen;
+	if (cnn->ruse > pool->len) cnn->ruse = pool->len;
+	if (cnn->ruse > 0) memcpy(pool->buf, cnn->rbuf, cnn->ruse);
+	Safefree(cnn->rbuf);
+	cnn->rbuf = pool->buf;
+	cnn->rlen = pool->len;
+
+	u->prev = NULL;
+	u->next = pool->users;
+	if (pool->users) pool->users->prev = u;
+	pool->users = u;
+}
+
+/* A detach may happen while a read still walks the buffer: a busy pool is freed on leave */
+static void rbuf_pool_detach(TntRbufUser *u) {
+	TntRbufPool *pool = u->pool;
+	if (!pool) return;
+
+	Newx(u->cnn->rbuf, u->own_len, char);
+	u->cnn->rlen = u->own_len;
+	u->cnn->ruse = 0;
+
+	if (u->prev) u->prev->next = u->next;
+	else pool->users = u->next;
+	if (u->next) u->next->prev = u->prev;
+	u->prev = u->next = NULL;
+	u->pool = NULL;
+
+	if (!pool->users && !pool->busy) {
+		rbuf_pool_free(pool);
+	}
+}
+
+/* Starts a read on the pool buffer; the pool is then held busy until the enclosing scope is left */
+static void rbuf_pool_leave(pTHX_ void *p) {
+	TntRbufPool *pool = (TntRbufPool *) p;
+	if (--pool->busy > 0) return;
+	if (!pool->users) {
+		rbuf_pool_free(pool);
+	} else if (pool->want != pool->len) {
+		rbuf_pool_resize(pool, pool->want);
+	}
+}
+
+#define rbuf_pool_enter(u) STMT_START { \
+	if ((u)->pool) { \
+		++(u)->pool->busy; \
+		SAVEDESTRUCTOR_X(rbuf_pool_leave, (u)->pool); \
+	} \
+} STMT_END
+
+/* Notes a read that filled the whole buffer */
+static inline void rbuf_pool_filled(TntRbufUser *u) {
+	TntRbufPool *pool = u->pool;
+	if (!pool) return;
+	++pool->fills;
+	if (pool->want < TNT_RBUF_MAX) {
+		pool->want = pool->want * 2 < TNT_RBUF_MAX ? pool->want * 2 : TNT_RBUF_MAX;
+	}
+}
+
+#endif // _RBUFPOOL_H_
@@ -0,0 +1,129 @@
+#ifndef _REQTABLE_H_
+#define _REQTABLE_H_
+
+#include "xsmy.h"
+#include "types.h"
+
+#ifndef TNT_REQS_INITIAL_SIZE
+#  define TNT_REQS_INITIAL_SIZE 64
+#endif
+
+/*
+ * In-flight requests of a connection, indexed by sync id.
+ *
+ * Open addressing with linear probing over a power-of-two array. Sync ids
+ * are handed out sequentially, so `id & mask` almost never collides while
+ * the table is at most half full, and a lookup is one or two slot reads.
+ * Deletion uses backward shifting, so there are no tombstones to clean up.
+ */
+
+typedef struct {
+	uint32_t  id;
+	TntCtx   *ctx;
+} TntReqSlot;
+
+typedef struct {
+	TntReqSlot *slots;
+	uint32_t    size;  /* power of two */
+	uint32_t    count;
+} TntReqs;
+
+#define reqs_mask(reqs) ((reqs)->size - 1)
+
+#define reqs_foreach(reqs, slot) \
+	for (slot = (reqs)->slots; slot < (reqs)->slots + (reqs)->size; ++slot) \
+		if (slot->ctx)
+
+static inline void reqs_init(TntReqs *reqs, uint32_t size) {
+	reqs->size = size;
+	reqs->count = 0;
+	Newxz(reqs->slots, size, TntReqSlot);
+}
+
+static inline void reqs_destroy(TntReqs *reqs) {
+	if (reqs->slots) {
+		Safefree(reqs->slots);
+		reqs->slots = NULL;
+	}
+	reqs->size = 0;
+	reqs->count = 0;
+}
+
+static inline void _reqs_insert(TntReqs *reqs, uint32_t id, TntCtx *ctx) {
+	uint32_t mask = reqs_mask(reqs);
+	uint32_t i = id & mask;
+	while (reqs->slots[i].ctx) {
+		i = (i + 1) & mask;
+	}
+	reqs->slots[i].id = id;
+	reqs->slots[i].ctx = ctx;
+	++reqs->count;
+}
+
+static void reqs_grow(TntReqs *reqs) {
+	TntReqSlot *old = reqs->slots;
+	uint32_t old_size = reqs->size;
+	uint32_t i;
+
+	reqs_init(reqs, old_size << 1);
+	for (i = 0; i < old_size; ++i) {
+		if (old[i].ctx) {
+			_reqs_insert(reqs, old[i].id, old[i].ctx);
+		}
+	}
+	Safefree(old);
+}
+
+static inline void reqs_put(TntReqs *reqs, uint32_t id, TntCtx *ctx) {
+	if (unlikely((reqs->count + 1) * 2 > reqs->size)) {
+		reqs_grow(reqs);
+	}
+	_reqs_insert(reqs, id, ctx);
+}
+
+static inline void _reqs_remove_at(TntReqs *reqs, uint32_t hole) {
+	TntReqSlot *slots = reqs->slots;
+	uint32_t mask = reqs_mask(reqs);
+	uint32_t j = hole;
+
+	slots[hole].ctx = NULL;
+	--reqs->count;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!slots[j].ctx) break;
+
+		/* entry at j may fill the hole unless its home slot lies in (hole, j] */
+		uint32_t home = slots[j].id & mask;
+		bool in_range = hole <= j
+			? (hole < home && home <= j)
+			: (hole < home || home <= j);
+		if (!in_range) {
+			slots[hole] = slots[j];
+			slots[j].ctx = NULL;
+			hole = j;
+		}
+	}
+}
+
+static inline TntCtx *reqs_take(TntReqs *reqs, uint32_t id) {
+	uint32_t mask = reqs_mask(reqs);
+	uint32_t i = id & mask;
+	while (reqs->slots[i].ctx) {
+		if (reqs->slots[i].id == id) {
+			TntCtx *ctx = reqs->slots[i].ctx;
+			_reqs_remove_at(reqs, i);
+			return ctx;
+		}
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+/* Moves all entries out into `detached`, leaving an empty table of the same size */
+static inline void reqs_detach(TntReqs *reqs, TntReqs *detached) {
+	*detached = *reqs;
+	reqs_init(reqs, detached->size);
+}
+
+#endif // _REQTABLE_H_
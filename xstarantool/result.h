@@ -0,0 +1,100 @@
+#ifndef _RESULT_H_
+#define _RESULT_H_
+
+#include "xsmy.h"
+#include "types.h"
+
+/*
+ * Reply of a request.
+ *
+ * The body parser always fills a TntResult. By default it is then moved into
+ * a plain hash { code, sync, schema_id, status, errstr, count, tuples }; with
+ * the `compact` option the struct itself is handed to the callback, blessed
+ * into EV::Tarantool16::Result, so a reply costs one allocation plus the
+ * tuples array. The hash is built only if the result is dereferenced as one.
+ */
+
+enum {
+	TNT_RES_NONE = 0,
+	TNT_RES_OK,
+	TNT_RES_ERROR
+};
+
+typedef struct {
+	int      code;
+	int      sync;
+	int      schema_id;
+	int      status;
+	SV      *errstr;
+	AV      *tuples;
+	uint32_t count;
+	const char *rest;     /* set if tuples are left to on_chunk; not valid after the reply is parsed */
+	const char *rest_end;
+	HV      *hv;     /* hash view, built on demand */
+} TntResult;
+
+static HV *result_stash;
+
+/* objects blessed by us are recognized by their stash, subclasses the slow way */
+#define xs_result_self(r) \
+	if (unlikely(!SvROK(this) || !SvOBJECT(SvRV(this)) || (SvSTASH(SvRV(this)) != result_stash \
+			&& !sv_derived_from(this, "EV::Tarantool16::Result")))) \
+		croak("Not an EV::Tarantool16::Result"); \
+	TntResult *r = (TntResult *) SvPVX(SvRV(this))
+
+static inline void result_init(TntResult *r, tnt_header_t *hdr) {
+	memset(r, 0, sizeof(TntResult));
+	r->code = hdr->code;
+	r->sync = hdr->id;
+	r->schema_id = hdr->schema_id;
+}
+
+static SV *result_new(tnt_header_t *hdr, TntResult **res) {
+	dSVX(rsv, r, TntResult);
+	result_init(r, hdr);
+	*res = r;
+	return sv_bless(newRV_noinc(rsv), result_stash);
+}
+
+static void result_destroy(TntResult *r) {
+	if (r->errstr) SvREFCNT_dec(r->errstr);
+	if (r->tuples) SvREFCNT_dec(r->tuples);
+	if (r->hv) SvREFCNT_dec(r->hv);
+	memset(r, 0, sizeof(TntResult));
+}
+
+static inline SV *result_status(TntResult *r) {
+	switch (r->status) {
+	case TNT_RES_OK:    return newSVpvs("ok");
+	case TNT_RES_ERROR: return newSVpvs("error");
+	default:            return NULL;
+	}
+}
+
+/* Stores the result into hv; the errstr and tuples references are moved when steal is set */
+static void result_store_hv(TntResult *r, HV *hv, int steal) {
+	SV *status;
+	(void) hv_stores(hv, "code", newSViv(r->code));
+	(void) hv_stores(hv, "sync", newSViv(r->sync));
+	if (r->schema_id > 0) {
+		(void) hv_stores(hv, "schema_id", newSViv(r->schema_id));
+	}
+	if ((status = result_status(r))) {
+		(void) hv_stores(hv, "status", status);
+	}
+	if (r->errstr) {
+		(void) hv_stores(hv, "errstr", steal ? r->errstr : newSVsv(r->errstr));
+	}
+	if (r->tuples) {
+		(void) hv_stores(hv, "count", newSViv(av_len(r->tuples) + 1));
+		(void) hv_stores(hv, "tuples", steal ? newRV_noinc((SV *) r->tuples) : newRV_inc((SV *) r->tuples));
+	} else if (r->rest) {
+		(void) hv_stores(hv, "count", newSViv(r->count));
+	}
+	if (steal) {
+		r->errstr = NULL;
+		r->tuples = NULL;
+	}
+}
+
+#endif // _RESULT_H_
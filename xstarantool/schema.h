@@ -0,0 +1,140 @@
+#ifndef _SCHEMA_H_
+#define _SCHEMA_H_
+
+#include "xsmy.h"
+#include "xstnt16.h"
+
+/*
+ * Schema cache file (schema_cache option).
+ *
+ * The file holds the schema_id and the bodies of the _vspace and _vindex
+ * replies the schema was decoded from: TNT_SCHEMA_MAGIC, a version byte and
+ * [ schema_id, _vspace body, _vindex body ] in msgpack. A new connection
+ * decodes it up front and treats it like a schema kept over a reconnect, so
+ * even its first handshake skips loading when the server's schema_id still
+ * matches. Every completed load rewrites the file through a rename.
+ */
+
+#define TNT_SCHEMA_MAGIC   "T16S"
+#define TNT_SCHEMA_VERSION 1
+
+static void schema_file_save(SV *path, uint32_t schema_id, SV *spaces_body, const char *index_body, uint32_t index_len, uint8_t log_level) {
+	const char *name = SvPV_nolen(path);
+	uint32_t spaces_len = SvCUR(spaces_body);
+	size_t size = 5 + mp_sizeof_array(3) + mp_sizeof_uint(schema_id) + mp_sizeof_bin(spaces_len) + mp_sizeof_bin(index_len);
+	SV *buf = sv_2mortal(newSV(size));
+	char *p = SvPVX(buf), *h = p;
+
+	memcpy(h, TNT_SCHEMA_MAGIC, 4);
+	h += 4;
+	*h++ = TNT_SCHEMA_VERSION;
+	h = mp_encode_array(h, 3);
+	h = mp_encode_uint(h, schema_id);
+	h = mp_encode_bin(h, SvPVX(spaces_body), spaces_len);
+	h = mp_encode_bin(h, index_body, index_len);
+
+	SV *tmp = sv_2mortal(newSVpvf("%s.%d", name, (int) PerlProc_getpid()));
+	PerlIO *f = PerlIO_open(SvPVX(tmp), "wb");
+	if (!f) {
+		log_warn(log_level, "Couldn't write schema cache %s: %s", SvPVX(tmp), strerror(errno));
+		return;
+	}
+	int ok = PerlIO_write(f, p, h - p) == h - p;
+	ok = PerlIO_close(f) == 0 && ok;
+	if (!ok || PerlLIO_rename(SvPVX(tmp), name) != 0) {
+		log_warn(log_level, "Couldn't write schema cache %s: %s", name, strerror(errno));
+		(void) PerlLIO_unlink(SvPVX(tmp));
+	}
+}
+
+/*
+ * The body parsers croak on semantic errors (a bad format, an index of an
+ * unknown space). A cache file is only a hint, so they run inside an eval:
+ * an anonymous XSUB called with G_EVAL, which gets its arguments through
+ * a pointer.
+ */
+typedef struct {
+	const char *spaces_body;
+	const char *index_body;
+	uint32_t    spaces_len;
+	uint32_t    index_len;
+	uint8_t     log_level;
+	HV         *spaces;     /* the result, NULL if the bodies don't parse */
+} TntSchemaParse;
+
+static XSPROTO(schema_file_parse) {
+	dXSARGS;
+	TntSchemaParse *job = INT2PTR(TntSchemaParse *, SvIV(ST(0)));
+	HV *ret = (HV *) sv_2mortal((SV *) newHV());
+	SV **var;
+	PERL_UNUSED_VAR(cv);
+	PERL_UNUSED_VAR(items);
+
+	/* the spaces belong to ret until both bodies are parsed */
+	if (parse_spaces_body(ret, job->spaces_body, job->spaces_len, job->log_level) < 0) XSRETURN_EMPTY;
+	if (!(var = hv_fetchs(ret, "data", 0)) || !SvROK(*var)) XSRETURN_EMPTY;
+	if (parse_index_body((HV *) SvRV(*var), ret, job->index_body, job->index_len, job->log_level) < 0) XSRETURN_EMPTY;
+
+	job->spaces = (HV *) SvREFCNT_inc(SvRV(*var));
+	XSRETURN_EMPTY;
+}
+
+/* Decodes the spaces saved in the file, or returns NULL if there is no usable one */
+static HV *schema_file_load(SV *path, uint32_t *schema_id, uint8_t log_level) {
+	const char *name = SvPV_nolen(path);
+	PerlIO *f = PerlIO_open(name, "rb");
+	if (!f) {
+		return NULL;
+	}
+
+	SV *buf = sv_2mortal(newSV(64 * 1024));
+	STRLEN len = 0;
+	SSize_t n;
+	while ((n = PerlIO_read(f, SvPVX(buf) + len, SvLEN(buf) - len)) > 0) {
+		len += n;
+		if (len == SvLEN(buf)) SvGROW(buf, len * 2);
+	}
+	PerlIO_close(f);
+
+	const char *p = SvPVX(buf), *end = p + len, *test;
+	TntSchemaParse job;
+	uint32_t id;
+
+	if (len < 5 || memcmp(p, TNT_SCHEMA_MAGIC, 4) != 0 || p[4] != TNT_SCHEMA_VERSION) goto bad;
+	p += 5;
+	test = p;
+	if (mp_check(&test, end) || mp_typeof(*p) != MP_ARRAY || mp_decode_array(&p) != 3) goto bad;
+	if (mp_typeof(*p) != MP_UINT) goto bad;
+	id = mp_decode_uint(&p);
+	if (mp_typeof(*p) != MP_BIN) goto bad;
+	job.spaces_body = mp_decode_bin(&p, &job.spaces_len);
+	if (mp_typeof(*p) != MP_BIN) goto bad;
+	job.index_body = mp_decode_bin(&p, &job.index_len);
+	job.log_level = log_level;
+	job.spaces = NULL;
+
+	{
+		dSP;
+		CV *parse = (CV *) sv_2mortal((SV *) newXS(NULL, schema_file_parse, __FILE__));
+		ENTER; SAVETMPS;
+		PUSHMARK(SP);
+		XPUSHs(sv_2mortal(newSViv(PTR2IV(&job))));
+		PUTBACK;
+		(void) call_sv((SV *) parse, G_DISCARD | G_VOID | G_EVAL);
+		if (SvTRUE(ERRSV)) {
+			log_warn(log_level, "Ignoring schema cache %s: %s", name, SvPV_nolen(ERRSV));
+			sv_setpvs(ERRSV, "");
+		}
+		FREETMPS; LEAVE;
+	}
+	if (!job.spaces) goto bad;
+
+	*schema_id = id;
+	return job.spaces;
+
+bad:
+	log_warn(log_level, "Ignoring malformed schema cache %s", name);
+	return NULL;
+}
+
+#endif // _SCHEMA_H_
@@ -0,0 +1,80 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "xsmy.h"
+#include "types.h"
+#include "xstnt16.h"
+
+/*
+ * Chunked delivery of a reply (on_chunk option).
+ *
+ * The undecoded tuples of the reply are copied out of the read buffer and
+ * decoded `ctx->chunk` at a time from a zero-delay timer, so the loop polls
+ * between chunks and at most one chunk of Perl values exists at once. The
+ * context stays allocated until the last chunk; the final callback then gets
+ * the reply without tuples.
+ */
+
+typedef struct _TntStream {
+	ev_timer    t;
+	void       *self;  /* TntCnn */
+	TntCtx     *ctx;
+	SV         *buf;   /* undecoded tuples */
+	const char *p;
+	uint32_t    left;
+	SV         *reply;
+	struct _TntStream *prev;
+	struct _TntStream *next;
+} TntStream;
+
+static TntStream *stream_new(void *self, TntCtx *ctx, TntResult *res, SV *reply) {
+	TntStream *s;
+	Newxz(s, 1, TntStream);
+	s->self = self;
+	s->ctx = ctx;
+	s->buf = newSVpvn(res->rest, res->rest_end - res->rest);
+	s->p = SvPVX(s->buf);
+	s->left = res->count;
+	s->reply = SvREFCNT_inc(reply);
+	return s;
+}
+
+static inline void stream_link(TntStream **head, TntStream *s) {
+	s->prev = NULL;
+	s->next = *head;
+	if (*head) (*head)->prev = s;
+	*head = s;
+}
+
+static inline void stream_unlink(TntStream **head, TntStream *s) {
+	if (s->prev) s->prev->next = s->next;
+	else *head = s->next;
+	if (s->next) s->next->prev = s->prev;
+	s->prev = s->next = NULL;
+}
+
+static void stream_free(TntStream *s) {
+	SvREFCNT_dec(s->buf);
+	SvREFCNT_dec(s->reply);
+	Safefree(s);
+}
+
+/* Decodes the next chunk of at most ctx->chunk tuples */
+static AV *stream_next_chunk(TntStream *s) {
+	TntCtx *ctx = s->ctx;
+	uint32_t n = s->left < ctx->chunk ? s->left : ctx->chunk;
+	AV *fields = (ctx->space && ctx->use_hash) ? ctx->space->fields : NULL;
+	uint32_t mismatch = 0;
+
+	AV *tuples = newAV();
+	av_extend(tuples, n);
+	decode_tuples(ctx, tuples, &s->p, n, s->buf, &ctx->f, fields, &mismatch);
+	s->left -= n;
+
+	if (unlikely(mismatch)) {
+		log_warn(ctx->log_level, "%u values in reply do not match format '%.*s'", mismatch, (int) ctx->f.size, ctx->f.f);
+	}
+	return tuples;
+}
+
+#endif // _STREAM_H_
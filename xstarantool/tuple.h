@@ -0,0 +1,96 @@
+#ifndef _TUPLE_H_
+#define _TUPLE_H_
+
+#include "xsmy.h"
+#include "msgpuck.h"
+#include "types.h"
+#include "encdec.h"
+
+/*
+ * Lazily decoded tuple (EV::Tarantool16::Tuple).
+ *
+ * All tuples of a reply share one copy of the raw reply data. Field offsets
+ * are found with mp_next only as far as the highest field accessed so far,
+ * and every field is decoded at most once, on first access.
+ */
+
+typedef struct {
+	SV          *buf;    /* raw data of the whole reply */
+	const char  *data;   /* first field of this tuple inside buf */
+	uint32_t     size;   /* number of fields */
+	uint32_t     known;  /* fields with a known offset */
+	const char **offs;
+	SV         **vals;
+	AV          *fields; /* field names of the space */
+	HV          *field;  /* field name => TntField */
+} TntTuple;
+
+static HV *tuple_stash;
+
+/* objects blessed by us are recognized by their stash, subclasses the slow way */
+#define xs_tuple_self(t) \
+	if (unlikely(!SvROK(this) || !SvOBJECT(SvRV(this)) || (SvSTASH(SvRV(this)) != tuple_stash \
+			&& !sv_derived_from(this, "EV::Tarantool16::Tuple")))) \
+		croak("Not an EV::Tarantool16::Tuple"); \
+	TntTuple *t = (TntTuple *) SvPVX(SvRV(this))
+
+static SV *tuple_new(SV *buf, const char *data, uint32_t size, TntSpace *spc) {
+	dSVX(tsv, t, TntTuple);
+	t->buf = SvREFCNT_inc_NN(buf);
+	t->data = data;
+	t->size = size;
+	if (spc && spc->fields && spc->field) {
+		t->fields = (AV *) SvREFCNT_inc_NN((SV *) spc->fields);
+		t->field = (HV *) SvREFCNT_inc_NN((SV *) spc->field);
+	}
+	return sv_bless(newRV_noinc(tsv), tuple_stash);
+}
+
+static void tuple_destroy(TntTuple *t) {
+	uint32_t i;
+	if (t->vals) {
+		for (i = 0; i < t->size; i++) {
+			if (t->vals[i]) SvREFCNT_dec(t->vals[i]);
+		}
+		Safefree(t->vals);
+		Safefree(t->offs);
+	}
+	if (t->fields) SvREFCNT_dec(t->fields);
+	if (t->field) SvREFCNT_dec(t->field);
+	SvREFCNT_dec(t->buf);
+	memset(t, 0, sizeof(TntTuple));
+}
+
+/* Returns the decoded field, owned by the tuple, or NULL if out of range */
+static SV *tuple_get(TntTuple *t, uint32_t i) {
+	if (i >= t->size) return NULL;
+
+	if (unlikely(!t->vals)) {
+		Newxz(t->vals, t->size, SV *);
+		Newx(t->offs, t->size, const char *);
+		t->offs[0] = t->data;
+		t->known = 1;
+	}
+	if (t->vals[i]) return t->vals[i];
+
+	while (t->known <= i) {
+		const char *p = t->offs[t->known - 1];
+		mp_next(&p);
+		t->offs[t->known++] = p;
+	}
+
+	const char *p = t->offs[i];
+	t->vals[i] = decode_obj(&p);
+	return t->vals[i];
+}
+
+static int tuple_field_no(TntTuple *t, SV *name, uint32_t *no) {
+	HE *he;
+	if (t->field && (he = hv_fetch_ent(t->field, name, 0, 0)) && SvOK(HeVAL(he))) {
+		*no = ((TntField *) SvPVX(HeVAL(he)))->id;
+		return 1;
+	}
+	return 0;
+}
+
+#endif // _TUPLE_H_
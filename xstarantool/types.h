@@ -32,6 +32,11 @@ enum tp_response_key_t {
 	TP_ERROR = 0x31
 };
 
+/* error codes */
+enum tp_error_code_t {
+	TP_ER_WRONG_SCHEMA_VERSION = 109
+};
+
 /* request types */
 enum tp_request_type {
 	TP_SELECT = 0x01,
@@ -55,14 +60,18 @@ typedef struct {
 void tnt_header_init(tnt_header_t *hdr) {
 	hdr->code = -1;
 	hdr->id = -1;
-	hdr->schema_id = -1;
+	hdr->schema_id = 0; /* not sent by the server */
 }
 
+struct _TntEncPlan;
+typedef void (*tnt_enc_fn)(struct _TntEncPlan *, SV *, char);
+
 typedef struct {
-	size_t  size;
-	char   *f;
-	int     nofree;
-	char    def;
+	size_t      size;
+	char       *f;
+	int         nofree;
+	char        def;
+	tnt_enc_fn *enc;  /* per-field encoders of a schema format, see enc_compile */
 } unpack_format;
 
 
@@ -72,6 +81,8 @@ typedef struct {
 	SV   *type;
 	HV   *opts;
 	AV   *fields;
+	uint32_t *parts;  /* field numbers of the key parts */
+	uint32_t  parts_count;
 	unpack_format f;
 } TntIndex;
 
@@ -91,17 +102,56 @@ typedef struct {
 } TntSpace;
 
 typedef struct {
-	ev_timer t;
+	uint32_t no;        /* field number in the tuple */
+	uint32_t slot;      /* position in the result */
+} TntProj;
+
+typedef struct _TntBatch {
+	SV      *cb;      /* aggregate callback */
+	AV      *results;
+	uint32_t left;    /* unanswered requests, +1 while the batch is being sent */
+	SV      *error;   /* error slot the requests are encoded with, see err_slot_new */
+} TntBatch;
+
+/* A lookup of a lazy space, kept by the context of its request in flight */
+typedef struct {
+	SV      *name;
+	HV      *spaces;    /* _vspace reply, waiting for the _vindex one */
+	uint32_t schema_id; /* of the _vspace reply */
+	U32      preload;   /* connected waits for it */
+} TntLookup;
+
+/* CV and up to 6 arguments (update, upsert) */
+#define TNT_REPLAY_MAX 7
+
+typedef struct _TntCtx {
+	ev_tstamp deadline;
+	struct _TntCtx *dprev;
+	struct _TntCtx *dnext;
+	uint32_t dq;
 	uint32_t id;
 	void *self;
 	SV *cb;
-	SV *wbuf;
 	U32 use_hash;
+	U32 lazy;
+	U32 compact;
 	uint8_t log_level;
 	TntSpace *space;
 	unpack_format *fmt;
 	unpack_format f;
+	TntProj *proj;      /* requested fields, sorted by field number */
+	uint32_t proj_count;
 	char *call;
+	TntBatch *batch;
+	uint32_t batch_idx;
+	SV *on_chunk;
+	uint32_t chunk;
+	uint32_t schema_id;  /* sent in the request header, 0 for none */
+	HV *spaces;          /* keeps the schema of `space` alive until the reply */
+	SV *replay[TNT_REPLAY_MAX]; /* CV and arguments of the call, repeated after a schema reload */
+	uint32_t replay_n;
+	TntLookup *lookup;
+	struct _TntCtx *next;
 } TntCtx;
 
 typedef struct {
@@ -129,7 +179,8 @@ typedef enum {
 	FMT_ARRAY = 'a',
 	FMT_SCALAR = 'r',
 	FMT_MAP = 'm',
-	FMT_BOOLEAN = 'b'
+	FMT_BOOLEAN = 'b',
+	FMT_BINARY = 'x'
 } tnt_format_t;
 
 typedef enum {
@@ -0,0 +1,89 @@
+#ifndef _UTF8_H_
+#define _UTF8_H_
+
+#include <string.h>
+#include <stdint.h>
+#include "xsmy.h"
+
+/*
+ * Strings from replies are marked as UTF-8 only when they need to be:
+ * the leading run of ASCII bytes is found 32 (AVX2) or 16 (SSE2) bytes at
+ * a time, and perl's own validator runs only on the rest, if any. The result
+ * is the same as sv_utf8_decode, which checks the whole string byte by byte.
+ * The AVX2 kernel is picked at runtime by tnt_utf8_init; other platforms
+ * scan a word at a time.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#  define TNT_ASCII_SIMD 1
+#  include <immintrin.h>
+#endif
+
+static inline size_t ascii_prefix_word(const char *s, size_t len) {
+	size_t i = 0;
+	uint64_t w;
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, 8);
+		if (w & 0x8080808080808080ULL) break;
+	}
+	for (; i < len; i++) {
+		if ((unsigned char) s[i] & 0x80) break;
+	}
+	return i;
+}
+
+#ifdef TNT_ASCII_SIMD
+
+static size_t ascii_prefix_sse2(const char *s, size_t len) {
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		unsigned m = (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (s + i)));
+		if (m) return i + __builtin_ctz(m);
+	}
+	return i + ascii_prefix_word(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_prefix_avx2(const char *s, size_t len) {
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		unsigned m = (unsigned) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (s + i)));
+		if (m) return i + __builtin_ctz(m);
+	}
+	return i + ascii_prefix_sse2(s + i, len - i);
+}
+
+static size_t (*ascii_prefix_simd)(const char *, size_t) = ascii_prefix_sse2;
+
+static void tnt_utf8_init(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ascii_prefix_simd = ascii_prefix_avx2;
+	}
+}
+
+#else
+
+static void tnt_utf8_init(void) {}
+
+#endif
+
+/* Length of the leading ASCII run of s */
+static inline size_t ascii_prefix(const char *s, size_t len) {
+#ifdef TNT_ASCII_SIMD
+	if (len >= 16) return ascii_prefix_simd(s, len);
+#endif
+	return ascii_prefix_word(s, len);
+}
+
+/* New SV with the bytes of a MP_STR, flagged as UTF-8 if it is non-ASCII valid UTF-8 */
+static inline SV *newSVstr_utf8(const char *s, uint32_t len) {
+	SV *sv = newSVpvn(s, len);
+	size_t a = ascii_prefix(s, len);
+	if (a < len && is_utf8_string((const U8 *) s + a, len - a)) {
+		SvUTF8_on(sv);
+	}
+	return sv;
+}
+
+#endif // _UTF8_H_
@@ -43,9 +43,28 @@ typedef uint64_t U64;
 #define dObjBy(Type,obj,ptr,xx) Type *obj = (Type *) ( (char *) ptr - (ptrdiff_t) &((Type *) 0)-> xx )
 #endif
 
+/*
+ * An error slot passed in place of a callback gets the message of a failed
+ * request stored in it, for the caller to pick up after the request builder
+ * returns (see batch_send_op).
+ */
+static MGVTBL err_slot_vtbl;
+
+static SV *err_slot_new(void) {
+	SV *sv = newSV(0);
+	sv_magicext(sv, NULL, PERL_MAGIC_ext, &err_slot_vtbl, NULL, 0);
+	return sv;
+}
+
+static inline int is_err_slot(SV *sv) {
+	return sv && SvMAGICAL(sv) && mg_findext(sv, PERL_MAGIC_ext, &err_slot_vtbl);
+}
+
 #define _croak_cb(cb,...) STMT_START { \
 		/* warn(__VA_ARGS__);*/ \
-		if (likely(cb != NULL)) { \
+		if (unlikely(is_err_slot(cb))) { \
+			sv_setpvf(cb, __VA_ARGS__); \
+		} else if (likely(cb != NULL)) { \
 			dSP; \
 			ENTER; \
 			SAVETMPS; \
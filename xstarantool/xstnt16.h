@@ -8,17 +8,25 @@
 #include "msgpuck.h"
 #include "types.h"
 #include "encdec.h"
+#include "tuple.h"
+#include "result.h"
 #include "sha1.h"
 #include "base64.h"
 #include "log.h"
 
+#ifndef TNT_CHUNK_DEFAULT
+#  define TNT_CHUNK_DEFAULT 1000
+#endif
+
 static const uint32_t SCRAMBLE_SIZE = 20;
 static const uint32_t HEADER_CONST_LEN = 5 + // pkt_len
-                                         1 + // mp_sizeof_map(2) +
+                                         1 + // mp_sizeof_map(3) +
                                          1 + // mp_sizeof_uint(TP_CODE) +
                                          1 + // mp_sizeof_uint(TP COMMAND) +
                                          1 + // mp_sizeof_uint(TP_SYNC) +
-                                         5;  // sync len
+                                         5 + // sync len
+                                         1 + // mp_sizeof_uint(TP_SCHEMA_ID) +
+                                         5;  // schema_id len
 
 
 #define check_tuple(tuple, allow_hash, cb) STMT_START { \
@@ -37,7 +45,7 @@ static const uint32_t HEADER_CONST_LEN = 5 + // pkt_len
 
 
 
-#define dUnpackFormat(fvar) unpack_format fvar; fvar.f = ""; fvar.nofree = 1; fvar.size = 0; fvar.def = FMT_UNKNOWN
+#define dUnpackFormat(fvar) unpack_format fvar; fvar.f = ""; fvar.nofree = 1; fvar.size = 0; fvar.def = FMT_UNKNOWN; fvar.enc = NULL
 
 static TntIndex *evt_find_index(TntSpace *spc, SV **key, uint8_t log_level) {
 	if (SvIOK(*key)) {
@@ -95,8 +103,21 @@ static TntSpace *evt_find_space(SV *space, HV *spaces, uint8_t log_level, SV *cb
 	}
 }
 
-static void destroy_spaces(HV *spaces) {
+/*
+ * The spaces hash is freed like any other SV, together with its TntSpace and
+ * TntIndex structs, once the last reference is gone: besides the connection,
+ * every request in flight holds one for its ctx->space, so a reloaded schema
+ * outlives the replies still decoded with it.
+ */
+static HV *schema_registry = NULL;
+
+static int spaces_mg_free(pTHX_ SV *sv, MAGIC *mg) {
+	HV *spaces = (HV *) sv;
+	if (PL_dirty) return 0;
 	debug("Destroy started");
+	if (mg->mg_obj && schema_registry) {
+		(void) hv_delete(schema_registry, SvPVX(mg->mg_obj), SvCUR(mg->mg_obj), G_DISCARD);
+	}
 	HE *ent;
 	(void) hv_iterinit(spaces);
 	while ((ent = hv_iternext(spaces))) {
@@ -124,7 +145,10 @@ static void destroy_spaces(HV *spaces) {
 				if (idx->name) {
 					//cwarn("destroy index %s in space %s",SvPV_nolen(idx->name), SvPV_nolen(spc->name));
 					if (idx->f.size > 0) safefree(idx->f.f);
+					if (idx->f.enc) Safefree(idx->f.enc);
 					if (idx->fields) SvREFCNT_dec(idx->fields);
+					if (idx->parts) Safefree(idx->parts);
+					idx->parts = NULL;
 					SvREFCNT_dec(idx->name);
 					idx->name = NULL;
 
@@ -148,6 +172,10 @@ static void destroy_spaces(HV *spaces) {
 			spc->f.f = NULL;
 			spc->f.size = 0;
 		}
+		if (spc->f.enc) {
+			Safefree(spc->f.enc);
+			spc->f.enc = NULL;
+		}
 
 		if (spc->owner) {
 			SvREFCNT_dec(spc->owner);
@@ -166,9 +194,70 @@ static void destroy_spaces(HV *spaces) {
 			spc->flags = NULL;
 		}
 	}
+	return 0;
+}
+
+static MGVTBL spaces_vtbl = { NULL, NULL, NULL, NULL, spaces_mg_free };
+
+static HV *spaces_new(void) {
+	HV *spaces = newHV();
+	sv_magicext((SV *) spaces, NULL, PERL_MAGIC_ext, &spaces_vtbl, NULL, 0);
+	return spaces;
+}
+
+static inline void destroy_spaces(HV *spaces) {
 	SvREFCNT_dec(spaces);
 }
 
+/*
+ * Schemas shared by the connections to one cluster (share_schema option).
+ *
+ * A complete spaces hash is published under "<cluster uuid>:<schema_id>",
+ * and a connection that finds the same pair takes a reference to it instead
+ * of loading a copy of its own. The registry does not own the hashes: an
+ * entry goes away with the last reference to its hash, through the key kept
+ * in the magic. A published hash is not changed any more, except for the
+ * placeholders evt_find_space adds for numeric ids, which are the same for
+ * every connection.
+ */
+static SV *schema_key(SV *cluster, uint32_t schema_id) {
+	return sv_2mortal(newSVpvf("%" SVf ":%u", SVfARG(cluster), schema_id));
+}
+
+static HV *schema_shared(SV *cluster, uint32_t schema_id) {
+	SV **v;
+	if (!schema_registry || !cluster || !schema_id) return NULL;
+	SV *key = schema_key(cluster, schema_id);
+	if (!(v = hv_fetch(schema_registry, SvPVX(key), SvCUR(key), 0))) return NULL;
+	return INT2PTR(HV *, SvIV(*v));
+}
+
+/* Whether any schema of the cluster is published, whatever its schema_id */
+static int schema_shared_cluster(SV *cluster) {
+	STRLEN len, klen;
+	const char *name, *key;
+	HE *he;
+	if (!schema_registry || !cluster) return 0;
+	name = SvPV(cluster, len);
+	(void) hv_iterinit(schema_registry);
+	while ((he = hv_iternext(schema_registry))) {
+		key = HePV(he, klen);
+		if (klen > len && key[len] == ':' && memcmp(key, name, len) == 0) return 1;
+	}
+	return 0;
+}
+
+static void schema_share(HV *spaces, SV *cluster, uint32_t schema_id) {
+	MAGIC *mg = mg_findext((SV *) spaces, PERL_MAGIC_ext, &spaces_vtbl);
+	if (!cluster || !schema_id || !mg || mg->mg_obj || schema_shared(cluster, schema_id)) return;
+
+	SV *key = SvREFCNT_inc_NN(schema_key(cluster, schema_id));
+	if (!schema_registry) schema_registry = newHV();
+	(void) hv_store(schema_registry, SvPVX(key), SvCUR(key), newSViv(PTR2IV(spaces)), 0);
+	mg->mg_obj = key;
+	mg->mg_flags |= MGf_REFCOUNTED;
+}
+
 #define CHECK_PACK_FORMAT(src, cb) STMT_START { \
 	char *p = src; \
 	while(*p) { \
@@ -180,6 +269,9 @@ static void destroy_spaces(HV *spaces) {
 			case FMT_INTEGER: \
 			case FMT_ARRAY: \
 			case FMT_SCALAR: \
+			case FMT_MAP: \
+			case FMT_BOOLEAN: \
+			case FMT_BINARY: \
 				p++; break; \
 			default: \
 				croak_cb(cb,"Unknown pattern in format: %c", *p); \
@@ -208,6 +300,193 @@ static void destroy_spaces(HV *spaces) {
 	} \
 } STMT_END
 
+/* Format used to decode the reply: `out` option or the space format */
+#define evt_opt_out(ctx, opt, spc, key, cb) STMT_START { \
+	if (opt && (key = hv_fetchs(opt, "out", 0)) && SvOK(*key)) { \
+		dUnpackFormat(_out); \
+		dExtractFormat2(_out, *key, cb); \
+		if (_out.size) { \
+			ctx->f.f = savepvn(_out.f, _out.size); \
+			ctx->f.size = _out.size; \
+			ctx->f.nofree = 0; \
+			ctx->f.def = FMT_UNKNOWN; \
+		} \
+	} else if (spc) { \
+		ctx->f = (spc)->f; \
+		ctx->f.nofree = 1; \
+	} \
+	if (opt && (key = hv_fetchs(opt, "binary", 0)) && SvOK(*key)) { \
+		SV *_err; \
+		if (unlikely(( _err = tnt_binary_format(ctx, spc, *key) ) != NULL)) { \
+			croak_cb(cb, "%s", SvPV_nolen(_err)); \
+		} \
+	} \
+} STMT_END
+
+
+/*
+ * Resolves an entry of a field list: a field number, or a name from the space
+ * format. Strings that are not a field name but read as an integer are field
+ * numbers. Returns an error message or NULL.
+ */
+static SV *tnt_field_no(TntSpace *spc, SV *f, uint32_t *no) {
+	HE *fhe;
+	STRLEN len;
+	const char *pv;
+	UV uv;
+
+	if (SvIOK(f)) {
+		if (SvIV(f) < 0 || (SvIsUV(f) ? SvUV(f) : (UV) SvIV(f)) > UINT32_MAX) {
+			return sv_2mortal(newSVpvf("Bad field number %" SVf, SVfARG(f)));
+		}
+		*no = (uint32_t) SvUV(f);
+		return NULL;
+	}
+	if (spc && spc->field && (fhe = hv_fetch_ent(spc->field, f, 0, 0)) && SvOK(HeVAL(fhe))) {
+		*no = ((TntField *) SvPVX(HeVAL(fhe)))->id;
+		return NULL;
+	}
+	pv = SvPV(f, len);
+	if (len && grok_number(pv, len, &uv) == IS_NUMBER_IN_UV && uv <= UINT32_MAX) {
+		*no = (uint32_t) uv;
+		return NULL;
+	}
+	return sv_2mortal(newSVpvf("Unknown field name: '%s' in space %u", pv, spc ? spc->id : 0));
+}
+
+/* Fields beyond the reply format that `binary => [ ... ]` may name by number */
+#define TNT_BINARY_NO_MAX 1024
+
+/*
+ * Applies `binary => 1` or `binary => [ names or numbers ]` to the reply
+ * format: the given fields (or all string and untyped fields, and fields
+ * beyond the format) are decoded as raw bytes, with no UTF-8 check.
+ * Returns an error message or NULL.
+ */
+static SV *tnt_binary_format(TntCtx *ctx, TntSpace *spc, SV *binary) {
+	AV *list = NULL;
+	uint32_t count = 0, i, no, size = ctx->f.size;
+	uint32_t limit = size > TNT_BINARY_NO_MAX ? size : TNT_BINARY_NO_MAX;
+	uint32_t *nos = NULL;
+	SV **f, *err;
+	char *fmt;
+
+	if (SvROK(binary) && SvTYPE(SvRV(binary)) == SVt_PVAV) {
+		list = (AV *) SvRV(binary);
+		count = av_len(list) + 1;
+		Newx(nos, count ? count : 1, uint32_t);
+		SAVEFREEPV(nos);
+		for (i = 0; i < count; i++) {
+			f = av_fetch(list, i, 0);
+			if (!f || !SvOK(*f)) {
+				return sv_2mortal(newSVpvf("Binary field #%u is undefined", i));
+			}
+			if ((err = tnt_field_no(spc, *f, &nos[i])) != NULL) {
+				return err;
+			}
+			if (nos[i] >= limit) {
+				return sv_2mortal(newSVpvf("Binary field number %u is too large", nos[i]));
+			}
+			if (nos[i] >= size) size = nos[i] + 1;
+		}
+	} else if (!SvTRUE(binary)) {
+		return NULL;
+	}
+
+	if (size == 0) {
+		ctx->f.def = FMT_BINARY;
+		return NULL;
+	}
+
+	fmt = safemalloc(size + 1);
+	for (no = 0; no < size; no++) {
+		fmt[no] = no < ctx->f.size ? ctx->f.f[no] : FMT_UNKNOWN;
+	}
+	fmt[size] = 0;
+	if (list) {
+		for (i = 0; i < count; i++) fmt[nos[i]] = FMT_BINARY;
+	} else {
+		for (no = 0; no < size; no++) {
+			if (fmt[no] == FMT_STRING || fmt[no] == FMT_UNKNOWN) fmt[no] = FMT_BINARY;
+		}
+		ctx->f.def = FMT_BINARY;
+	}
+
+	if (ctx->f.size && !ctx->f.nofree) safefree(ctx->f.f);
+	ctx->f.f = fmt;
+	ctx->f.size = size;
+	ctx->f.nofree = 0;
+	ctx->f.enc = NULL;
+	return NULL;
+}
+
+static int tnt_proj_cmp(const void *a, const void *b) {
+	uint32_t x = ((const TntProj *) a)->no, y = ((const TntProj *) b)->no;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Builds the field projection of `fields => [ ... ]`: entries are field
+ * numbers or names from the space format. The (field, slot) pairs are kept
+ * sorted by field number, so the decoder walks them along with the tuple.
+ * Returns an error message or NULL.
+ */
+static SV *tnt_projection(TntCtx *ctx, TntSpace *spc, AV *list) {
+	uint32_t count = av_len(list) + 1;
+	uint32_t i;
+	TntProj *proj;
+	SV **f, *err;
+
+	if (count == 0) {
+		return sv_2mortal(newSVpvs("Field list is empty"));
+	}
+
+	Newx(proj, count, TntProj);
+	SAVEFREEPV(proj);
+	for (i = 0; i < count; i++) {
+		f = av_fetch(list, i, 0);
+		if (!f || !SvOK(*f)) {
+			return sv_2mortal(newSVpvf("Field #%u is undefined", i));
+		}
+		if ((err = tnt_field_no(spc, *f, &proj[i].no)) != NULL) {
+			return err;
+		}
+		proj[i].slot = i;
+	}
+
+	qsort(proj, count, sizeof(TntProj), tnt_proj_cmp);
+	for (i = 1; i < count; i++) {
+		if (proj[i].no == proj[i - 1].no) {
+			return sv_2mortal(newSVpvf("Field %u is listed twice", proj[i].no));
+		}
+	}
+
+	Newx(ctx->proj, count, TntProj);
+	Copy(proj, ctx->proj, count, TntProj);
+	ctx->proj_count = count;
+	return NULL;
+}
+
+#define evt_opt_chunk(ctx, opt, key) STMT_START { \
+	if ((key = hv_fetchs(opt, "on_chunk", 0)) && SvOK(*key)) { \
+		ctx->on_chunk = SvREFCNT_inc(*key); \
+		ctx->chunk = TNT_CHUNK_DEFAULT; \
+		if ((key = hv_fetchs(opt, "chunk", 0)) && SvOK(*key) && SvUV(*key) > 0) \
+			ctx->chunk = SvUV(*key) < UINT32_MAX ? (uint32_t) SvUV(*key) : UINT32_MAX; \
+	} \
+} STMT_END
+
+#define evt_opt_fields(ctx, opt, spc, key, cb) STMT_START { \
+	if (opt && (key = hv_fetchs(opt, "fields", 0)) && SvOK(*key)) { \
+		SV *_err; \
+		if (unlikely(!SvROK(*key) || SvTYPE(SvRV(*key)) != SVt_PVAV)) { \
+			croak_cb(cb, "Usage { .. fields => [ names or numbers ], .. }"); \
+		} \
+		if (unlikely(( _err = tnt_projection(ctx, spc, (AV *) SvRV(*key)) ) != NULL)) { \
+			croak_cb(cb, "%s", SvPV_nolen(_err)); \
+		} \
+	} \
+} STMT_END
 
 static AV *hash_to_array_fields(HV *hf, AV *fields, bool ignore_missing_fields, SV *cb) {
 	AV *rv = (AV *) sv_2mortal((SV *) newAV());
@@ -325,7 +604,7 @@ static inline update_op_type_t get_update_op_type(const char *op_str, uint32_t l
 	}
 }
 
-static inline SV *pkt_authenticate(uint32_t iid, SV *username, SV *password, const char *const salt_begin, const char *const salt_end, SV *cb) {
+static inline SV *pkt_authenticate(TntCtx *ctx, uint32_t iid, SV *username, SV *password, const char *const salt_begin, const char *const salt_end, SV *cb) {
 	char scramble[SCRAMBLE_SIZE];
 
 	const size_t salt_size = 64;
@@ -334,20 +613,20 @@ static inline SV *pkt_authenticate(uint32_t iid, SV *username, SV *password, con
 
 	unsigned char hash1[SCRAMBLE_SIZE];
 	unsigned char hash2[SCRAMBLE_SIZE];
-	SHA1_CTX ctx;
+	SHA1_CTX sha;
 
-	SHA1Init(&ctx);
-	SHA1Update(&ctx, (const unsigned char *) SvPV_nolen(password), SvCUR(password));
-	SHA1Final(hash1, &ctx);
+	SHA1Init(&sha);
+	SHA1Update(&sha, (const unsigned char *) SvPV_nolen(password), SvCUR(password));
+	SHA1Final(hash1, &sha);
 
-	SHA1Init(&ctx);
-	SHA1Update(&ctx, hash1, SCRAMBLE_SIZE);
-	SHA1Final(hash2, &ctx);
+	SHA1Init(&sha);
+	SHA1Update(&sha, hash1, SCRAMBLE_SIZE);
+	SHA1Final(hash2, &sha);
 
-	SHA1Init(&ctx);
-	SHA1Update(&ctx, (const unsigned char *) salt, SCRAMBLE_SIZE);
-	SHA1Update(&ctx, hash2, SCRAMBLE_SIZE);
-	SHA1Final((unsigned char *) scramble, &ctx);
+	SHA1Init(&sha);
+	SHA1Update(&sha, (const unsigned char *) salt, SCRAMBLE_SIZE);
+	SHA1Update(&sha, hash2, SCRAMBLE_SIZE);
+	SHA1Final((unsigned char *) scramble, &sha);
 
 	for (int i = 0; i < SCRAMBLE_SIZE; ++i) {
 	    scramble[i] = hash1[i] ^ scramble[i];
@@ -362,7 +641,7 @@ static inline SV *pkt_authenticate(uint32_t iid, SV *username, SV *password, con
 	            + 1 + 9  // mp_sizeof_str(9)
 	            + 1 + SCRAMBLE_SIZE // mp_sizeof_str(SCRAMBLE_SIZE)
 	            ;
-	create_buffer(rv, h, sz, TP_AUTH, iid);
+	create_buffer(rv, h, sz, TP_AUTH, iid, 0);
 
 	h = mp_encode_map(h, 2);
 	h = mp_encode_uint(h, TP_USERNAME);
@@ -372,22 +651,18 @@ static inline SV *pkt_authenticate(uint32_t iid, SV *username, SV *password, con
 	h = mp_encode_str(h, "chap-sha1", 9);
 	h = mp_encode_str(h, scramble, SCRAMBLE_SIZE);
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
-	return SvREFCNT_inc(rv);
+	finish_buffer(rv, h);
+	return rv;
 }
 
 
-static inline SV *pkt_ping(uint32_t iid) {
+static inline SV *pkt_ping(TntCtx *ctx, uint32_t iid) {
 	size_t sz = HEADER_CONST_LEN;
 
-	create_buffer(rv, h, sz, TP_PING, iid);
+	create_buffer(rv, h, sz, TP_PING, iid, 0);
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
-	return SvREFCNT_inc(rv);
+	finish_buffer(rv, h);
+	return rv;
 }
 
 static inline SV *pkt_select(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, SV *keys, HV *opt, SV *cb) {
@@ -421,6 +696,10 @@ static inline SV *pkt_select(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 		if ((key = hv_fetchs(opt, "offset", 0)) && SvOK(*key)) offset = SvUV(*key);
 		if ((key = hv_fetchs(opt, "iterator", 0)) && SvOK(*key)) iterator = get_iterator(ctx, *key);
 		if ((key = hv_fetchs(opt, "hash", 0)) ) ctx->use_hash = SvOK(*key) ? SvIV( *key ) : 0;
+		if ((key = hv_fetchs(opt, "compact", 0)) ) ctx->compact = SvTRUE(*key) ? 1 : 0;
+		if ((key = hv_fetchs(opt, "lazy", 0)) ) ctx->lazy = SvTRUE(*key) ? 1 : 0;
+		evt_opt_fields(ctx, opt, spc, key, cb);
+		evt_opt_chunk(ctx, opt, key);
 	} else {
 		ctx->f.size = 0;
 	}
@@ -429,6 +708,7 @@ static inline SV *pkt_select(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 			idx = (TntIndex *) SvPVX(*key);
 		}
 	}
+	evt_opt_out(ctx, opt, spc, key, cb);
 	evt_opt_in(opt, idx, key, format, fmt, cb);
 
 	uint32_t body_map_sz = 3 + (index != -1) + (offset != -1) + (iterator != -1);
@@ -466,14 +746,13 @@ static inline SV *pkt_select(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	} else if (SvROK(t) && SvTYPE(SvRV(t)) == SVt_PVAV) {
 		fields  = (AV *) SvRV(t);
 	} else {
-		if (!ctx->f.nofree) safefree(ctx->f.f);
 		croak_cb(cb, "Input container is invalid. Expecting ARRAYREF or HASHREF");
 	}
 
 	keys_size = av_len(fields) + 1;
 	sz += mp_sizeof_array(keys_size);
 
-	create_buffer(rv, h, sz, TP_SELECT, iid);
+	create_buffer(rv, h, sz, TP_SELECT, iid, ctx->schema_id);
 	h = mp_encode_map(h, body_map_sz);
 	h = mp_encode_uint(h, TP_SPACE);
 	h = mp_encode_uint(h, spc->id);
@@ -499,11 +778,9 @@ static inline SV *pkt_select(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	h = mp_encode_array(h, keys_size);
 	encode_keys(h, sz, fields, keys_size, fmt, key);
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
+	finish_buffer(rv, h);
 
-	return SvREFCNT_inc(rv);
+	return rv;
 }
 
 static inline SV *pkt_insert(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, SV *tuple, HV *opt, SV *cb) {
@@ -526,8 +803,10 @@ static inline SV *pkt_insert(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	if (opt) {
 		if ((key = hv_fetchs(opt, "replace", 0)) && SvOK(*key) && SvIV(*key) != 0) op_code = TP_REPLACE;
 		if ((key = hv_fetchs(opt, "hash", 0)) ) ctx->use_hash = SvOK(*key) ? SvIV( *key ) : 0;
+		if ((key = hv_fetchs(opt, "compact", 0)) ) ctx->compact = SvTRUE(*key) ? 1 : 0;
 	}
 	check_tuple(tuple, spc, cb);
+	evt_opt_out(ctx, opt, spc, key, cb);
 	evt_opt_in(opt, spc, key, format, fmt, cb);
 
 
@@ -551,7 +830,7 @@ static inline SV *pkt_insert(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 
 	sz += mp_sizeof_array(cardinality);
 
-	create_buffer(rv, h, sz, op_code, iid);
+	create_buffer(rv, h, sz, op_code, iid, ctx->schema_id);
 	h = mp_encode_map(h, 2);
 	h = mp_encode_uint(h, TP_SPACE);
 	h = mp_encode_uint(h, spc->id);
@@ -559,11 +838,9 @@ static inline SV *pkt_insert(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	h = mp_encode_array(h, cardinality);
 	encode_keys(h, sz, fields, cardinality, fmt, key);
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
+	finish_buffer(rv, h);
 
-	return SvREFCNT_inc(rv);
+	return rv;
 }
 
 
@@ -579,7 +856,6 @@ static inline char *pkt_update_write_operations(TntCtx *ctx,
 	SV **key;
 
 	if (unlikely( !operations || !SvROK(operations) || (SvTYPE(SvRV(operations)) != SVt_PVAV))) {
-		if (!ctx->f.nofree) safefree(ctx->f.f);
 		croak_cb(cb, "update operations must be ARRAYREF");
 	}
 
@@ -757,6 +1033,7 @@ static inline SV *pkt_update(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 				index = idx->id;
 		}
 		if ((key = hv_fetchs(opt, "hash", 0)) ) ctx->use_hash = SvOK(*key) ? SvIV( *key ) : 0;
+		if ((key = hv_fetchs(opt, "compact", 0)) ) ctx->compact = SvTRUE(*key) ? 1 : 0;
 	} else {
 		ctx->f.size = 0;
 	}
@@ -767,6 +1044,7 @@ static inline SV *pkt_update(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 			idx = (TntIndex *) SvPVX(*key);
 		}
 	}
+	evt_opt_out(ctx, opt, spc, key, cb);
 	evt_opt_in(opt, idx, key, format, fmt, cb);
 
 	uint32_t body_map_sz = 3 + (index != -1);
@@ -794,14 +1072,13 @@ static inline SV *pkt_update(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	} else if (SvROK(t) && SvTYPE(SvRV(t)) == SVt_PVAV) {
 		fields  = (AV *) SvRV(t);
 	} else {
-		if (!ctx->f.nofree) safefree(ctx->f.f);
 		croak_cb(cb, "Input container is invalid. Expecting ARRAYREF or HASHREF");
 	}
 
 	keys_size = av_len(fields) + 1;
 	sz += mp_sizeof_array(keys_size);
 
-	create_buffer(rv, h, sz, TP_UPDATE, iid);
+	create_buffer(rv, h, sz, TP_UPDATE, iid, ctx->schema_id);
 	h = mp_encode_map(h, body_map_sz);
 	h = mp_encode_uint(h, TP_SPACE);
 	h = mp_encode_uint(h, spc->id);
@@ -816,13 +1093,14 @@ static inline SV *pkt_update(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	encode_keys(h, sz, fields, keys_size, fmt, key);
 
 	h = pkt_update_write_operations(ctx, spc, idx, TP_TUPLE, operations, &sz, rv, h, cb);
-	if (!h) return NULL;
+	if (!h) {
+		encbuf_release(rv);
+		return NULL;
+	}
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
+	finish_buffer(rv, h);
 
-	return SvREFCNT_inc(rv);
+	return rv;
 }
 
 
@@ -845,6 +1123,7 @@ static inline SV *pkt_upsert(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 
 	if (opt) {
 		if ((key = hv_fetchs(opt, "hash", 0)) ) ctx->use_hash = SvOK(*key) ? SvIV( *key ) : 0;
+		if ((key = hv_fetchs(opt, "compact", 0)) ) ctx->compact = SvTRUE(*key) ? 1 : 0;
 	} else {
 		ctx->f.size = 0;
 	}
@@ -854,6 +1133,7 @@ static inline SV *pkt_upsert(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 			idx = (TntIndex *) SvPVX(*key);
 		}
 	}
+	evt_opt_out(ctx, opt, spc, key, cb);
 	evt_opt_in(opt, idx, key, format, fmt, cb);
 
 	uint32_t body_map_sz = 3;  // space, tuple and operations
@@ -875,14 +1155,13 @@ static inline SV *pkt_upsert(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	} else if (SvROK(t) && SvTYPE(SvRV(t)) == SVt_PVAV) {
 		fields  = (AV *) SvRV(t);
 	} else {
-		if (!ctx->f.nofree) safefree(ctx->f.f);
 		croak_cb(cb, "Input container is invalid. Expecting ARRAYREF or HASHREF");
 	}
 
 	tuple_size = av_len(fields) + 1;
 	sz += mp_sizeof_array(tuple_size);
 
-	create_buffer(rv, h, sz, TP_UPSERT, iid);
+	create_buffer(rv, h, sz, TP_UPSERT, iid, ctx->schema_id);
 	h = mp_encode_map(h, body_map_sz);
 	h = mp_encode_uint(h, TP_SPACE);
 	h = mp_encode_uint(h, spc->id);
@@ -892,13 +1171,14 @@ static inline SV *pkt_upsert(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	encode_keys(h, sz, fields, tuple_size, fmt, key);
 
 	h = pkt_update_write_operations(ctx, spc, idx, TP_OPERATIONS, operations, &sz, rv, h, cb);
-	if (!h) return NULL;
+	if (!h) {
+		encbuf_release(rv);
+		return NULL;
+	}
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
+	finish_buffer(rv, h);
 
-	return SvREFCNT_inc(rv);
+	return rv;
 }
 
 
@@ -925,6 +1205,7 @@ static inline SV *pkt_delete(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 				index = idx->id;
 		}
 		if ((key = hv_fetchs(opt, "hash", 0)) ) ctx->use_hash = SvOK(*key) ? SvIV( *key ) : 0;
+		if ((key = hv_fetchs(opt, "compact", 0)) ) ctx->compact = SvTRUE(*key) ? 1 : 0;
 	} else {
 		ctx->f.size = 0;
 	}
@@ -935,6 +1216,7 @@ static inline SV *pkt_delete(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 			log_warn(ctx->log_level, "No index %d config. Using without formats", index);
 		}
 	}
+	evt_opt_out(ctx, opt, spc, key, cb);
 	evt_opt_in( opt, idx, key, format, fmt, cb );
 
 	uint32_t body_map_sz = 2 + (index != -1);
@@ -960,14 +1242,13 @@ static inline SV *pkt_delete(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	} else if (SvROK(t) && SvTYPE(SvRV(t)) == SVt_PVAV) {
 		fields  = (AV *) SvRV(t);
 	} else {
-		if (!ctx->f.nofree) safefree(ctx->f.f);
 		croak_cb(cb, "Keys are invalid. Expecting ARRAYREF or HASHREF");
 	}
 
 	keys_size = av_len(fields) + 1;
 	sz += mp_sizeof_array(keys_size);
 
-	create_buffer(rv, h, sz, TP_DELETE, iid);
+	create_buffer(rv, h, sz, TP_DELETE, iid, ctx->schema_id);
 	h = mp_encode_map(h, body_map_sz);
 	h = mp_encode_uint(h, TP_SPACE);
 	h = mp_encode_uint(h, spc->id);
@@ -981,11 +1262,9 @@ static inline SV *pkt_delete(TntCtx *ctx, uint32_t iid, HV *spaces, SV *space, S
 	h = mp_encode_array(h, keys_size);
 	encode_keys(h, sz, fields, keys_size, fmt, key);
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
+	finish_buffer(rv, h);
 
-	return SvREFCNT_inc(rv);
+	return rv;
 }
 
 static inline SV *pkt_eval(TntCtx *ctx, uint32_t iid, HV *spaces, SV *expression, SV *tuple, HV *opt, SV *cb) {
@@ -1005,9 +1284,14 @@ static inline SV *pkt_eval(TntCtx *ctx, uint32_t iid, HV *spaces, SV *expression
 				return NULL;
 			}
 		}
+		if ((key = hv_fetchs(opt, "compact", 0)) ) ctx->compact = SvTRUE(*key) ? 1 : 0;
+		if ((key = hv_fetchs(opt, "lazy", 0)) ) ctx->lazy = SvTRUE(*key) ? 1 : 0;
+		evt_opt_fields(ctx, opt, spc, key, cb);
+		evt_opt_chunk(ctx, opt, key);
 	} else {
 		ctx->f.size = 0;
 	}
+	evt_opt_out(ctx, opt, spc, key, cb);
 	evt_opt_in(opt, idx, key, format, fmt, cb);
 
 	uint32_t body_map_sz = 2;
@@ -1027,7 +1311,6 @@ static inline SV *pkt_eval(TntCtx *ctx, uint32_t iid, HV *spaces, SV *expression
 	          ;
 
 	if (unlikely( !tuple || !SvROK(tuple) || ( (SvTYPE(SvRV(tuple)) != SVt_PVAV) ))) {
-		if (!ctx->f.nofree) safefree(ctx->f.f);
 		croak_cb(cb, "Tuple is invalid. Expecting ARRAYREF");
 	}
 
@@ -1036,7 +1319,7 @@ static inline SV *pkt_eval(TntCtx *ctx, uint32_t iid, HV *spaces, SV *expression
 	keys_size = av_len(fields) + 1;
 	sz += mp_sizeof_array(keys_size);
 
-	create_buffer(rv, h, sz, TP_EVAL, iid);
+	create_buffer(rv, h, sz, TP_EVAL, iid, 0);
 	h = mp_encode_map(h, body_map_sz);
 	h = mp_encode_uint(h, TP_EXPRESSION);
 	h = mp_encode_str(h, (const char *) SvPV_nolen(expression), expression_size);
@@ -1045,11 +1328,9 @@ static inline SV *pkt_eval(TntCtx *ctx, uint32_t iid, HV *spaces, SV *expression
 	h = mp_encode_array(h, keys_size);
 	encode_keys(h, sz, fields, keys_size, fmt, key);
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
+	finish_buffer(rv, h);
 
-	return SvREFCNT_inc(rv);
+	return rv;
 }
 
 static inline SV *pkt_call(TntCtx *ctx, uint32_t iid, HV *spaces, SV *function_name, SV *tuple, HV *opt, SV *cb) {
@@ -1069,9 +1350,14 @@ static inline SV *pkt_call(TntCtx *ctx, uint32_t iid, HV *spaces, SV *function_n
 				return NULL;
 			}
 		}
+		if ((key = hv_fetchs(opt, "compact", 0)) ) ctx->compact = SvTRUE(*key) ? 1 : 0;
+		if ((key = hv_fetchs(opt, "lazy", 0)) ) ctx->lazy = SvTRUE(*key) ? 1 : 0;
+		evt_opt_fields(ctx, opt, spc, key, cb);
+		evt_opt_chunk(ctx, opt, key);
 	} else {
 		ctx->f.size = 0;
 	}
+	evt_opt_out(ctx, opt, spc, key, cb);
 	evt_opt_in(opt, idx, key, format, fmt, cb);
 
 	uint32_t body_map_sz = 2;
@@ -1091,7 +1377,6 @@ static inline SV *pkt_call(TntCtx *ctx, uint32_t iid, HV *spaces, SV *function_n
 	          ;
 
 	if (unlikely( !tuple || !SvROK(tuple) || ( (SvTYPE(SvRV(tuple)) != SVt_PVAV) ))) {
-		if (!ctx->f.nofree) safefree(ctx->f.f);
 		croak_cb(cb, "Tuple is invalid. Expecting ARRAYREF");
 	}
 
@@ -1100,7 +1385,7 @@ static inline SV *pkt_call(TntCtx *ctx, uint32_t iid, HV *spaces, SV *function_n
 	keys_size = av_len(fields) + 1;
 	sz += mp_sizeof_array(keys_size);
 
-	create_buffer(rv, h, sz, TP_CALL, iid);
+	create_buffer(rv, h, sz, TP_CALL, iid, 0);
 	h = mp_encode_map(h, body_map_sz);
 	h = mp_encode_uint(h, TP_FUNCTION);
 	h = mp_encode_str(h, (const char *) SvPVX(function_name), function_name_size);
@@ -1109,11 +1394,9 @@ static inline SV *pkt_call(TntCtx *ctx, uint32_t iid, HV *spaces, SV *function_n
 	h = mp_encode_array(h, keys_size);
 	encode_keys(h, sz, fields, keys_size, fmt, key);
 
-	char *p = SvPVX(rv);
-	write_length(p, h-p-5);
-	SvCUR_set(rv, h-p);
+	finish_buffer(rv, h);
 
-	return SvREFCNT_inc(rv);
+	return rv;
 }
 
 static int parse_reply_hdr(HV *ret, const char *const data, STRLEN size, tnt_header_t *hdr, uint8_t log_level) {
@@ -1173,17 +1456,139 @@ static int parse_reply_hdr(HV *ret, const char *const data, STRLEN size, tnt_hea
 		}
 	}
 
-	(void) hv_stores(ret, "code", newSViv(hdr->code));
-	(void) hv_stores(ret, "sync", newSViv(hdr->id));
-	if (hdr->schema_id > 0) {
-		(void) hv_stores(ret, "schema_id", newSViv(hdr->schema_id));
+	if (ret) {
+		(void) hv_stores(ret, "code", newSViv(hdr->code));
+		(void) hv_stores(ret, "sync", newSViv(hdr->id));
+		if (hdr->schema_id > 0) {
+			(void) hv_stores(ret, "schema_id", newSViv(hdr->schema_id));
+		}
 	}
 
 	return p - data;
 }
 
 
-static inline int parse_reply_body_data(TntCtx *ctx, HV *ret, const char *const data_begin, const char *const data_end, const unpack_format *const format, AV *fields) {
+/*
+ * Decodes n tuples starting at *pp into tuples and advances *pp past them.
+ * With ctx->lazy the raw data must live in buf, which the tuples keep alive.
+ */
+static void decode_tuples(TntCtx *ctx, AV *tuples, const char **pp, uint32_t n, SV *buf, const unpack_format *const format, AV *fields, uint32_t *mismatch) {
+	const char *p = *pp;
+	uint32_t tuple_size = 0;
+	uint32_t i = 0, k = 0;
+
+	if (ctx->lazy) { // tuples decoded on access
+		for (i = 0; i < n; ++i) {
+			if (mp_typeof(*p) != MP_ARRAY) {
+				(void) av_push(tuples, decode_obj(&p));
+				continue;
+			}
+			tuple_size = mp_decode_array(&p);
+			(void) av_push(tuples, tuple_new(buf, p, tuple_size, ctx->space));
+			for (k = 0; k < tuple_size; ++k) {
+				mp_next(&p);
+			}
+		}
+
+	} else if (ctx->proj) { // only the requested fields
+		SV **name;
+		uint32_t j;
+		uint32_t known_tuple_size = fields ? av_len(fields) + 1 : 0;
+		for (i = 0; i < n; ++i) {
+			if (mp_typeof(*p) != MP_ARRAY) {
+				(void) av_push(tuples, decode_obj(&p));
+				continue;
+			}
+			tuple_size = mp_decode_array(&p);
+
+			if (fields) {
+				HV *tuple = newHV();
+				av_push(tuples, newRV_noinc((SV *) tuple));
+				hv_ksplit(tuple, ctx->proj_count);
+				for (k = 0, j = 0; k < tuple_size; ++k) {
+					int wanted = j < ctx->proj_count && ctx->proj[j].no == k;
+					if (wanted) ++j;
+					if (wanted && k < known_tuple_size && (name = av_fetch(fields, k, 0)) && *name) {
+						(void) hv_store_ent(tuple, *name, decode_field(&p, format_at(format, k), mismatch), 0);
+					} else {
+						mp_next(&p);
+					}
+				}
+			} else {
+				AV *tuple = newAV();
+				av_push(tuples, newRV_noinc((SV *) tuple));
+				av_fill(tuple, ctx->proj_count - 1);
+				for (k = 0, j = 0; k < tuple_size; ++k) {
+					if (j < ctx->proj_count && ctx->proj[j].no == k) {
+						(void) av_store(tuple, ctx->proj[j++].slot, decode_field(&p, format_at(format, k), mismatch));
+					} else {
+						mp_next(&p);
+					}
+				}
+			}
+		}
+
+	} else if (fields) { // using space definition
+		uint32_t known_tuple_size = av_len(fields) + 1;
+		SV **name;
+		for (i = 0; i < n; ++i) {
+			if (mp_typeof(*p) != MP_ARRAY) {
+				(void) av_push(tuples, decode_obj(&p));
+				continue;
+			}
+			HV *tuple = newHV();
+			AV *unknown_fields = NULL;
+			av_push(tuples, newRV_noinc((SV *)tuple));
+			hv_ksplit(tuple, known_tuple_size);
+
+			tuple_size = mp_decode_array(&p);
+
+			for (k = 0; k < tuple_size; ++k) {
+				SV *field_value = decode_field(&p, format_at(format, k), mismatch);
+
+				if (k < known_tuple_size && (name = av_fetch(fields, k, 0)) && *name) {
+					(void) hv_store_ent(tuple, *name, field_value, 0);
+				} else {
+					// cwarn("Field name for field %d is not defined", k);
+					if (unknown_fields == NULL) {
+						unknown_fields = newAV();
+					}
+					av_push(unknown_fields, field_value);
+				}
+			}
+
+			if (unknown_fields != NULL) {
+				(void) hv_stores(tuple, "", newRV_noinc((SV *) unknown_fields));
+			}
+		}
+
+	} else if (format && format->size) {  // typed arrays
+		for (i = 0; i < n; ++i) {
+			if (mp_typeof(*p) != MP_ARRAY) {
+				(void) av_push(tuples, decode_obj(&p));
+				continue;
+			}
+			tuple_size = mp_decode_array(&p);
+
+			AV *tuple = newAV();
+			av_push(tuples, newRV_noinc((SV *) tuple));
+			av_extend(tuple, tuple_size);
+			for (k = 0; k < tuple_size; ++k) {
+				av_push(tuple, decode_field(&p, format_at(format, k), mismatch));
+			}
+		}
+
+	} else {  // without space definition
+		for (i = 0; i < n; ++i) {
+			(void) av_push(tuples, decode_obj(&p));
+			// assert(p <= data_end);
+		}
+	}
+
+	*pp = p;
+}
+
+static inline int parse_reply_body_data(TntCtx *ctx, TntResult *res, const char *const data_begin, const char *const data_end, const unpack_format *const format, AV *fields) {
 	STRLEN data_size = data_end - data_begin;
 	if (data_size == 0)
 		return 0;
@@ -1196,52 +1601,28 @@ static inline int parse_reply_body_data(TntCtx *ctx, HV *ret, const char *const
 	case MP_ARRAY: {
 		cont_size = mp_decode_array(&p);
 		// cwarn("tuples count = %d", cont_size);
+		res->count = cont_size;
+
+		if (ctx->on_chunk) { // decoded later, chunk by chunk
+			res->rest = p;
+			res->rest_end = data_end;
+			break;
+		}
 
 		AV *tuples = newAV();
 		av_extend(tuples, cont_size);
-		(void) hv_stores(ret, "count", newSViv(cont_size));
-		(void) hv_stores(ret, "tuples", newRV_noinc((SV *) tuples));
+		res->tuples = tuples;
 
-		uint32_t tuple_size = 0;
-		uint32_t i = 0, k = 0;
-		if (fields) { // using space definition
-			uint32_t known_tuple_size = av_len(fields) + 1;
-			SV **name;
-			for (i = 0; i < cont_size; ++i) {
-				if (mp_typeof(*p) != MP_ARRAY) {
-					(void) av_push(tuples, decode_obj(&p));
-					continue;
-				}
-				HV *tuple = newHV();
-				AV *unknown_fields = NULL;
-				av_push(tuples, newRV_noinc((SV *)tuple));
-
-				tuple_size = mp_decode_array(&p);
-
-				for (k = 0; k < tuple_size; ++k) {
-					SV *field_value = decode_obj(&p);
-
-					if (k < known_tuple_size && (name = av_fetch(fields, k, 0)) && *name) {
-						(void) hv_store(tuple, SvPV_nolen(*name), sv_len(*name), field_value, 0);
-					} else {
-						// cwarn("Field name for field %d is not defined", k);
-						if (unknown_fields == NULL) {
-							unknown_fields = newAV();
-						}
-						av_push(unknown_fields, field_value);
-					}
-				}
-
-				if (unknown_fields != NULL) {
-					(void) hv_stores(tuple, "", newRV_noinc((SV *) unknown_fields));
-				}
-			}
+		SV *buf = NULL;
+		uint32_t mismatch = 0;
+		if (ctx->lazy) { // tuples decoded on access
+			buf = sv_2mortal(newSVpvn(p, data_end - p));
+			p = SvPVX(buf);
+		}
+		decode_tuples(ctx, tuples, &p, cont_size, buf, format, fields, &mismatch);
 
-		} else {  // without space definition
-			for (i = 0; i < cont_size; ++i) {
-				(void) av_push(tuples, decode_obj(&p));
-				// assert(p <= data_end);
-			}
+		if (unlikely(mismatch)) {
+			log_warn(ctx->log_level, "%u values in reply do not match format '%.*s'", mismatch, (int) format->size, format->f);
 		}
 
 		break;
@@ -1314,7 +1695,7 @@ static inline int parse_spaces_body_data(HV *ret, const char *const data_begin,
 		cont_size = mp_decode_array(&p);
 		// cwarn("tuples count = %d", cont_size);
 
-		HV *data = newHV();
+		HV *data = spaces_new();
 
 		(void) hv_stores(ret, "count", newSViv(cont_size));
 		(void) hv_stores(ret, "data", newRV_noinc((SV *) data));
@@ -1382,7 +1763,8 @@ static inline int parse_spaces_body_data(HV *ret, const char *const data_begin,
 
 						if (str_len == 4 && strncasecmp(str, "name", 4) == 0) {
 							str = mp_decode_str(&p, &str_len); // getting the name itself
-							field_name = sv_2mortal(newSVpvn(str, str_len));
+							/* shared key: hashed once, reused by every hv_store_ent of a tuple */
+							field_name = sv_2mortal(newSVpvn_share(str, str_len, 0));
 							field_name_len = str_len;
 						}
 						else
@@ -1415,6 +1797,7 @@ static inline int parse_spaces_body_data(HV *ret, const char *const data_begin,
 					// cwarn("field_name = %.*s", SvCUR(field_name), SvPV_nolen(field_name));
 					av_push(spc->fields, SvREFCNT_inc_NN(field_name));
 				}
+				spc->f.enc = enc_compile(spc->f.f, spc->f.size);
 			}
 
 			(void) hv_store(data, (char *) &id, sizeof(U32), spcf, 0);
@@ -1481,6 +1864,8 @@ static inline int parse_index_body_data(HV *spaces, const char *const data_begin
 				idx->f.def = FMT_UNKNOWN;
 				idx->fields = newAV();
 				av_extend(idx->fields, parts_count);
+				idx->parts_count = parts_count;
+				Newx(idx->parts, parts_count ? parts_count : 1, uint32_t);
 
 				uint32_t part_i = 0;
 				int32_t ix = -1;
@@ -1534,6 +1919,7 @@ static inline int parse_index_body_data(HV *spaces, const char *const data_begin
 						part_format = FMT_UNKNOWN;
 					}
 					idx->f.f[part_i] = part_format;
+					idx->parts[part_i] = (uint32_t) ix;
 
 					SV **f = av_fetch(spc->fields, ix, 0);
 					if (f) {
@@ -1546,6 +1932,7 @@ static inline int parse_index_body_data(HV *spaces, const char *const data_begin
 						log_info(log_level, "The field %d of space %.*s is not in space format information", ix, (int) SvCUR(spc->name), SvPV_nolen(spc->name));
 					}
 				}
+				idx->f.enc = enc_compile(idx->f.f, idx->f.size);
 
 
 				(void) hv_store(spc->indexes, (char *) &index_id, sizeof(uint32_t), idxcf, 0);
@@ -1566,7 +1953,7 @@ static inline int parse_index_body_data(HV *spaces, const char *const data_begin
 	return 0;
 }
 
-static int parse_reply_body(TntCtx *ctx, HV *ret, const char *const data, STRLEN size, const unpack_format *const format, AV *fields) {
+static int parse_reply_body(TntCtx *ctx, TntResult *res, const char *const data, STRLEN size, const unpack_format *const format, AV *fields) {
 	const char *p = data;
 	const char *test = p;
 	// body
@@ -1595,8 +1982,9 @@ static int parse_reply_body(TntCtx *ctx, HV *ret, const char *const data, STRLEN
 			uint32_t elen = 0;
 			const char *err_str = mp_decode_str(&p, &elen);
 
-			(void) hv_stores(ret, "status", newSVpvs("error"));
-			(void) hv_stores(ret, "errstr", newSVpvn(err_str, elen));
+			res->status = TNT_RES_ERROR;
+			if (res->errstr) SvREFCNT_dec(res->errstr);
+			res->errstr = newSVpvn(err_str, elen);
 			break;
 		}
 
@@ -1606,10 +1994,10 @@ static int parse_reply_body(TntCtx *ctx, HV *ret, const char *const data, STRLEN
 				return -1;
 			}
 
-			(void) hv_stores(ret, "status", newSVpvs("ok"));
+			res->status = TNT_RES_OK;
 			const char *data_begin = p;
 			mp_next(&p);
-			parse_reply_body_data(ctx, ret, data_begin, p, format, fields);
+			parse_reply_body_data(ctx, res, data_begin, p, format, fields);
 			break;
 		}
 